@@ -1,15 +1,27 @@
 #pragma once
-#include <unordered_map>
 #include <fstream>
 #include <mutex>
 #include <algorithm>
 #include <assert.h>
+#include "label_map.h"
 
 namespace hnswlib {
 template<typename dist_t>
 class BruteforceSearch : public AlgorithmInterface<dist_t> {
  public:
+    // Files written by saveIndex start with this marker, files without it
+    // use the original interleaved (vector, label) layout.
+    static const size_t FORMAT_MAGIC = 0x31584446455242ULL;  // "BREFDX1"
+    static const size_t FORMAT_VERSION = 2;
+    // saveIndex/loadIndex move data in blocks of this size
+    static const size_t IO_BLOCK_SIZE = 4 * 1024 * 1024;
+
+    // Structure-of-arrays storage: vectors are kept in one contiguous,
+    // cache-line aligned matrix (row `i` at data_ + i * size_per_element_)
+    // and their labels in a parallel array, so a scan streams through
+    // vector data only.
     char *data_;
+    labeltype *labels_;
     size_t maxelements_;
     size_t cur_element_count;
     size_t size_per_element_;
@@ -19,11 +31,12 @@ class BruteforceSearch : public AlgorithmInterface<dist_t> {
     void *dist_func_param_;
     std::mutex index_lock;
 
-    std::unordered_map<labeltype, size_t > dict_external_to_internal;
+    LabelMap dict_external_to_internal;
 
 
     BruteforceSearch(SpaceInterface <dist_t> *s)
         : data_(nullptr),
+            labels_(nullptr),
             maxelements_(0),
             cur_element_count(0),
             size_per_element_(0),
@@ -32,32 +45,46 @@ class BruteforceSearch : public AlgorithmInterface<dist_t> {
     }
 
 
-    BruteforceSearch(SpaceInterface<dist_t> *s, const std::string &location)
+    BruteforceSearch(SpaceInterface<dist_t> *s, const std::string &location, size_t max_elements = 0)
         : data_(nullptr),
+            labels_(nullptr),
             maxelements_(0),
             cur_element_count(0),
             size_per_element_(0),
             data_size_(0),
             dist_func_param_(nullptr) {
-        loadIndex(location, s);
+        loadIndex(location, s, max_elements);
     }
 
 
-    BruteforceSearch(SpaceInterface <dist_t> *s, size_t maxElements) {
+    BruteforceSearch(SpaceInterface <dist_t> *s, size_t maxElements)
+        : data_(nullptr),
+            labels_(nullptr) {
         maxelements_ = maxElements;
         data_size_ = s->get_data_size();
         fstdistfunc_ = s->get_dist_func();
         dist_func_param_ = s->get_dist_func_param();
-        size_per_element_ = data_size_ + sizeof(labeltype);
-        data_ = (char *) malloc(maxElements * size_per_element_);
-        if (data_ == nullptr)
-            throw std::runtime_error("Not enough memory: BruteforceSearch failed to allocate data");
+        size_per_element_ = data_size_;
+        allocateStorage(maxElements);
         cur_element_count = 0;
     }
 
 
     ~BruteforceSearch() {
-        free(data_);
+        alignedFree(data_);
+        free(labels_);
+    }
+
+
+    void allocateStorage(size_t maxElements) {
+        if (maxElements >= LabelMap::EMPTY)
+            throw std::runtime_error("The number of elements exceeds the range of internal ids");
+        data_ = (char *) alignedMalloc(maxElements * size_per_element_);
+        if (data_ == nullptr)
+            throw std::runtime_error("Not enough memory: BruteforceSearch failed to allocate data");
+        labels_ = (labeltype *) malloc(std::max(maxElements, (size_t)1) * sizeof(labeltype));
+        if (labels_ == nullptr)
+            throw std::runtime_error("Not enough memory: BruteforceSearch failed to allocate labels");
     }
 
 
@@ -66,19 +93,20 @@ class BruteforceSearch : public AlgorithmInterface<dist_t> {
         {
             std::unique_lock<std::mutex> lock(index_lock);
 
-            auto search = dict_external_to_internal.find(label);
-            if (search != dict_external_to_internal.end()) {
-                idx = search->second;
+            uint32_t found;
+            if (dict_external_to_internal.find(label, found)) {
+                idx = found;
             } else {
                 if (cur_element_count >= maxelements_) {
                     throw std::runtime_error("The number of elements exceeds the specified limit\n");
                 }
                 idx = cur_element_count;
-                dict_external_to_internal[label] = idx;
+                if (!dict_external_to_internal.set(label, idx))
+                    throw std::runtime_error("Not enough memory: addPoint failed to grow the label lookup");
                 cur_element_count++;
             }
         }
-        memcpy(data_ + size_per_element_ * idx + data_size_, &label, sizeof(labeltype));
+        labels_[idx] = label;
         memcpy(data_ + size_per_element_ * idx, datapoint, data_size_);
     }
 
@@ -86,19 +114,22 @@ class BruteforceSearch : public AlgorithmInterface<dist_t> {
     void removePoint(labeltype cur_external) {
         std::unique_lock<std::mutex> lock(index_lock);
 
-        auto found = dict_external_to_internal.find(cur_external);
-        if (found == dict_external_to_internal.end()) {
+        uint32_t found;
+        if (!dict_external_to_internal.find(cur_external, found)) {
             return;
         }
 
-        size_t cur_c = found->second;
-        dict_external_to_internal.erase(found);
+        size_t cur_c = found;
+        dict_external_to_internal.erase(cur_external);
 
-        labeltype label = *((labeltype*)(data_ + size_per_element_ * (cur_element_count-1) + data_size_));
-        dict_external_to_internal[label] = cur_c;
-        memcpy(data_ + size_per_element_ * cur_c,
-                data_ + size_per_element_ * (cur_element_count-1),
-                data_size_+sizeof(labeltype));
+        // move the last row into the hole so that both arrays stay dense
+        size_t last = cur_element_count - 1;
+        if (cur_c != last) {
+            labeltype label = labels_[last];
+            dict_external_to_internal.set(label, cur_c);
+            labels_[cur_c] = label;
+            memcpy(data_ + size_per_element_ * cur_c, data_ + size_per_element_ * last, data_size_);
+        }
         cur_element_count--;
     }
 
@@ -108,18 +139,22 @@ class BruteforceSearch : public AlgorithmInterface<dist_t> {
         assert(k <= cur_element_count);
         std::priority_queue<std::pair<dist_t, labeltype >> topResults;
         if (cur_element_count == 0) return topResults;
-        for (int i = 0; i < k; i++) {
-            dist_t dist = fstdistfunc_(query_data, data_ + size_per_element_ * i, dist_func_param_);
-            labeltype label = *((labeltype*) (data_ + size_per_element_ * i + data_size_));
+        const char *row = data_;
+        for (int i = 0; i < k; i++, row += size_per_element_) {
+            dist_t dist = fstdistfunc_(query_data, row, dist_func_param_);
+            labeltype label = labels_[i];
             if ((!isIdAllowed) || (*isIdAllowed)(label)) {
                 topResults.emplace(dist, label);
             }
         }
         dist_t lastdist = topResults.empty() ? std::numeric_limits<dist_t>::max() : topResults.top().first;
-        for (int i = k; i < cur_element_count; i++) {
-            dist_t dist = fstdistfunc_(query_data, data_ + size_per_element_ * i, dist_func_param_);
+        for (int i = k; i < cur_element_count; i++, row += size_per_element_) {
+#ifdef USE_SSE
+            _mm_prefetch(row + 4 * size_per_element_, _MM_HINT_T0);
+#endif
+            dist_t dist = fstdistfunc_(query_data, row, dist_func_param_);
             if (dist <= lastdist) {
-                labeltype label = *((labeltype *) (data_ + size_per_element_ * i + data_size_));
+                labeltype label = labels_[i];
                 if ((!isIdAllowed) || (*isIdAllowed)(label)) {
                     topResults.emplace(dist, label);
                 }
@@ -136,38 +171,123 @@ class BruteforceSearch : public AlgorithmInterface<dist_t> {
 
 
     void saveIndex(const std::string &location) {
-        std::ofstream output(location, std::ios::binary);
-        std::streampos position;
+        std::vector<char> buffer(IO_BLOCK_SIZE);
+        std::ofstream output;
+        output.rdbuf()->pubsetbuf(buffer.data(), buffer.size());
+        output.open(location, std::ios::binary);
+        if (!output.is_open())
+            throw std::runtime_error("Cannot open file");
+        saveIndex(output);
+        output.close();
+        if (output.fail())
+            throw std::runtime_error("Cannot write index file");
+    }
+
 
+    void saveIndex(std::ostream &output) {
+        writeBinaryPOD(output, FORMAT_MAGIC);
+        writeBinaryPOD(output, FORMAT_VERSION);
         writeBinaryPOD(output, maxelements_);
         writeBinaryPOD(output, size_per_element_);
         writeBinaryPOD(output, cur_element_count);
 
-        output.write(data_, maxelements_ * size_per_element_);
-
-        output.close();
+        // only the live rows are written, the capacity is restored from the header
+        writeBlocks(output, data_, cur_element_count * size_per_element_);
+        writeBlocks(output, (const char *) labels_, cur_element_count * sizeof(labeltype));
+        if (output.fail())
+            throw std::runtime_error("Cannot write index file");
     }
 
 
-    void loadIndex(const std::string &location, SpaceInterface<dist_t> *s) {
-        std::ifstream input(location, std::ios::binary);
-        std::streampos position;
+    /*
+    * Loads an index saved by saveIndex. The index is allocated with room for
+    * `max_elements` vectors, or for the saved capacity if `max_elements` is
+    * smaller than the number of stored vectors.
+    */
+    void loadIndex(const std::string &location, SpaceInterface<dist_t> *s, size_t max_elements = 0) {
+        std::vector<char> buffer(IO_BLOCK_SIZE);
+        std::ifstream input;
+        input.rdbuf()->pubsetbuf(buffer.data(), buffer.size());
+        input.open(location, std::ios::binary);
+
+        if (!input.is_open())
+            throw std::runtime_error("Cannot open file");
+        loadIndex(input, s, max_elements);
+        input.close();
+    }
+
 
-        readBinaryPOD(input, maxelements_);
+    void loadIndex(std::istream &input, SpaceInterface<dist_t> *s, size_t max_elements = 0) {
+        size_t magic = 0;
+        size_t version = 0;
+        readBinaryPOD(input, magic);
+        if (magic == FORMAT_MAGIC) {
+            readBinaryPOD(input, version);
+            if (version < 1 || version > FORMAT_VERSION)
+                throw std::runtime_error("Unsupported bruteforce index format version");
+            readBinaryPOD(input, maxelements_);
+        } else {
+            maxelements_ = magic;
+        }
         readBinaryPOD(input, size_per_element_);
         readBinaryPOD(input, cur_element_count);
+        if (!input.good() || cur_element_count > maxelements_)
+            throw std::runtime_error("Index seems to be corrupted or unsupported");
 
         data_size_ = s->get_data_size();
         fstdistfunc_ = s->get_dist_func();
         dist_func_param_ = s->get_dist_func_param();
-        size_per_element_ = data_size_ + sizeof(labeltype);
-        data_ = (char *) malloc(maxelements_ * size_per_element_);
-        if (data_ == nullptr)
-            throw std::runtime_error("Not enough memory: loadIndex failed to allocate data");
+        size_t stored_size_per_element = size_per_element_;
+        size_t stored_max_elements = maxelements_;
+        if (max_elements >= cur_element_count)
+            maxelements_ = max_elements;
+        size_per_element_ = data_size_;
+        allocateStorage(maxelements_);
+
+        if (magic != FORMAT_MAGIC) {
+            // the original layout interleaves each vector with its label
+            if (stored_size_per_element != data_size_ + sizeof(labeltype))
+                throw std::runtime_error("Index seems to be corrupted or unsupported");
+            for (size_t i = 0; i < cur_element_count; i++) {
+                input.read(data_ + i * size_per_element_, data_size_);
+                readBinaryPOD(input, labels_[i]);
+            }
+        } else {
+            if (stored_size_per_element != data_size_)
+                throw std::runtime_error("Index seems to be corrupted or unsupported");
+            // version 1 files store the whole capacity of both arrays
+            size_t stored_rows = version == 1 ? stored_max_elements : cur_element_count;
+            readBlocks(input, data_, cur_element_count * size_per_element_);
+            input.seekg((stored_rows - cur_element_count) * size_per_element_, input.cur);
+            readBlocks(input, (char *) labels_, cur_element_count * sizeof(labeltype));
+        }
+        if (input.fail())
+            throw std::runtime_error("Index seems to be corrupted or unsupported");
+
+        dict_external_to_internal.clear();
+        if (!dict_external_to_internal.reserve(cur_element_count))
+            throw std::runtime_error("Not enough memory: loadIndex failed to allocate the label lookup");
+        for (size_t i = 0; i < cur_element_count; i++) {
+            dict_external_to_internal.set(labels_[i], i);
+        }
+    }
 
-        input.read(data_, maxelements_ * size_per_element_);
 
-        input.close();
+    static void writeBlocks(std::ostream &out, const char *data, size_t size) {
+        for (size_t offset = 0; offset < size; offset += IO_BLOCK_SIZE) {
+            out.write(data + offset, std::min(IO_BLOCK_SIZE, size - offset));
+        }
+    }
+
+
+    static void readBlocks(std::istream &in, char *data, size_t size) {
+        for (size_t offset = 0; offset < size && in.good(); offset += IO_BLOCK_SIZE) {
+            in.read(data + offset, std::min(IO_BLOCK_SIZE, size - offset));
+        }
     }
 };
+
+template<typename dist_t> const size_t BruteforceSearch<dist_t>::FORMAT_MAGIC;
+template<typename dist_t> const size_t BruteforceSearch<dist_t>::FORMAT_VERSION;
+template<typename dist_t> const size_t BruteforceSearch<dist_t>::IO_BLOCK_SIZE;
 }  // namespace hnswlib
@@ -0,0 +1,292 @@
+#pragma once
+
+#include <atomic>
+#include <algorithm>
+#include <limits>
+#include <new>
+#include <type_traits>
+#include <vector>
+#include <string.h>
+#include <stdlib.h>
+#include "page_memory.h"
+
+namespace hnswlib {
+/*
+ * Storage for a growable number of elements of `width` values of type T each.
+ *
+ * In flat mode all elements live in a single block and resize() reallocates it,
+ * so it must not run while other threads read the array.
+ *
+ * In segmented mode elements are stored in chunks of 2^chunk_shift elements that
+ * are reached through a small directory. Chunks never move: growing only allocates
+ * new chunks and, once the directory is full, publishes a larger copy of it. The
+ * replaced directories are kept until release(), so readers are never left with
+ * freed memory and resize() only has to be serialized with other resizes.
+ *
+ * attach() serves the elements from a block owned by someone else, e.g. a
+ * memory-mapped file. Such an array cannot be resized.
+ *
+ * Blocks and chunks of trivial types are placed according to the MemoryFlags
+ * given to init().
+ */
+template<typename T>
+class ChunkedArray {
+ public:
+    static const size_t FLAT = sizeof(size_t) * 8 - 1;
+
+ private:
+    struct Directory {
+        size_t size;
+        T *chunks[1];
+    };
+
+    size_t width_{1};
+    size_t shift_{FLAT};
+    size_t mask_{~(size_t) 0};
+    size_t capacity_{0};
+    size_t chunk_count_{0};
+    bool owned_{true};
+    int memory_flags_{MEMORY_DEFAULT};
+    std::atomic<Directory *> directory_{nullptr};
+    std::vector<Directory *> retired_;
+    T *block_{nullptr};  // the single block in flat mode, so that at() skips the directory
+
+ public:
+    ChunkedArray() {}
+
+    ChunkedArray(const ChunkedArray &) = delete;
+    ChunkedArray &operator=(const ChunkedArray &) = delete;
+
+    ~ChunkedArray() {
+        release();
+    }
+
+
+    /*
+    * Allocates room for `capacity` elements, dropping the previous contents.
+    * Returns false when out of memory.
+    */
+    bool init(size_t capacity, size_t width = 1, size_t chunk_shift = FLAT, int memory_flags = MEMORY_DEFAULT) {
+        release();
+        width_ = std::max(width, (size_t) 1);
+        shift_ = chunk_shift;
+        memory_flags_ = memory_flags;
+        mask_ = segmented() ? ((size_t) 1 << shift_) - 1 : ~(size_t) 0;
+
+        Directory *dir = newDirectory(1);
+        if (dir == nullptr)
+            return false;
+        directory_.store(dir);
+        if (segmented())
+            return resize(capacity);
+
+        if (!validCapacity(capacity) || (dir->chunks[0] = newChunk(capacity)) == nullptr)
+            return false;
+        block_ = dir->chunks[0];
+        chunk_count_ = 1;
+        capacity_ = capacity;
+        return true;
+    }
+
+
+    /*
+    * Serves `capacity` elements from `block` without copying or taking ownership of it.
+    */
+    bool attach(T *block, size_t capacity, size_t width = 1) {
+        release();
+        width_ = std::max(width, (size_t) 1);
+        shift_ = FLAT;
+        mask_ = ~(size_t) 0;
+
+        Directory *dir = newDirectory(1);
+        if (dir == nullptr)
+            return false;
+        dir->chunks[0] = block;
+        directory_.store(dir);
+        block_ = block;
+        chunk_count_ = 1;
+        capacity_ = capacity;
+        owned_ = false;
+        return true;
+    }
+
+
+    /*
+    * Changes the capacity, keeping the elements below the new capacity.
+    * In flat mode values that are not trivially copyable (e.g. locks) are
+    * replaced by new ones. Returns false when out of memory.
+    */
+    bool resize(size_t capacity) {
+        Directory *dir = directory_.load();
+        if (dir == nullptr || !owned_ || !validCapacity(capacity))
+            return false;
+
+        if (!segmented()) {
+            T *block = resizeBlock(dir->chunks[0], capacity_, capacity);
+            if (block == nullptr)
+                return false;
+            dir->chunks[0] = block;
+            block_ = block;
+            capacity_ = capacity;
+            return true;
+        }
+
+        size_t chunks = (capacity + mask_) >> shift_;
+        if (chunks > dir->size) {
+            Directory *bigger = newDirectory(std::max(chunks, dir->size * 2));
+            if (bigger == nullptr)
+                return false;
+            memcpy(bigger->chunks, dir->chunks, chunk_count_ * sizeof(T *));
+            retired_.push_back(dir);
+            directory_.store(bigger, std::memory_order_release);
+            dir = bigger;
+        }
+        while (chunk_count_ < chunks) {
+            T *chunk = newChunk(chunkSize());
+            if (chunk == nullptr)
+                return false;
+            dir->chunks[chunk_count_++] = chunk;
+        }
+        while (chunk_count_ > chunks) {
+            chunk_count_--;
+            deleteChunk(dir->chunks[chunk_count_], chunkSize());
+            dir->chunks[chunk_count_] = nullptr;
+        }
+        capacity_ = capacity;
+        return true;
+    }
+
+
+    void release() {
+        Directory *dir = directory_.load();
+        if (dir) {
+            size_t size = segmented() ? chunkSize() : capacity_;
+            for (size_t i = 0; i < chunk_count_ && owned_; i++) {
+                deleteChunk(dir->chunks[i], size);
+            }
+            free(dir);
+        }
+        for (Directory *retired : retired_) {
+            free(retired);
+        }
+        retired_.clear();
+        directory_.store(nullptr);
+        block_ = nullptr;
+        chunk_count_ = 0;
+        capacity_ = 0;
+        owned_ = true;
+    }
+
+
+    inline T *at(size_t i) const {
+        if (!segmented())
+            return block_ + i * width_;
+        Directory *dir = directory_.load(std::memory_order_acquire);
+        return dir->chunks[i >> shift_] + (i & mask_) * width_;
+    }
+
+
+    inline T &operator[](size_t i) const {
+        return *at(i);
+    }
+
+
+    /*
+    * Same as at(), but returns nullptr for elements that were never allocated
+    * instead of reading past the directory. Meant for prefetching ids that may
+    * be garbage.
+    */
+    inline T *find(size_t i) const {
+        Directory *dir = directory_.load(std::memory_order_acquire);
+        size_t chunk = i >> shift_;
+        if (chunk >= dir->size || dir->chunks[chunk] == nullptr)
+            return nullptr;
+        return dir->chunks[chunk] + (i & mask_) * width_;
+    }
+
+
+    /*
+    * Calls fn(pointer, count) for each contiguous run of the elements in [begin, end).
+    */
+    template<typename Function>
+    void forEachRun(size_t begin, size_t end, Function fn) const {
+        while (begin < end) {
+            size_t run_end = segmented() ? std::min(end, ((begin >> shift_) + 1) << shift_) : end;
+            fn(at(begin), run_end - begin);
+            begin = run_end;
+        }
+    }
+
+
+    bool segmented() const {
+        return shift_ != FLAT;
+    }
+
+
+    size_t capacity() const {
+        return capacity_;
+    }
+
+
+    // number of elements per chunk, only meaningful in segmented mode
+    size_t chunkSize() const {
+        return (size_t) 1 << shift_;
+    }
+
+ private:
+    bool validCapacity(size_t capacity) const {
+        size_t slack = segmented() ? chunkSize() : 0;
+        return capacity <= std::numeric_limits<size_t>::max() / (width_ * sizeof(T)) - slack;
+    }
+
+
+    static Directory *newDirectory(size_t size) {
+        Directory *dir = (Directory *) calloc(1, sizeof(Directory) + (size - 1) * sizeof(T *));
+        if (dir)
+            dir->size = size;
+        return dir;
+    }
+
+
+    T *newChunk(size_t elements) const {
+        size_t count = std::max(elements, (size_t) 1) * width_;
+        if (std::is_trivial<T>::value)
+            return (T *) allocateMemory(count * sizeof(T), memory_flags_);
+        T *chunk = (T *) malloc(count * sizeof(T));
+        if (chunk) {
+            for (size_t i = 0; i < count; i++) {
+                new (chunk + i) T();
+            }
+        }
+        return chunk;
+    }
+
+
+    void deleteChunk(T *chunk, size_t elements) const {
+        size_t count = std::max(elements, (size_t) 1) * width_;
+        if (std::is_trivial<T>::value) {
+            freeMemory(chunk, count * sizeof(T), memory_flags_);
+            return;
+        }
+        if (chunk) {
+            for (size_t i = 0; i < count; i++) {
+                chunk[i].~T();
+            }
+        }
+        free(chunk);
+    }
+
+
+    T *resizeBlock(T *block, size_t from, size_t to) const {
+        if (std::is_trivial<T>::value)
+            return (T *) reallocateMemory(block, std::max(from, (size_t) 1) * width_ * sizeof(T),
+                std::max(to, (size_t) 1) * width_ * sizeof(T), memory_flags_);
+        T *fresh = newChunk(to);
+        if (fresh)
+            deleteChunk(block, from);
+        return fresh;
+    }
+};
+
+template<typename T> const size_t ChunkedArray<T>::FLAT;
+}  // namespace hnswlib
@@ -0,0 +1,167 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#if defined(__x86_64__) || defined(_M_X64)
+#define HNSWLIB_CRC32C_SSE42
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#include <nmmintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#define HNSWLIB_CRC32C_ARM
+#include <arm_acle.h>
+#endif
+
+namespace hnswlib {
+/*
+ * CRC-32C (Castagnoli). Passing the result of a previous call as `crc`
+ * continues the checksum, so crc32c(b, nb, crc32c(a, na)) is the checksum of
+ * a followed by b.
+ *
+ * Uses the SSE 4.2 crc32 instruction when the CPU has it and the ARMv8 CRC
+ * instructions when the compiler targets them, otherwise a table built on
+ * first use, one byte at a time.
+ */
+struct Crc32cTable {
+    uint32_t values[256];
+
+    Crc32cTable() {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t crc = i;
+            for (int bit = 0; bit < 8; bit++) {
+                crc = (crc & 1) ? (crc >> 1) ^ 0x82F63B78 : crc >> 1;
+            }
+            values[i] = crc;
+        }
+    }
+};
+
+
+inline uint32_t crc32cTable(const unsigned char *bytes, size_t size, uint32_t crc) {
+    static const Crc32cTable table;
+    for (size_t i = 0; i < size; i++) {
+        crc = table.values[(crc ^ bytes[i]) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+
+#if defined(HNSWLIB_CRC32C_SSE42)
+inline bool crc32cSse42Capable() {
+#ifdef _MSC_VER
+    int info[4];
+    __cpuid(info, 1);
+    return (info[2] & (1 << 20)) != 0;
+#else
+    unsigned int eax, ebx, ecx = 0, edx;
+    return __get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & (1 << 20)) != 0;
+#endif
+}
+
+
+inline bool crc32cHardware() {
+    static const bool capable = crc32cSse42Capable();
+    return capable;
+}
+
+
+#ifndef _MSC_VER
+__attribute__((target("sse4.2")))
+#endif
+inline uint32_t crc32cSse42(const unsigned char *bytes, size_t size, uint32_t crc) {
+    uint64_t crc64 = crc;
+    for (; size >= 8; bytes += 8, size -= 8) {
+        uint64_t word;
+        memcpy(&word, bytes, sizeof(word));
+        crc64 = _mm_crc32_u64(crc64, word);
+    }
+    crc = (uint32_t) crc64;
+    for (; size > 0; bytes++, size--) {
+        crc = _mm_crc32_u8(crc, *bytes);
+    }
+    return crc;
+}
+#elif defined(HNSWLIB_CRC32C_ARM)
+inline uint32_t crc32cArm(const unsigned char *bytes, size_t size, uint32_t crc) {
+    for (; size >= 8; bytes += 8, size -= 8) {
+        uint64_t word;
+        memcpy(&word, bytes, sizeof(word));
+        crc = __crc32cd(crc, word);
+    }
+    for (; size > 0; bytes++, size--) {
+        crc = __crc32cb(crc, *bytes);
+    }
+    return crc;
+}
+#endif
+
+
+inline uint32_t crc32c(const void *data, size_t size, uint32_t crc = 0) {
+    const unsigned char *bytes = (const unsigned char *) data;
+#if defined(HNSWLIB_CRC32C_SSE42)
+    if (crc32cHardware())
+        return ~crc32cSse42(bytes, size, ~crc);
+#elif defined(HNSWLIB_CRC32C_ARM)
+    return ~crc32cArm(bytes, size, ~crc);
+#endif
+    return ~crc32cTable(bytes, size, ~crc);
+}
+
+
+inline uint32_t crc32cMatrixTimes(const uint32_t *matrix, uint32_t vector) {
+    uint32_t sum = 0;
+    for (; vector; vector >>= 1, matrix++) {
+        if (vector & 1)
+            sum ^= *matrix;
+    }
+    return sum;
+}
+
+
+inline void crc32cMatrixSquare(uint32_t *square, const uint32_t *matrix) {
+    for (int n = 0; n < 32; n++) {
+        square[n] = crc32cMatrixTimes(matrix, matrix[n]);
+    }
+}
+
+
+/*
+ * Checksum of a followed by b from crc1 = crc32c(a), crc2 = crc32c(b) and the
+ * size of b, so that parts of a buffer can be checksummed on separate threads.
+ * Appends size2 zero bytes to crc1 by squaring the operator for one zero bit,
+ * as zlib's crc32_combine does.
+ */
+inline uint32_t crc32cCombine(uint32_t crc1, uint32_t crc2, size_t size2) {
+    if (size2 == 0)
+        return crc1;
+
+    uint32_t even[32];
+    uint32_t odd[32];
+    odd[0] = 0x82F63B78;
+    uint32_t row = 1;
+    for (int n = 1; n < 32; n++) {
+        odd[n] = row;
+        row <<= 1;
+    }
+    crc32cMatrixSquare(even, odd);  // two zero bits
+    crc32cMatrixSquare(odd, even);  // four zero bits
+
+    do {
+        crc32cMatrixSquare(even, odd);
+        if (size2 & 1)
+            crc1 = crc32cMatrixTimes(even, crc1);
+        size2 >>= 1;
+        if (size2 == 0)
+            break;
+        crc32cMatrixSquare(odd, even);
+        if (size2 & 1)
+            crc1 = crc32cMatrixTimes(odd, crc1);
+        size2 >>= 1;
+    } while (size2 != 0);
+    return crc1 ^ crc2;
+}
+}  // namespace hnswlib
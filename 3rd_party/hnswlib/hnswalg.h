@@ -1,26 +1,147 @@
 #pragma once
 
 #include "visited_list_pool.h"
+#include "chunked_array.h"
+#include "link_list_arena.h"
+#include "label_map.h"
+#include "parking_lock.h"
+#include "mapped_file.h"
+#include "tiered_vectors.h"
 #include "hnswlib.h"
 #include <atomic>
+#include <condition_variable>
+#include <cstdint>
 #include <random>
 #include <stdlib.h>
 #include <assert.h>
 #include <unordered_set>
 #include <list>
 #include <memory>
+#include <thread>
 
 namespace hnswlib {
 typedef unsigned int tableint;
 typedef unsigned int linklistsizeint;
 
+/*
+ * Files written by HierarchicalNSW::saveMappableIndex start with this header.
+ * Every section begins at a multiple of MAPPABLE_ALIGNMENT from the start of
+ * the file so that it can be used in place once the file is memory-mapped:
+ *
+ *   level0_offset        element_count * size_data_per_element bytes, as in memory
+ *   link_offsets_offset  element_count + 1 offsets of the upper link lists
+ *   links_offset         upper link lists of all elements, links_size bytes
+ *   labels_offset        label_slots MappableLabelSlot entries
+ */
+struct MappableIndexHeader {
+    uint64_t magic;
+    uint64_t version;
+    uint64_t max_elements;
+    uint64_t element_count;
+    uint64_t deleted_count;
+    uint64_t size_data_per_element;
+    uint64_t label_offset;
+    uint64_t offset_data;
+    int64_t max_level;
+    uint64_t enterpoint_node;
+    uint64_t max_m;
+    uint64_t max_m0;
+    uint64_t m;
+    double mult;
+    uint64_t ef_construction;
+    uint64_t level0_offset;
+    uint64_t link_offsets_offset;
+    uint64_t links_offset;
+    uint64_t links_size;
+    uint64_t labels_offset;
+    uint64_t label_slots;
+};
+
+// open addressing table from labels to internal ids, probed linearly
+struct MappableLabelSlot {
+    uint64_t label;
+    uint64_t internal_id;
+};
+
+/*
+ * Files written by HierarchicalNSW::saveCompactIndex start with this header,
+ * followed by these sections:
+ *
+ *   block_count + 1 CompactLinkBlock entries
+ *   links_size bytes of link lists
+ *   element_count labels
+ *   element_count vectors of data_size bytes
+ *
+ * The link lists of each element are stored as a varint of level * 2 + the
+ * delete mark, then for each level from 0 up a varint count and the neighbor
+ * ids in ascending order, the first one as is and the others as varint deltas
+ * to the previous one. Only the lists themselves are written, not the unused
+ * room for maxM0 / maxM links, which is most of the legacy format besides the
+ * vectors. Elements are grouped in blocks of COMPACT_BLOCK_ELEMENTS so that
+ * loading can decode the blocks in parallel.
+ *
+ * Since version 2 the header also names the space and dimension the index was
+ * made for and carries a CRC-32C of itself and of each section, which loading
+ * checks before using any of them. Version 1 headers end at `dim`.
+ *
+ * `flags` has COMPACT_ALIGNED_ELEMENTS set when the level 0 elements of the
+ * index were padded to cache lines, which loading gives them again.
+ */
+struct CompactIndexHeader {
+    uint64_t magic;
+    uint64_t version;
+    uint64_t max_elements;
+    uint64_t element_count;
+    uint64_t data_size;
+    int64_t max_level;
+    uint64_t enterpoint_node;
+    uint64_t max_m;
+    uint64_t max_m0;
+    uint64_t m;
+    double mult;
+    uint64_t ef_construction;
+    uint64_t block_count;
+    uint64_t links_size;
+    uint64_t dim;
+    uint64_t deleted_count;
+    char space[16];  // as given to saveCompactIndex, zero padded
+    uint32_t section_crcs[4];  // link blocks, links, labels, vectors
+    uint32_t header_crc;  // of the header with header_crc set to 0
+    uint32_t flags;
+};
+
+// where the elements of a block start in the links section, and how many
+// upper levels the elements before it have in total
+struct CompactLinkBlock {
+    uint64_t links_offset;
+    uint64_t upper_levels;
+};
+
 template<typename dist_t>
 class HierarchicalNSW : public AlgorithmInterface<dist_t> {
  public:
+    // label operations are serialized by one of a power of two number of locks,
+    // picked from the capacity at construction between these bounds
+    static const tableint MIN_LABEL_OPERATION_LOCKS = 64;
     static const tableint MAX_LABEL_OPERATION_LOCKS = 65536;
     static const unsigned char DELETE_MARK = 0x01;
-
-    size_t max_elements_{0};
+    // Legacy index files start with offsetLevel0_, which is always 0,
+    // so they can never be mistaken for a mappable file.
+    static const uint64_t MAPPABLE_MAGIC = 0x31504d4d57534e48ULL;  // "HNSWMMP1"
+    static const uint64_t MAPPABLE_VERSION = 1;
+    static const uint64_t MAPPABLE_ALIGNMENT = 4096;
+    static const uint64_t EMPTY_LABEL_SLOT = ~(uint64_t) 0;
+    static const uint64_t COMPACT_MAGIC = 0x31504d4357534e48ULL;  // "HNSWCMP1"
+    static const uint64_t COMPACT_VERSION = 2;
+    static const uint32_t COMPACT_ALIGNED_ELEMENTS = 1;
+    static const size_t COMPACT_BLOCK_ELEMENTS = 4096;
+    // label_lookup_ is split by label hash so that loading can build it in parallel
+    // and writers of different shards do not wait for each other
+    static const size_t LABEL_LOOKUP_SHARDS = 64;
+    // loadIndex reads files in the default layout in blocks of this size
+    static const size_t IO_BLOCK_SIZE = 4 * 1024 * 1024;
+
+    mutable std::atomic<size_t> max_elements_{0};
     mutable std::atomic<size_t> cur_element_count{0};  // current number of elements
     size_t size_data_per_element_{0};
     size_t size_links_per_element_{0};
@@ -36,29 +157,55 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
 
     std::unique_ptr<VisitedListPool> visited_list_pool_{nullptr};
 
-    // Locks operations with element by label value
+    // Locks operations with element by label value. Their count follows the
+    // capacity, see labelOperationLockCount, and is fixed once segmented
+    // storage is in use, as segments grow while other operations hold them.
     mutable std::vector<std::mutex> label_op_locks_;
 
     std::mutex global;
-    std::vector<std::mutex> link_list_locks_;
+    ChunkedArray<ParkingLock> link_list_locks_;
 
     tableint enterpoint_node_{0};
 
     size_t size_links_level0_{0};
     size_t offsetData_{0}, offsetLevel0_{0}, label_offset_{ 0 };
 
-    char *data_level0_memory_{nullptr};
-    char **linkLists_{nullptr};
-    std::vector<int> element_levels_;  // keeps level of each element
+    // With segmented storage (segment_shift_ != ChunkedArray::FLAT) the per-element
+    // arrays grow by whole segments of 2^segment_shift_ elements without moving
+    // existing elements, so resizeIndex can run alongside searches and insertions.
+    size_t segment_shift_{ChunkedArray<char>::FLAT};
+    int memory_flags_{MEMORY_DEFAULT};  // placement of the level 0 arrays, see MemoryFlags
+    ChunkedArray<char> data_level0_memory_;
+    // With split_elements_ data_level0_memory_ only holds the level 0 links, and the
+    // vectors and labels live in arrays of their own, so that the graph traversal
+    // does not pull vector bytes into the cache and each array can be placed apart.
+    // Index files keep the interleaved layout of size_data_per_element_ either way.
+    bool split_elements_{false};
+    size_t vector_stride_{0};
+    ChunkedArray<char> vector_memory_;
+    ChunkedArray<labeltype> label_memory_;
+    // Set by loadTieredIndex. vector_memory_ then holds the codes of the vectors,
+    // which searches walk the graph on, and fstdistfunc_ compares a query to a code.
+    // The best candidates are ordered by vector_dist_func_ on their full vectors,
+    // which are read from the index file.
+    std::unique_ptr<TieredVectors> tiered_;
+    DISTFUNC<dist_t> vector_dist_func_{nullptr};
+    void *vector_dist_func_param_{nullptr};
+    ChunkedArray<char *> linkLists_;
+    ChunkedArray<int> element_levels_;  // keeps level of each element
 
     size_t data_size_{0};
 
     DISTFUNC<dist_t> fstdistfunc_;
     void *dist_func_param_{nullptr};
 
-    mutable std::mutex label_lookup_lock;  // lock for label_lookup_
-    std::unordered_map<labeltype, tableint> label_lookup_;
+    struct LabelLookupShard {
+        mutable std::mutex lock;
+        LabelMap labels;
+    };
+    std::vector<LabelLookupShard> label_lookup_ = std::vector<LabelLookupShard>(LABEL_LOOKUP_SHARDS);
 
+    std::mutex level_generator_lock_;  // addPoint may run concurrently
     std::default_random_engine level_generator_;
     std::default_random_engine update_probability_generator_;
 
@@ -70,6 +217,43 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
     std::mutex deleted_elements_lock;  // lock for deleted_elements
     std::unordered_set<tableint> deleted_elements;  // contains internal ids of deleted elements
 
+    // upper link lists, linkLists_[i] points into the arena for elements of level > 0
+    LinkListArena link_list_arena_;
+
+    // Set when the index is served from a file mapped by loadMappableIndex. The level 0
+    // data, upper link lists and labels are then read from the file and the index is read-only.
+    std::unique_ptr<MappedFile> mapped_file_;
+    const uint64_t *mapped_link_offsets_{nullptr};
+    char *mapped_links_{nullptr};
+    const MappableLabelSlot *mapped_labels_{nullptr};
+    size_t mapped_label_mask_{0};
+
+    // Set by freeze(). The element and label operation locks are gone and lookups
+    // no longer lock the label shards, as nothing changes the index anymore.
+    bool frozen_{false};
+
+    // A point-in-time copy of the index that writeSnapshot streams out while writes
+    // go on. Elements below `count` are saved as they were when the snapshot began:
+    // a writer that is about to change one first copies it aside (preserveElement).
+    // state[i] and the copy of element i are only touched under link_list_locks_[i].
+    struct Snapshot {
+        size_t count;
+        size_t max_elements;
+        int max_level;
+        tableint enterpoint_node;
+        std::vector<unsigned char> state;
+        std::mutex copies_lock;
+        std::unordered_map<tableint, std::string> copies;
+    };
+    static const unsigned char SNAPSHOT_PENDING = 0;
+    static const unsigned char SNAPSHOT_COPIED = 1;
+    static const unsigned char SNAPSHOT_WRITTEN = 2;
+
+    std::atomic<Snapshot *> snapshot_{nullptr};
+    std::mutex snapshot_lock_;
+    std::condition_variable snapshot_done_;
+    bool snapshot_active_{false};  // until the last writer let go of snapshot_
+
 
     HierarchicalNSW(SpaceInterface<dist_t> *s) {
     }
@@ -80,9 +264,11 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
         const std::string &location,
         bool nmslib = false,
         size_t max_elements = 0,
-        bool allow_replace_deleted = false)
+        bool allow_replace_deleted = false,
+        size_t segment_size = 0,
+        size_t num_threads = 1)
         : allow_replace_deleted_(allow_replace_deleted) {
-        loadIndex(location, s, max_elements);
+        loadIndex(location, s, max_elements, segment_size, num_threads);
     }
 
 
@@ -92,10 +278,12 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
         size_t M = 16,
         size_t ef_construction = 200,
         size_t random_seed = 100,
-        bool allow_replace_deleted = false)
-        : label_op_locks_(MAX_LABEL_OPERATION_LOCKS),
-            link_list_locks_(max_elements),
-            element_levels_(max_elements),
+        bool allow_replace_deleted = false,
+        size_t segment_size = 0,
+        int memory_flags = MEMORY_DEFAULT,
+        bool align_elements = false,
+        bool split_elements = false)
+        : label_op_locks_(labelOperationLockCount(max_elements)),
             allow_replace_deleted_(allow_replace_deleted) {
         max_elements_ = max_elements;
         num_deleted_ = 0;
@@ -117,28 +305,20 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
         level_generator_.seed(random_seed);
         update_probability_generator_.seed(random_seed + 1);
 
-        size_links_level0_ = maxM0_ * sizeof(tableint) + sizeof(linklistsizeint);
-        size_data_per_element_ = size_links_level0_ + data_size_ + sizeof(labeltype);
-        offsetData_ = size_links_level0_;
-        label_offset_ = size_links_level0_ + data_size_;
-        offsetLevel0_ = 0;
+        setElementLayout(align_elements);
+        size_links_per_element_ = maxM_ * sizeof(tableint) + sizeof(linklistsizeint);
 
-        data_level0_memory_ = (char *) malloc(max_elements_ * size_data_per_element_);
-        if (data_level0_memory_ == nullptr)
-            throw std::runtime_error("Not enough memory");
+        segment_shift_ = getSegmentShift(segment_size);
+        memory_flags_ = memory_flags;
+        split_elements_ = split_elements;
+        allocateStorage(max_elements_);
 
         cur_element_count = 0;
 
-        visited_list_pool_ = std::unique_ptr<VisitedListPool>(new VisitedListPool(1, max_elements));
-
         // initializations for special treatment of the first node
         enterpoint_node_ = -1;
         maxlevel_ = -1;
 
-        linkLists_ = (char **) malloc(sizeof(void *) * max_elements_);
-        if (linkLists_ == nullptr)
-            throw std::runtime_error("Not enough memory: HierarchicalNSW failed to allocate linklists");
-        size_links_per_element_ = maxM_ * sizeof(tableint) + sizeof(linklistsizeint);
         mult_ = 1 / log(1.0 * M_);
         revSize_ = 1.0 / mult_;
     }
@@ -149,16 +329,258 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
     }
 
     void clear() {
-        free(data_level0_memory_);
-        data_level0_memory_ = nullptr;
-        for (tableint i = 0; i < cur_element_count; i++) {
-            if (element_levels_[i] > 0)
-                free(linkLists_[i]);
-        }
-        free(linkLists_);
-        linkLists_ = nullptr;
+        link_list_arena_.release();
+        data_level0_memory_.release();
+        vector_memory_.release();
+        label_memory_.release();
+        linkLists_.release();
+        element_levels_.release();
+        link_list_locks_.release();
         cur_element_count = 0;
         visited_list_pool_.reset(nullptr);
+        for (LabelLookupShard &shard : label_lookup_) {
+            shard.labels.clear();
+        }
+        mapped_link_offsets_ = nullptr;
+        mapped_links_ = nullptr;
+        mapped_labels_ = nullptr;
+        mapped_label_mask_ = 0;
+        mapped_file_.reset(nullptr);
+        tiered_.reset(nullptr);
+    }
+
+
+    // zeroed link lists for an element of level `level` > 0
+    char *allocateLinkLists(int level) {
+        char *link_lists = link_list_arena_.allocate(level);
+        if (link_lists == nullptr)
+            throw std::runtime_error("Not enough memory: HierarchicalNSW failed to allocate linklists");
+        return link_lists;
+    }
+
+
+    bool isReadOnly() const {
+        return mapped_file_ != nullptr || tiered_ != nullptr || frozen_;
+    }
+
+
+    void checkWritable() const {
+        if (mapped_file_)
+            throw std::runtime_error("The index is memory-mapped and read-only");
+        if (tiered_)
+            throw std::runtime_error("The index keeps its vectors on disk and is read-only");
+        if (frozen_)
+            throw std::runtime_error("The index is frozen and read-only");
+    }
+
+
+    bool isFrozen() const {
+        return frozen_;
+    }
+
+
+    /*
+    * Makes the index immutable. The capacity shrinks to the current number of
+    * elements, the per-element and label operation locks are freed, and searches
+    * and lookups run without taking any lock. Every write fails afterwards.
+    * Must not run concurrently with any other operation.
+    */
+    void freeze() {
+        if (frozen_)
+            return;
+        if (!mapped_file_) {
+            // a snapshot being written reads the arrays that are about to shrink
+            std::unique_lock <std::mutex> lock_snapshot(snapshot_lock_);
+            snapshot_done_.wait(lock_snapshot, [this] { return !snapshot_active_; });
+            lock_snapshot.unlock();
+
+            size_t count = cur_element_count;
+            if (!resizeLevel0(count) || !linkLists_.resize(count) || !element_levels_.resize(count))
+                throw std::runtime_error("Not enough memory: freeze failed to compact the index");
+            max_elements_ = count;
+            visited_list_pool_.reset(new VisitedListPool(1, count));
+            std::unordered_set<tableint>().swap(deleted_elements);
+        }
+        link_list_locks_.release();
+        std::vector<std::mutex>().swap(label_op_locks_);
+        frozen_ = true;
+    }
+
+
+    int getElementLevel(tableint internal_id) const {
+        if (mapped_link_offsets_) {
+            uint64_t size = mapped_link_offsets_[internal_id + 1] - mapped_link_offsets_[internal_id];
+            return (int) (size / size_links_per_element_);
+        }
+        return element_levels_[internal_id];
+    }
+
+
+    /*
+    * Segments hold a power of two number of elements, `segment_size` is rounded up.
+    * A segment size of 0 keeps every per-element array in a single block.
+    */
+    static size_t getSegmentShift(size_t segment_size) {
+        if (segment_size == 0)
+            return ChunkedArray<char>::FLAT;
+        size_t shift = 0;
+        while (((size_t) 1 << shift) < segment_size)
+            shift++;
+        return shift;
+    }
+
+
+    bool isSegmented() const {
+        return segment_shift_ != ChunkedArray<char>::FLAT;
+    }
+
+
+    // number of elements per segment, or 0 when the storage is not segmented
+    size_t getSegmentSize() const {
+        return isSegmented() ? (size_t) 1 << segment_shift_ : 0;
+    }
+
+
+    /*
+    * Lays out a level 0 element as its links, vector and label. Aligned elements
+    * start the vector on a cache line and take a whole number of cache lines, so
+    * that a vector spans as few lines as it can. maxM0_ and data_size_ must be set.
+    */
+    void setElementLayout(bool aligned) {
+        size_links_level0_ = maxM0_ * sizeof(tableint) + sizeof(linklistsizeint);
+        offsetLevel0_ = 0;
+        offsetData_ = aligned ? roundUpToCacheLine(size_links_level0_) : size_links_level0_;
+        label_offset_ = offsetData_ + data_size_;
+        size_data_per_element_ = label_offset_ + sizeof(labeltype);
+        if (aligned)
+            size_data_per_element_ = roundUpToCacheLine(size_data_per_element_);
+    }
+
+
+    static size_t roundUpToCacheLine(size_t size) {
+        return (size + CACHE_LINE_SIZE - 1) / CACHE_LINE_SIZE * CACHE_LINE_SIZE;
+    }
+
+
+    // whether the elements were laid out by setElementLayout(true), maybe in a loaded file
+    bool alignedElements() const {
+        return offsetData_ % CACHE_LINE_SIZE == 0 && size_data_per_element_ % CACHE_LINE_SIZE == 0;
+    }
+
+
+    void allocateStorage(size_t max_elements) {
+        // aligned elements need the blocks to start on a cache line as well
+        int memory_flags = memory_flags_ | (alignedElements() ? MEMORY_CACHE_ALIGNED : 0);
+        if (split_elements_) {
+            if (tiered_)
+                vector_stride_ = tiered_->codeSize();
+            else
+                vector_stride_ = alignedElements() ? roundUpToCacheLine(data_size_) : data_size_;
+            if (!data_level0_memory_.init(max_elements, size_links_level0_, segment_shift_, memory_flags_) ||
+                !vector_memory_.init(max_elements, vector_stride_, segment_shift_, memory_flags) ||
+                !label_memory_.init(max_elements, 1, segment_shift_, memory_flags_))
+                throw std::runtime_error("Not enough memory");
+        } else if (!data_level0_memory_.init(max_elements, size_data_per_element_, segment_shift_, memory_flags)) {
+            throw std::runtime_error("Not enough memory");
+        }
+        if (!linkLists_.init(max_elements, 1, segment_shift_))
+            throw std::runtime_error("Not enough memory: HierarchicalNSW failed to allocate linklists");
+        if (!element_levels_.init(max_elements, 1, segment_shift_) ||
+            !link_list_locks_.init(max_elements, 1, segment_shift_))
+            throw std::runtime_error("Not enough memory: HierarchicalNSW failed to allocate element levels");
+        link_list_arena_.init(size_links_per_element_);
+        visited_list_pool_ = std::unique_ptr<VisitedListPool>(new VisitedListPool(1, max_elements));
+    }
+
+
+    bool resizeLevel0(size_t max_elements) {
+        if (!data_level0_memory_.resize(max_elements))
+            return false;
+        return !split_elements_ || (vector_memory_.resize(max_elements) && label_memory_.resize(max_elements));
+    }
+
+
+    // bytes of an element in data_level0_memory_
+    size_t level0Stride() const {
+        return split_elements_ ? size_links_level0_ : size_data_per_element_;
+    }
+
+
+    /*
+    * Copy element `internal_id` from or to `element`, which holds it as laid out
+    * in index files: size_data_per_element_ bytes with the vector at offsetData_
+    * and the label at label_offset_.
+    */
+    void readLevel0(tableint internal_id, char *element) const {
+        if (!split_elements_) {
+            memcpy(element, data_level0_memory_.at(internal_id), size_data_per_element_);
+            return;
+        }
+        memset(element, 0, size_data_per_element_);
+        memcpy(element, data_level0_memory_.at(internal_id), size_links_level0_);
+        copyVectors(&internal_id, 1, element + offsetData_);
+        memcpy(element + label_offset_, label_memory_.at(internal_id), sizeof(labeltype));
+    }
+
+
+    void writeLevel0(tableint internal_id, const char *element) {
+        if (!split_elements_) {
+            memcpy(data_level0_memory_.at(internal_id), element, size_data_per_element_);
+            return;
+        }
+        memcpy(data_level0_memory_.at(internal_id), element, size_links_level0_);
+        storeVector(internal_id, element + offsetData_);
+        memcpy(label_memory_.at(internal_id), element + label_offset_, sizeof(labeltype));
+    }
+
+
+    void moveLevel0(tableint to, tableint from) {
+        memcpy(data_level0_memory_.at(to), data_level0_memory_.at(from), level0Stride());
+        if (split_elements_) {
+            memcpy(vector_memory_.at(to), vector_memory_.at(from), vector_stride_);
+            label_memory_[to] = label_memory_[from];
+        }
+    }
+
+
+    // Copies the full vectors of the `n` elements `ids` into `out`, data_size_ bytes each.
+    void copyVectors(const tableint *ids, size_t n, char *out) const {
+        if (tiered_) {
+            tiered_->read(ids, n, out);
+            return;
+        }
+        for (size_t i = 0; i < n; i++) {
+            memcpy(out + i * data_size_, getDataByInternalId(ids[i]), data_size_);
+        }
+    }
+
+
+    void storeVector(tableint internal_id, const char *vector) {
+        if (tiered_)
+            tiered_->encode(vector, getDataByInternalId(internal_id));
+        else
+            memcpy(getDataByInternalId(internal_id), vector, data_size_);
+    }
+
+
+    // Calls write(data, size) with the first `count` elements as laid out in index files.
+    template<typename Write>
+    void writeLevel0Elements(size_t count, Write write) const {
+        if (!split_elements_) {
+            data_level0_memory_.forEachRun(0, count, [&](const char *run, size_t n) {
+                write(run, n * size_data_per_element_);
+            });
+            return;
+        }
+        const size_t batch = 1024;
+        std::vector<char> elements(batch * size_data_per_element_);
+        for (size_t begin = 0; begin < count; begin += batch) {
+            size_t n = std::min(batch, count - begin);
+            for (size_t i = 0; i < n; i++) {
+                readLevel0((tableint) (begin + i), elements.data() + i * size_data_per_element_);
+            }
+            write(elements.data(), n * size_data_per_element_);
+        }
     }
 
 
@@ -175,37 +597,73 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
     }
 
 
+    static size_t labelOperationLockCount(size_t max_elements) {
+        size_t count = MIN_LABEL_OPERATION_LOCKS;
+        while (count < max_elements && count < MAX_LABEL_OPERATION_LOCKS) {
+            count *= 2;
+        }
+        return count;
+    }
+
+
     inline std::mutex& getLabelOpMutex(labeltype label) const {
         // calculate hash
-        size_t lock_id = label & (MAX_LABEL_OPERATION_LOCKS - 1);
+        size_t lock_id = label & (label_op_locks_.size() - 1);
         return label_op_locks_[lock_id];
     }
 
 
     inline labeltype getExternalLabel(tableint internal_id) const {
+        if (split_elements_)
+            return label_memory_[internal_id];
         labeltype return_label;
-        memcpy(&return_label, (data_level0_memory_ + internal_id * size_data_per_element_ + label_offset_), sizeof(labeltype));
+        memcpy(&return_label, (data_level0_memory_.at(internal_id) + label_offset_), sizeof(labeltype));
         return return_label;
     }
 
 
     inline void setExternalLabel(tableint internal_id, labeltype label) const {
-        memcpy((data_level0_memory_ + internal_id * size_data_per_element_ + label_offset_), &label, sizeof(labeltype));
+        if (split_elements_) {
+            label_memory_[internal_id] = label;
+            return;
+        }
+        memcpy((data_level0_memory_.at(internal_id) + label_offset_), &label, sizeof(labeltype));
     }
 
 
     inline labeltype *getExternalLabeLp(tableint internal_id) const {
-        return (labeltype *) (data_level0_memory_ + internal_id * size_data_per_element_ + label_offset_);
+        if (split_elements_)
+            return label_memory_.at(internal_id);
+        return (labeltype *) (data_level0_memory_.at(internal_id) + label_offset_);
     }
 
 
     inline char *getDataByInternalId(tableint internal_id) const {
-        return (data_level0_memory_ + internal_id * size_data_per_element_ + offsetData_);
+        if (split_elements_)
+            return vector_memory_.at(internal_id);
+        return (data_level0_memory_.at(internal_id) + offsetData_);
+    }
+
+
+    // `internal_id` may be read past the end of a link list, so it is only a hint
+    inline void prefetchDataByInternalId(tableint internal_id) const {
+#ifdef USE_SSE
+        if (split_elements_) {
+            char *vector = vector_memory_.find(internal_id);
+            if (vector)
+                _mm_prefetch(vector, _MM_HINT_T0);
+            return;
+        }
+        char *element = data_level0_memory_.find(internal_id);
+        if (element)
+            _mm_prefetch(element + offsetData_, _MM_HINT_T0);
+#endif
     }
 
 
     int getRandomLevel(double reverse_size) {
         std::uniform_real_distribution<double> distribution(0.0, 1.0);
+        std::unique_lock <std::mutex> lock(level_generator_lock_);
         double r = -log(distribution(level_generator_)) * reverse_size;
         return (int) r;
     }
@@ -227,6 +685,8 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
         VisitedList *vl = visited_list_pool_->getFreeVisitedList();
         vl_type *visited_array = vl->mass;
         vl_type visited_array_tag = vl->curV;
+        // segmented storage may grow during the search, elements added since are skipped
+        tableint visited_limit = vl->numelements;
 
         std::priority_queue<std::pair<dist_t, tableint>, std::vector<std::pair<dist_t, tableint>>, CompareByFirst> top_candidates;
         std::priority_queue<std::pair<dist_t, tableint>, std::vector<std::pair<dist_t, tableint>>, CompareByFirst> candidateSet;
@@ -252,7 +712,7 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
 
             tableint curNodeNum = curr_el_pair.second;
 
-            std::unique_lock <std::mutex> lock(link_list_locks_[curNodeNum]);
+            std::unique_lock <ParkingLock> lock(link_list_locks_[curNodeNum]);
 
             int *data;  // = (int *)(linkList0_ + curNodeNum * size_links_per_element0_);
             if (layer == 0) {
@@ -266,17 +726,18 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
 #ifdef USE_SSE
             _mm_prefetch((char *) (visited_array + *(data + 1)), _MM_HINT_T0);
             _mm_prefetch((char *) (visited_array + *(data + 1) + 64), _MM_HINT_T0);
-            _mm_prefetch(getDataByInternalId(*datal), _MM_HINT_T0);
-            _mm_prefetch(getDataByInternalId(*(datal + 1)), _MM_HINT_T0);
 #endif
+            prefetchDataByInternalId(*datal);
+            prefetchDataByInternalId(*(datal + 1));
 
             for (size_t j = 0; j < size; j++) {
                 tableint candidate_id = *(datal + j);
 //                    if (candidate_id == 0) continue;
 #ifdef USE_SSE
                 _mm_prefetch((char *) (visited_array + *(datal + j + 1)), _MM_HINT_T0);
-                _mm_prefetch(getDataByInternalId(*(datal + j + 1)), _MM_HINT_T0);
 #endif
+                prefetchDataByInternalId(*(datal + j + 1));
+                if (candidate_id >= visited_limit) continue;
                 if (visited_array[candidate_id] == visited_array_tag) continue;
                 visited_array[candidate_id] = visited_array_tag;
                 char *currObj1 = (getDataByInternalId(candidate_id));
@@ -317,6 +778,8 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
         VisitedList *vl = visited_list_pool_->getFreeVisitedList();
         vl_type *visited_array = vl->mass;
         vl_type visited_array_tag = vl->curV;
+        // segmented storage may grow during the search, elements added since are skipped
+        tableint visited_limit = vl->numelements;
 
         std::priority_queue<std::pair<dist_t, tableint>, std::vector<std::pair<dist_t, tableint>>, CompareByFirst> top_candidates;
         std::priority_queue<std::pair<dist_t, tableint>, std::vector<std::pair<dist_t, tableint>>, CompareByFirst> candidate_set;
@@ -370,18 +833,18 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
 #ifdef USE_SSE
             _mm_prefetch((char *) (visited_array + *(data + 1)), _MM_HINT_T0);
             _mm_prefetch((char *) (visited_array + *(data + 1) + 64), _MM_HINT_T0);
-            _mm_prefetch(data_level0_memory_ + (*(data + 1)) * size_data_per_element_ + offsetData_, _MM_HINT_T0);
             _mm_prefetch((char *) (data + 2), _MM_HINT_T0);
 #endif
+            prefetchDataByInternalId(*(data + 1));
 
             for (size_t j = 1; j <= size; j++) {
                 int candidate_id = *(data + j);
 //                    if (candidate_id == 0) continue;
 #ifdef USE_SSE
                 _mm_prefetch((char *) (visited_array + *(data + j + 1)), _MM_HINT_T0);
-                _mm_prefetch(data_level0_memory_ + (*(data + j + 1)) * size_data_per_element_ + offsetData_,
-                                _MM_HINT_T0);  ////////////
 #endif
+                prefetchDataByInternalId(*(data + j + 1));
+                if ((tableint) candidate_id >= visited_limit) continue;
                 if (!(visited_array[candidate_id] == visited_array_tag)) {
                     visited_array[candidate_id] = visited_array_tag;
 
@@ -398,7 +861,7 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
                     if (flag_consider_candidate) {
                         candidate_set.emplace(-dist, candidate_id);
 #ifdef USE_SSE
-                        _mm_prefetch(data_level0_memory_ + candidate_set.top().second * size_data_per_element_ +
+                        _mm_prefetch(data_level0_memory_.at(candidate_set.top().second) +
                                         offsetLevel0_,  ///////////
                                         _MM_HINT_T0);  ////////////////////////
 #endif
@@ -484,16 +947,13 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
 
 
     linklistsizeint *get_linklist0(tableint internal_id) const {
-        return (linklistsizeint *) (data_level0_memory_ + internal_id * size_data_per_element_ + offsetLevel0_);
-    }
-
-
-    linklistsizeint *get_linklist0(tableint internal_id, char *data_level0_memory_) const {
-        return (linklistsizeint *) (data_level0_memory_ + internal_id * size_data_per_element_ + offsetLevel0_);
+        return (linklistsizeint *) (data_level0_memory_.at(internal_id) + offsetLevel0_);
     }
 
 
     linklistsizeint *get_linklist(tableint internal_id, int level) const {
+        if (mapped_links_)
+            return (linklistsizeint *) (mapped_links_ + mapped_link_offsets_[internal_id] + (level - 1) * size_links_per_element_);
         return (linklistsizeint *) (linkLists_[internal_id] + (level - 1) * size_links_per_element_);
     }
 
@@ -526,9 +986,10 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
         {
             // lock only during the update
             // because during the addition the lock for cur_c is already acquired
-            std::unique_lock <std::mutex> lock(link_list_locks_[cur_c], std::defer_lock);
+            std::unique_lock <ParkingLock> lock(link_list_locks_[cur_c], std::defer_lock);
             if (isUpdate) {
                 lock.lock();
+                preserveElement(cur_c);
             }
             linklistsizeint *ll_cur;
             if (level == 0)
@@ -552,7 +1013,7 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
         }
 
         for (size_t idx = 0; idx < selectedNeighbors.size(); idx++) {
-            std::unique_lock <std::mutex> lock(link_list_locks_[selectedNeighbors[idx]]);
+            std::unique_lock <ParkingLock> lock(link_list_locks_[selectedNeighbors[idx]]);
 
             linklistsizeint *ll_other;
             if (level == 0)
@@ -583,6 +1044,7 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
 
             // If cur_c is already present in the neighboring connections of `selectedNeighbors[idx]` then no need to modify any connections or run the heuristics.
             if (!is_cur_c_present) {
+                preserveElement(selectedNeighbors[idx]);
                 if (sz_link_list_other < Mcurmax) {
                     data[sz_link_list_other] = cur_c;
                     setListCount(ll_other, sz_link_list_other + 1);
@@ -630,31 +1092,155 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
     }
 
 
+    /*
+    * Changes the capacity of the index. With flat storage this reallocates every
+    * per-element array and must not run concurrently with any other operation.
+    * Segmented storage only adds or frees whole segments, existing elements stay
+    * in place, so it may run alongside searches and insertions.
+    */
     void resizeIndex(size_t new_max_elements) {
+        checkWritable();
+        if (isSegmented()) {
+            resizeSegments(new_max_elements);
+            return;
+        }
         if (new_max_elements < cur_element_count)
             throw std::runtime_error("Cannot resize, max element is less than the current number of elements");
 
-        visited_list_pool_.reset(new VisitedListPool(1, new_max_elements));
+        // a snapshot being written reads the arrays that are about to move
+        std::unique_lock <std::mutex> lock_snapshot(snapshot_lock_);
+        snapshot_done_.wait(lock_snapshot, [this] { return !snapshot_active_; });
+        lock_snapshot.unlock();
 
-        element_levels_.resize(new_max_elements);
+        visited_list_pool_.reset(new VisitedListPool(1, new_max_elements));
 
-        std::vector<std::mutex>(new_max_elements).swap(link_list_locks_);
+        if (!element_levels_.resize(new_max_elements) || !link_list_locks_.resize(new_max_elements))
+            throw std::runtime_error("Not enough memory: resizeIndex failed to allocate element levels");
 
         // Reallocate base layer
-        char * data_level0_memory_new = (char *) realloc(data_level0_memory_, new_max_elements * size_data_per_element_);
-        if (data_level0_memory_new == nullptr)
+        if (!resizeLevel0(new_max_elements))
             throw std::runtime_error("Not enough memory: resizeIndex failed to allocate base layer");
-        data_level0_memory_ = data_level0_memory_new;
 
         // Reallocate all other layers
-        char ** linkLists_new = (char **) realloc(linkLists_, sizeof(void *) * new_max_elements);
-        if (linkLists_new == nullptr)
+        if (!linkLists_.resize(new_max_elements))
             throw std::runtime_error("Not enough memory: resizeIndex failed to allocate other layers");
-        linkLists_ = linkLists_new;
 
+        size_t label_lock_count = labelOperationLockCount(new_max_elements);
+        if (label_lock_count != label_op_locks_.size())
+            std::vector<std::mutex>(label_lock_count).swap(label_op_locks_);
+
+        max_elements_ = new_max_elements;
+    }
+
+
+    void resizeSegments(size_t new_max_elements) {
+        // new elements take their ids under the lock of their label's shard, see addPoint
+        std::vector<std::unique_lock<std::mutex>> lock_shards;
+        for (LabelLookupShard &shard : label_lookup_) {
+            lock_shards.emplace_back(shard.lock);
+        }
+        if (new_max_elements < cur_element_count)
+            throw std::runtime_error("Cannot resize, max element is less than the current number of elements");
+        if (new_max_elements > (size_t) std::numeric_limits<int>::max())
+            throw std::runtime_error("Cannot resize, max element exceeds the range of internal ids");
+
+        if (!resizeLevel0(new_max_elements) || !linkLists_.resize(new_max_elements) ||
+            !element_levels_.resize(new_max_elements) || !link_list_locks_.resize(new_max_elements))
+            throw std::runtime_error("Not enough memory: resizeIndex failed to allocate a segment");
+
+        // visited lists must cover every id below max_elements_ before it is raised
+        visited_list_pool_->setNumElements((int) new_max_elements);
         max_elements_ = new_max_elements;
     }
 
+    /*
+    * Renumbers the elements in breadth-first order of the level 0 graph from the
+    * entry point, so that neighbors mostly sit next to each other in memory and a
+    * search touches fewer cache lines and pages. Elements the traversal does not
+    * reach keep their relative order at the end. Labels, levels, links and
+    * deletion marks move with their elements; only the internal ids change.
+    * Must not run concurrently with any other operation.
+    */
+    void reorder(size_t num_threads = 1) {
+        checkWritable();
+        size_t count = cur_element_count;
+        if (count == 0)
+            return;
+
+        // a snapshot being written reads elements by their internal id
+        std::unique_lock <std::mutex> lock_snapshot(snapshot_lock_);
+        snapshot_done_.wait(lock_snapshot, [this] { return !snapshot_active_; });
+        lock_snapshot.unlock();
+
+        // order[new id] = old id, new_ids[old id] = new id
+        std::vector<tableint> order;
+        order.reserve(count);
+        std::vector<tableint> new_ids(count, (tableint) count);
+        for (size_t start = enterpoint_node_, next_unreached = 0; order.size() < count;) {
+            if (new_ids[start] == count) {
+                size_t head = order.size();
+                new_ids[start] = (tableint) order.size();
+                order.push_back((tableint) start);
+                for (; head < order.size(); head++) {
+                    linklistsizeint *list = get_linklist0(order[head]);
+                    tableint *links = (tableint *) (list + 1);
+                    for (size_t j = 0; j < getListCount(list); j++) {
+                        if (new_ids[links[j]] == count) {
+                            new_ids[links[j]] = (tableint) order.size();
+                            order.push_back(links[j]);
+                        }
+                    }
+                }
+            }
+            while (next_unreached < count && new_ids[next_unreached] != count)
+                next_unreached++;
+            start = next_unreached;
+        }
+
+        parallelRanges(count, num_threads, [&](size_t begin, size_t end, size_t part) {
+            for (size_t i = begin; i < end; i++) {
+                for (int level = 0; level <= element_levels_[i]; level++) {
+                    linklistsizeint *list = get_linklist_at_level((tableint) i, level);
+                    tableint *links = (tableint *) (list + 1);
+                    for (size_t j = 0; j < getListCount(list); j++) {
+                        links[j] = new_ids[links[j]];
+                    }
+                }
+            }
+        });
+
+        // move the elements along the cycles of the permutation
+        std::vector<char> element(size_data_per_element_);
+        for (size_t i = 0; i < count; i++) {
+            if (new_ids[i] == i || order[i] == count)
+                continue;
+            readLevel0((tableint) i, element.data());
+            char *link_lists = linkLists_[i];
+            int level = element_levels_[i];
+            size_t target = i;
+            while (order[target] != i) {
+                size_t source = order[target];
+                moveLevel0((tableint) target, (tableint) source);
+                linkLists_[target] = linkLists_[source];
+                element_levels_[target] = element_levels_[source];
+                order[target] = (tableint) count;
+                target = source;
+            }
+            writeLevel0((tableint) target, element.data());
+            linkLists_[target] = link_lists;
+            element_levels_[target] = level;
+            order[target] = (tableint) count;
+        }
+        enterpoint_node_ = new_ids[enterpoint_node_];
+
+        for (LabelLookupShard &shard : label_lookup_) {
+            shard.labels.clear();
+        }
+        deleted_elements.clear();
+        rebuildLabelLookup(num_threads);
+    }
+
+
     size_t indexFileSize() const {
         size_t size = 0;
         size += sizeof(offsetLevel0_);
@@ -672,10 +1258,11 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
         size += sizeof(mult_);
         size += sizeof(ef_construction_);
 
-        size += cur_element_count * size_data_per_element_;
+        size_t count = cur_element_count;
+        size += count * size_data_per_element_;
 
-        for (size_t i = 0; i < cur_element_count; i++) {
-            unsigned int linkListSize = element_levels_[i] > 0 ? size_links_per_element_ * element_levels_[i] : 0;
+        for (size_t i = 0; i < count; i++) {
+            unsigned int linkListSize = size_links_per_element_ * getElementLevel(i);
             size += sizeof(linkListSize);
             size += linkListSize;
         }
@@ -684,11 +1271,19 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
 
     void saveIndex(const std::string &location) {
         std::ofstream output(location, std::ios::binary);
-        std::streampos position;
+        if (!output.is_open())
+            throw std::runtime_error("Cannot open file");
+        saveIndex(output);
+        output.close();
+    }
+
 
+    void saveIndex(std::ostream &output) {
+        // the header and the elements after it must agree on the count
+        size_t count = cur_element_count;
         writeBinaryPOD(output, offsetLevel0_);
         writeBinaryPOD(output, max_elements_);
-        writeBinaryPOD(output, cur_element_count);
+        writeBinaryPOD(output, count);
         writeBinaryPOD(output, size_data_per_element_);
         writeBinaryPOD(output, label_offset_);
         writeBinaryPOD(output, offsetData_);
@@ -701,144 +1296,1149 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
         writeBinaryPOD(output, mult_);
         writeBinaryPOD(output, ef_construction_);
 
-        output.write(data_level0_memory_, cur_element_count * size_data_per_element_);
+        writeLevel0Elements(count, [&](const char *elements, size_t size) {
+            output.write(elements, size);
+        });
 
-        for (size_t i = 0; i < cur_element_count; i++) {
-            unsigned int linkListSize = element_levels_[i] > 0 ? size_links_per_element_ * element_levels_[i] : 0;
+        for (size_t i = 0; i < count; i++) {
+            unsigned int linkListSize = size_links_per_element_ * getElementLevel(i);
             writeBinaryPOD(output, linkListSize);
             if (linkListSize)
-                output.write(linkLists_[i], linkListSize);
+                output.write((const char *) get_linklist(i, 1), linkListSize);
         }
-        output.close();
+        if (output.fail())
+            throw std::runtime_error("Cannot write index file");
     }
 
 
-    void loadIndex(const std::string &location, SpaceInterface<dist_t> *s, size_t max_elements_i = 0) {
-        std::ifstream input(location, std::ios::binary);
+    /*
+    * Starts a snapshot of the index as it is now, to be written by writeSnapshot.
+    * No write may be in progress during the call, later writes may run alongside
+    * writeSnapshot. Flat storage cannot be resized until the snapshot is written.
+    */
+    void beginSnapshot() {
+        std::unique_lock <std::mutex> lock_snapshot(snapshot_lock_);
+        if (snapshot_active_)
+            throw std::runtime_error("A snapshot of the index is already being saved");
+
+        std::unique_ptr<Snapshot> snapshot(new Snapshot());
+        {
+            std::unique_lock <std::mutex> templock(global);
+            snapshot->count = cur_element_count;
+            snapshot->max_elements = max_elements_;
+            snapshot->max_level = maxlevel_;
+            snapshot->enterpoint_node = enterpoint_node_;
+        }
+        snapshot->state.assign(snapshot->count, SNAPSHOT_PENDING);
+        snapshot_active_ = true;
+        snapshot_.store(snapshot.release());
+    }
 
+
+    /*
+    * Writes the snapshot started by beginSnapshot in the format of saveIndex and
+    * ends it, whether it could be written or not.
+    */
+    void writeSnapshot(std::ostream &output) {
+        Snapshot *snapshot = snapshot_.load();
+        if (snapshot == nullptr)
+            throw std::runtime_error("No snapshot of the index was started");
+
+        try {
+            writeBinaryPOD(output, offsetLevel0_);
+            writeBinaryPOD(output, snapshot->max_elements);
+            writeBinaryPOD(output, snapshot->count);
+            writeBinaryPOD(output, size_data_per_element_);
+            writeBinaryPOD(output, label_offset_);
+            writeBinaryPOD(output, offsetData_);
+            writeBinaryPOD(output, snapshot->max_level);
+            writeBinaryPOD(output, snapshot->enterpoint_node);
+            writeBinaryPOD(output, maxM_);
+
+            writeBinaryPOD(output, maxM0_);
+            writeBinaryPOD(output, M_);
+            writeBinaryPOD(output, mult_);
+            writeBinaryPOD(output, ef_construction_);
+
+            // levels never change, so only the upper link lists themselves are kept
+            // until the level 0 blocks are out
+            std::string links;
+            std::string element;
+            for (size_t i = 0; i < snapshot->count; i++) {
+                size_t linkListSize = size_links_per_element_ * getElementLevel(i);
+                {
+                    std::unique_lock <ParkingLock> lock_el;
+                    if (!frozen_)
+                        lock_el = std::unique_lock <ParkingLock>(link_list_locks_[i]);
+                    if (snapshot->state[i] == SNAPSHOT_COPIED) {
+                        std::unique_lock <std::mutex> lock_copies(snapshot->copies_lock);
+                        auto copy = snapshot->copies.find(i);
+                        element.swap(copy->second);
+                        snapshot->copies.erase(copy);
+                    } else {
+                        copyElement(i, element);
+                    }
+                    snapshot->state[i] = SNAPSHOT_WRITTEN;
+                }
+                output.write(element.data(), size_data_per_element_);
+                links.append(element, size_data_per_element_, linkListSize);
+                if (output.fail())
+                    throw std::runtime_error("Cannot write index file");
+            }
+
+            const char *next = links.data();
+            for (size_t i = 0; i < snapshot->count; i++) {
+                unsigned int linkListSize = size_links_per_element_ * getElementLevel(i);
+                writeBinaryPOD(output, linkListSize);
+                if (linkListSize)
+                    output.write(next, linkListSize);
+                next += linkListSize;
+            }
+            if (output.fail())
+                throw std::runtime_error("Cannot write index file");
+        } catch (...) {
+            endSnapshot();
+            throw;
+        }
+        endSnapshot();
+    }
+
+
+    // Drops the snapshot, e.g. when it will not be written after all.
+    void endSnapshot() {
+        Snapshot *snapshot = snapshot_.exchange(nullptr);
+        if (snapshot == nullptr)
+            return;
+        // a writer that still sees the snapshot holds the lock of the element it
+        // is changing, and every such element is below cur_element_count
+        size_t count = frozen_ ? 0 : cur_element_count.load();
+        for (size_t i = 0; i < count; i++) {
+            std::unique_lock <ParkingLock> lock_el(link_list_locks_[i]);
+        }
+        delete snapshot;
+
+        std::unique_lock <std::mutex> lock_snapshot(snapshot_lock_);
+        snapshot_active_ = false;
+        snapshot_done_.notify_all();
+    }
+
+
+    /*
+    * Copies an element of the running snapshot aside before it is changed.
+    * Must be called with link_list_locks_[internalId] held.
+    */
+    inline void preserveElement(tableint internalId) {
+        Snapshot *snapshot = snapshot_.load(std::memory_order_acquire);
+        if (snapshot == nullptr || internalId >= snapshot->count || snapshot->state[internalId] != SNAPSHOT_PENDING)
+            return;
+        std::string copy;
+        copyElement(internalId, copy);
+        std::unique_lock <std::mutex> lock_copies(snapshot->copies_lock);
+        snapshot->copies[internalId].swap(copy);
+        snapshot->state[internalId] = SNAPSHOT_COPIED;
+    }
+
+
+    // level 0 block followed by the upper link lists, as saveIndex writes them
+    void copyElement(tableint internalId, std::string &element) const {
+        size_t linkListSize = size_links_per_element_ * getElementLevel(internalId);
+        element.resize(size_data_per_element_);
+        readLevel0(internalId, &element[0]);
+        if (linkListSize)
+            element.append((const char *) get_linklist(internalId, 1), linkListSize);
+    }
+
+
+    /*
+    * Loads an index saved by saveIndex, saveMappableIndex or saveCompactIndex.
+    * Files in the default layout are read in large blocks, level 0 by `num_threads`
+    * threads at once, each with its own stream. The other layouts are mapped and
+    * copied by loadIndexFromBuffer.
+    */
+    void loadIndex(
+        const std::string &location,
+        SpaceInterface<dist_t> *s,
+        size_t max_elements_i = 0,
+        size_t segment_size = 0,
+        size_t num_threads = 1) {
+        std::ifstream input(location, std::ios::binary);
         if (!input.is_open())
             throw std::runtime_error("Cannot open file");
 
+        uint64_t magic = 0;
+        input.read((char *) &magic, sizeof(magic));
+        if (magic == MAPPABLE_MAGIC || magic == COMPACT_MAGIC) {
+            input.close();
+            MappedFile file(location);
+            loadIndexFromBuffer(file.data(), file.size(), s, max_elements_i, segment_size, num_threads);
+            return;
+        }
+
         clear();
-        // get file size:
+        input.clear();
         input.seekg(0, input.end);
-        std::streampos total_filesize = input.tellg();
+        uint64_t total_filesize = (uint64_t) input.tellg();
         input.seekg(0, input.beg);
+        size_t count = readParameters([&](void *value, size_t value_size) {
+            input.read((char *) value, value_size);
+            if (input.fail())
+                throw std::runtime_error("Index seems to be corrupted or unsupported");
+        }, s, max_elements_i);
+
+        uint64_t level0_position = (uint64_t) input.tellg();
+        if (size_data_per_element_ == 0 || count > (total_filesize - level0_position) / size_data_per_element_)
+            throw std::runtime_error("Index seems to be corrupted or unsupported");
+
+        // the upper link lists fill the rest of the file, each one preceded by its size
+        uint64_t links_position = level0_position + count * size_data_per_element_;
+        std::vector<char> links(total_filesize - links_position);
+        input.seekg(links_position, input.beg);
+        readBlocks(input, links.data(), links.size());
+        if (input.fail())
+            throw std::runtime_error("Index seems to be corrupted or unsupported");
+        input.close();
+        checkLinkLists(links.data(), links.size(), count);
+
+        prepareStorage(max_elements_, segment_size);
+        setLinkLists(links.data(), count);
+
+        parallelRanges(count, num_threads, [&](size_t begin, size_t end, size_t part) {
+            std::ifstream part_input(location, std::ios::binary);
+            part_input.seekg(level0_position + begin * size_data_per_element_, part_input.beg);
+            if (split_elements_) {
+                // whole elements are read a block at a time and scattered
+                size_t per_block = std::max((size_t) 1, IO_BLOCK_SIZE / size_data_per_element_);
+                std::vector<char> block(std::min(per_block, end - begin) * size_data_per_element_);
+                for (size_t i = begin; i < end && part_input.good(); i += per_block) {
+                    size_t n = std::min(per_block, end - i);
+                    part_input.read(block.data(), n * size_data_per_element_);
+                    for (size_t j = 0; j < n && part_input.good(); j++) {
+                        writeLevel0((tableint) (i + j), block.data() + j * size_data_per_element_);
+                    }
+                }
+            } else {
+                data_level0_memory_.forEachRun(begin, end, [&](char *run, size_t n) {
+                    readBlocks(part_input, run, n * size_data_per_element_);
+                });
+            }
+            if (!part_input.good())
+                throw std::runtime_error("Index seems to be corrupted or unsupported");
+        });
+        cur_element_count = count;
+
+        rebuildLabelLookup(num_threads);
+    }
+
 
-        readBinaryPOD(input, offsetLevel0_);
-        readBinaryPOD(input, max_elements_);
-        readBinaryPOD(input, cur_element_count);
+    /*
+    * Loads an index from the contents of a file written by saveIndex, saveMappableIndex
+    * or saveCompactIndex.
+    * Level 0 is copied by `num_threads` threads at once and the label lookup is rebuilt
+    * with the same number of threads.
+    */
+    void loadIndexFromBuffer(
+        const char *data,
+        size_t size,
+        SpaceInterface<dist_t> *s,
+        size_t max_elements_i = 0,
+        size_t segment_size = 0,
+        size_t num_threads = 1) {
+        uint64_t magic = 0;
+        if (size >= sizeof(magic))
+            memcpy(&magic, data, sizeof(magic));
+        if (magic == MAPPABLE_MAGIC) {
+            loadMappableIndexFromBuffer(data, size, s, max_elements_i, segment_size, num_threads);
+            return;
+        }
+        if (magic == COMPACT_MAGIC) {
+            loadCompactIndexFromBuffer(data, size, s, max_elements_i, segment_size, num_threads);
+            return;
+        }
+
+        clear();
+        size_t position = 0;
+        size_t count = readParameters([&](void *value, size_t value_size) {
+            if (size - position < value_size)
+                throw std::runtime_error("Index seems to be corrupted or unsupported");
+            memcpy(value, data + position, value_size);
+            position += value_size;
+        }, s, max_elements_i);
+
+        if (size_data_per_element_ == 0 || count > (size - position) / size_data_per_element_)
+            throw std::runtime_error("Index seems to be corrupted or unsupported");
+        const char *level0 = data + position;
+
+        // the upper link lists fill the rest of the file, each one preceded by its size
+        const char *links = level0 + count * size_data_per_element_;
+        checkLinkLists(links, size - (links - data), count);
+
+        prepareStorage(max_elements_, segment_size);
+        setLinkLists(links, count);
+
+        copyLevel0(level0, count, num_threads);
+        cur_element_count = count;
+
+        rebuildLabelLookup(num_threads);
+    }
+
+
+    /*
+    * Reads the parameters at the start of a file in the default layout with `read`
+    * and takes them over. Returns the number of elements in the file.
+    */
+    template<typename Read>
+    size_t readParameters(Read read, SpaceInterface<dist_t> *s, size_t max_elements_i) {
+        read(&offsetLevel0_, sizeof(offsetLevel0_));
+        size_t stored_max_elements = 0;
+        read(&stored_max_elements, sizeof(stored_max_elements));
+        size_t count = 0;
+        read(&count, sizeof(count));
 
         size_t max_elements = max_elements_i;
-        if (max_elements < cur_element_count)
-            max_elements = max_elements_;
+        if (max_elements < count)
+            max_elements = stored_max_elements;
         max_elements_ = max_elements;
-        readBinaryPOD(input, size_data_per_element_);
-        readBinaryPOD(input, label_offset_);
-        readBinaryPOD(input, offsetData_);
-        readBinaryPOD(input, maxlevel_);
-        readBinaryPOD(input, enterpoint_node_);
-
-        readBinaryPOD(input, maxM_);
-        readBinaryPOD(input, maxM0_);
-        readBinaryPOD(input, M_);
-        readBinaryPOD(input, mult_);
-        readBinaryPOD(input, ef_construction_);
+        read(&size_data_per_element_, sizeof(size_data_per_element_));
+        read(&label_offset_, sizeof(label_offset_));
+        read(&offsetData_, sizeof(offsetData_));
+        read(&maxlevel_, sizeof(maxlevel_));
+        read(&enterpoint_node_, sizeof(enterpoint_node_));
+
+        read(&maxM_, sizeof(maxM_));
+        read(&maxM0_, sizeof(maxM0_));
+        read(&M_, sizeof(M_));
+        read(&mult_, sizeof(mult_));
+        read(&ef_construction_, sizeof(ef_construction_));
 
         data_size_ = s->get_data_size();
         fstdistfunc_ = s->get_dist_func();
         dist_func_param_ = s->get_dist_func_param();
+        size_links_per_element_ = maxM_ * sizeof(tableint) + sizeof(linklistsizeint);
+        size_links_level0_ = maxM0_ * sizeof(tableint) + sizeof(linklistsizeint);
+        return count;
+    }
 
-        auto pos = input.tellg();
 
-        /// Optional - check if index is ok:
-        input.seekg(cur_element_count * size_data_per_element_, input.cur);
-        for (size_t i = 0; i < cur_element_count; i++) {
-            if (input.tellg() < 0 || input.tellg() >= total_filesize) {
+    // throws unless `links` holds exactly `count` upper link lists, each preceded by its size
+    static void checkLinkLists(const char *links, size_t links_size, size_t count) {
+        size_t offset = 0;
+        for (size_t i = 0; i < count; i++) {
+            unsigned int linkListSize;
+            if (links_size - offset < sizeof(linkListSize))
                 throw std::runtime_error("Index seems to be corrupted or unsupported");
-            }
+            memcpy(&linkListSize, links + offset, sizeof(linkListSize));
+            offset += sizeof(linkListSize);
+            if (links_size - offset < linkListSize)
+                throw std::runtime_error("Index seems to be corrupted or unsupported");
+            offset += linkListSize;
+        }
+        if (offset != links_size)
+            throw std::runtime_error("Index seems to be corrupted or unsupported");
+    }
+
+
+    void prepareStorage(size_t max_elements, size_t segment_size) {
+        segment_shift_ = getSegmentShift(segment_size);
+        allocateStorage(max_elements);
+        std::vector<std::mutex>(labelOperationLockCount(max_elements)).swap(label_op_locks_);
+        revSize_ = 1.0 / mult_;
+        ef_ = 10;
+    }
 
+
+    // copies the upper link lists checked by checkLinkLists into the arena
+    void setLinkLists(const char *links, size_t count) {
+        size_t offset = 0;
+        for (size_t i = 0; i < count; i++) {
             unsigned int linkListSize;
-            readBinaryPOD(input, linkListSize);
-            if (linkListSize != 0) {
-                input.seekg(linkListSize, input.cur);
+            memcpy(&linkListSize, links + offset, sizeof(linkListSize));
+            offset += sizeof(linkListSize);
+            int level = linkListSize / size_links_per_element_;
+            element_levels_[i] = level;
+            linkLists_[i] = nullptr;
+            if (level) {
+                linkLists_[i] = allocateLinkLists(level);
+                memcpy(linkLists_[i], links + offset, level * size_links_per_element_);
             }
+            offset += linkListSize;
         }
+    }
 
-        // throw exception if it either corrupted or old index
-        if (input.tellg() != total_filesize)
-            throw std::runtime_error("Index seems to be corrupted or unsupported");
 
-        input.clear();
-        /// Optional check end
+    static void readBlocks(std::istream &in, char *data, size_t size) {
+        for (size_t offset = 0; offset < size && in.good(); offset += IO_BLOCK_SIZE) {
+            in.read(data + offset, std::min(IO_BLOCK_SIZE, size - offset));
+        }
+    }
 
-        input.seekg(pos, input.beg);
 
-        data_level0_memory_ = (char *) malloc(max_elements * size_data_per_element_);
-        if (data_level0_memory_ == nullptr)
-            throw std::runtime_error("Not enough memory: loadIndex failed to allocate level0");
-        input.read(data_level0_memory_, cur_element_count * size_data_per_element_);
+    void copyLevel0(const char *level0, size_t count, size_t num_threads) {
+        parallelRanges(count, num_threads, [&](size_t begin, size_t end, size_t part) {
+            if (split_elements_) {
+                for (size_t i = begin; i < end; i++) {
+                    writeLevel0((tableint) i, level0 + i * size_data_per_element_);
+                }
+                return;
+            }
+            const char *source = level0 + begin * size_data_per_element_;
+            data_level0_memory_.forEachRun(begin, end, [&](char *run, size_t n) {
+                memcpy(run, source, n * size_data_per_element_);
+                source += n * size_data_per_element_;
+            });
+        });
+    }
 
-        size_links_per_element_ = maxM_ * sizeof(tableint) + sizeof(linklistsizeint);
 
+    /*
+    * Rebuilds label_lookup_, num_deleted_ and deleted_elements from the loaded elements.
+    * Each thread sorts the labels of a range of elements by shard, then each thread
+    * fills a range of shards. Later elements win for duplicated labels, as when the
+    * lookup is filled in order.
+    */
+    void rebuildLabelLookup(size_t num_threads) {
+        size_t count = cur_element_count;
+        size_t parts = std::max((size_t) 1, std::min(num_threads, count));
+        std::vector<std::vector<std::vector<tableint>>> ids(parts, std::vector<std::vector<tableint>>(LABEL_LOOKUP_SHARDS));
+        std::vector<std::vector<tableint>> deleted(parts);
+
+        parallelRanges(count, parts, [&](size_t begin, size_t end, size_t part) {
+            for (size_t i = begin; i < end; i++) {
+                ids[part][getLabelLookupShardIndex(getExternalLabel(i))].push_back(i);
+                if (isMarkedDeleted(i))
+                    deleted[part].push_back(i);
+            }
+        });
+        parallelRanges(LABEL_LOOKUP_SHARDS, parts, [&](size_t begin, size_t end, size_t part) {
+            for (size_t shard = begin; shard < end; shard++) {
+                size_t shard_size = 0;
+                for (size_t p = 0; p < parts; p++) {
+                    shard_size += ids[p][shard].size();
+                }
+                LabelMap &labels = label_lookup_[shard].labels;
+                if (!labels.reserve(shard_size))
+                    throw std::runtime_error("Not enough memory: HierarchicalNSW failed to allocate the label lookup");
+                for (size_t p = 0; p < parts; p++) {
+                    for (tableint id : ids[p][shard]) {
+                        labels.set(getExternalLabel(id), id);
+                    }
+                }
+            }
+        });
+
+        num_deleted_ = 0;
+        for (const std::vector<tableint> &part : deleted) {
+            num_deleted_ += part.size();
+            if (allow_replace_deleted_)
+                deleted_elements.insert(part.begin(), part.end());
+        }
+    }
+
+
+    /*
+    * Runs fn(begin, end, part) for `parts` consecutive ranges of [0, count), each on its own thread.
+    */
+    template<typename Function>
+    static void parallelRanges(size_t count, size_t parts, Function fn) {
+        parts = std::max((size_t) 1, std::min(parts, count));
+        if (parts == 1) {
+            fn(0, count, 0);
+            return;
+        }
+
+        std::vector<std::thread> threads;
+        std::exception_ptr last_exception = nullptr;
+        std::mutex last_exception_lock;
+        for (size_t part = 0; part < parts; part++) {
+            threads.push_back(std::thread([&, part] {
+                try {
+                    fn(count / parts * part + std::min(part, count % parts),
+                       count / parts * (part + 1) + std::min(part + 1, count % parts), part);
+                } catch (...) {
+                    std::unique_lock<std::mutex> lock(last_exception_lock);
+                    last_exception = std::current_exception();
+                }
+            }));
+        }
+        for (std::thread &thread : threads) {
+            thread.join();
+        }
+        if (last_exception)
+            std::rethrow_exception(last_exception);
+    }
+
+
+    static uint64_t alignToMappable(uint64_t offset) {
+        return (offset + MAPPABLE_ALIGNMENT - 1) / MAPPABLE_ALIGNMENT * MAPPABLE_ALIGNMENT;
+    }
+
+
+    static uint64_t hashLabel(labeltype label) {
+        return LabelMap::hash((uint64_t) label);
+    }
+
+
+    // LabelMap picks slots by the low bits of the hash, shards use the high ones
+    static size_t getLabelLookupShardIndex(labeltype label) {
+        return (hashLabel(label) >> 32) % LABEL_LOOKUP_SHARDS;
+    }
+
+
+    LabelLookupShard &getLabelLookupShard(labeltype label) {
+        return label_lookup_[getLabelLookupShardIndex(label)];
+    }
+
+
+    const LabelLookupShard &getLabelLookupShard(labeltype label) const {
+        return label_lookup_[getLabelLookupShardIndex(label)];
+    }
+
+
+    /*
+    * Looks up the internal id of an element by its label, taking the lock of its shard.
+    */
+    bool findInternalId(labeltype label, tableint &internal_id) const {
+        if (mapped_labels_) {
+            for (size_t slot = hashLabel(label) & mapped_label_mask_;; slot = (slot + 1) & mapped_label_mask_) {
+                const MappableLabelSlot &entry = mapped_labels_[slot];
+                if (entry.internal_id == EMPTY_LABEL_SLOT)
+                    return false;
+                if (entry.label == (uint64_t) label) {
+                    internal_id = (tableint) entry.internal_id;
+                    return true;
+                }
+            }
+        }
+        const LabelLookupShard &shard = getLabelLookupShard(label);
+        std::unique_lock <std::mutex> lock_shard(shard.lock, std::defer_lock);
+        if (!frozen_)
+            lock_shard.lock();
+        return shard.labels.find(label, internal_id);
+    }
+
+
+    /*
+    * Saves the index in a layout that loadMappableIndex can serve straight from a
+    * memory-mapped file, see MappableIndexHeader. loadIndex reads it as well.
+    * `location` is truncated, so a file that may still be mapped should be
+    * replaced by writing next to it and renaming, see Index::saveIndex.
+    */
+    void saveMappableIndex(const std::string &location) {
+        std::ofstream output(location, std::ios::binary);
+        if (!output.is_open())
+            throw std::runtime_error("Cannot open file");
+        saveMappableIndex(output);
+        output.close();
+    }
+
+
+    void saveMappableIndex(std::ostream &output) {
+        size_t count = cur_element_count;
+        std::vector<uint64_t> link_offsets(count + 1, 0);
+        for (size_t i = 0; i < count; i++) {
+            link_offsets[i + 1] = link_offsets[i] + size_links_per_element_ * getElementLevel(i);
+        }
+
+        // at most half full, so that every probe sequence ends at an empty slot
+        size_t label_slots = 2;
+        while (label_slots < 2 * count)
+            label_slots <<= 1;
+        std::vector<MappableLabelSlot> labels(label_slots, MappableLabelSlot{0, EMPTY_LABEL_SLOT});
+        for (size_t i = 0; i < count; i++) {
+            labeltype label = getExternalLabel(i);
+            size_t slot = hashLabel(label) & (label_slots - 1);
+            while (labels[slot].internal_id != EMPTY_LABEL_SLOT && labels[slot].label != (uint64_t) label)
+                slot = (slot + 1) & (label_slots - 1);
+            labels[slot].label = label;
+            labels[slot].internal_id = i;
+        }
+
+        MappableIndexHeader header;
+        memset(&header, 0, sizeof(header));
+        header.magic = MAPPABLE_MAGIC;
+        header.version = MAPPABLE_VERSION;
+        header.max_elements = max_elements_;
+        header.element_count = count;
+        header.deleted_count = num_deleted_;
+        header.size_data_per_element = size_data_per_element_;
+        header.label_offset = label_offset_;
+        header.offset_data = offsetData_;
+        header.max_level = maxlevel_;
+        header.enterpoint_node = enterpoint_node_;
+        header.max_m = maxM_;
+        header.max_m0 = maxM0_;
+        header.m = M_;
+        header.mult = mult_;
+        header.ef_construction = ef_construction_;
+        header.level0_offset = alignToMappable(sizeof(header));
+        header.link_offsets_offset = alignToMappable(header.level0_offset + count * size_data_per_element_);
+        header.links_offset = alignToMappable(header.link_offsets_offset + (count + 1) * sizeof(uint64_t));
+        header.links_size = link_offsets[count];
+        header.labels_offset = alignToMappable(header.links_offset + header.links_size);
+        header.label_slots = label_slots;
+
+        uint64_t position = 0;
+        auto write = [&](const char *data, size_t size) {
+            output.write(data, size);
+            position += size;
+        };
+        auto pad = [&](uint64_t offset) {
+            static const char zeros[MAPPABLE_ALIGNMENT] = {};
+            write(zeros, offset - position);
+        };
+
+        write((const char *) &header, sizeof(header));
+        pad(header.level0_offset);
+        writeLevel0Elements(count, write);
+        pad(header.link_offsets_offset);
+        write((const char *) link_offsets.data(), link_offsets.size() * sizeof(uint64_t));
+        pad(header.links_offset);
+        for (size_t i = 0; i < count; i++) {
+            if (link_offsets[i + 1] != link_offsets[i])
+                write((const char *) get_linklist(i, 1), link_offsets[i + 1] - link_offsets[i]);
+        }
+        pad(header.labels_offset);
+        write((const char *) labels.data(), labels.size() * sizeof(MappableLabelSlot));
+
+        if (output.fail())
+            throw std::runtime_error("Cannot write index file");
+    }
+
+
+    /*
+    * Serves a file written by saveMappableIndex from memory-mapped storage. Nothing is read
+    * up front: the level 0 data, upper link lists and label table are used in place from the
+    * mapped file, which is shared through the page cache with every other process mapping it.
+    * Such an index cannot be resized or modified.
+    */
+    void loadMappableIndex(const std::string &location, SpaceInterface<dist_t> *s) {
+        std::unique_ptr<MappedFile> file(new MappedFile(location));
+        MappableIndexHeader header = readMappableHeader(file->data(), file->size(), s);
+        size_t count = header.element_count;
+
+        split_elements_ = false;  // the file holds interleaved elements
+        if (!data_level0_memory_.attach(file->data() + header.level0_offset, count, size_data_per_element_))
+            throw std::runtime_error("Not enough memory");
+        mapped_link_offsets_ = (const uint64_t *) (file->data() + header.link_offsets_offset);
+        mapped_links_ = file->data() + header.links_offset;
+        mapped_labels_ = (const MappableLabelSlot *) (file->data() + header.labels_offset);
+        mapped_label_mask_ = header.label_slots - 1;
+        max_elements_ = count;
+        visited_list_pool_ = std::unique_ptr<VisitedListPool>(new VisitedListPool(1, count));
+        cur_element_count = count;
+        mapped_file_ = std::move(file);
+    }
+
+
+    /*
+    * Loads the contents of a file written by saveMappableIndex into regular storage with
+    * room for `max_elements_i` elements using `num_threads` threads, like loadIndexFromBuffer.
+    */
+    void loadMappableIndexFromBuffer(
+        const char *data,
+        size_t size,
+        SpaceInterface<dist_t> *s,
+        size_t max_elements_i = 0,
+        size_t segment_size = 0,
+        size_t num_threads = 1) {
+        MappableIndexHeader header = readMappableHeader(data, size, s);
+        size_t count = header.element_count;
+        const uint64_t *link_offsets = (const uint64_t *) (data + header.link_offsets_offset);
+
+        size_t max_elements = max_elements_i < count ? (size_t) max_elements_ : max_elements_i;
+        max_elements_ = max_elements;
+        segment_shift_ = getSegmentShift(segment_size);
+        allocateStorage(max_elements);
+
+        const char *links = data + header.links_offset;
+        for (size_t i = 0; i < count; i++) {
+            int level = (int) ((link_offsets[i + 1] - link_offsets[i]) / size_links_per_element_);
+            element_levels_[i] = level;
+            linkLists_[i] = nullptr;
+            if (level) {
+                linkLists_[i] = allocateLinkLists(level);
+                memcpy(linkLists_[i], links + link_offsets[i], level * size_links_per_element_);
+            }
+        }
+
+        copyLevel0(data + header.level0_offset, count, num_threads);
+        cur_element_count = count;
+
+        rebuildLabelLookup(num_threads);
+    }
+
+
+    /*
+    * Checks the header of a mappable file and takes over its parameters, leaving the index empty.
+    */
+    MappableIndexHeader readMappableHeader(const char *data, size_t size, SpaceInterface<dist_t> *s) {
+        MappableIndexHeader header;
+        if (size < sizeof(header))
+            throw std::runtime_error("Index seems to be corrupted or unsupported");
+        memcpy(&header, data, sizeof(header));
+        if (header.magic != MAPPABLE_MAGIC)
+            throw std::runtime_error("The index file was not saved in the mappable format");
+        if (header.version != MAPPABLE_VERSION)
+            throw std::runtime_error("Unsupported mappable index format version");
+        checkMappableHeader(header, data, size);
+
+        clear();
+        max_elements_ = header.max_elements;
+        num_deleted_ = header.deleted_count;
+        size_data_per_element_ = header.size_data_per_element;
+        label_offset_ = header.label_offset;
+        offsetData_ = header.offset_data;
+        offsetLevel0_ = 0;
+        maxlevel_ = (int) header.max_level;
+        enterpoint_node_ = (tableint) header.enterpoint_node;
+        maxM_ = header.max_m;
+        maxM0_ = header.max_m0;
+        M_ = header.m;
+        mult_ = header.mult;
+        ef_construction_ = header.ef_construction;
+
+        data_size_ = s->get_data_size();
+        fstdistfunc_ = s->get_dist_func();
+        dist_func_param_ = s->get_dist_func_param();
+        size_links_per_element_ = maxM_ * sizeof(tableint) + sizeof(linklistsizeint);
         size_links_level0_ = maxM0_ * sizeof(tableint) + sizeof(linklistsizeint);
-        std::vector<std::mutex>(max_elements).swap(link_list_locks_);
-        std::vector<std::mutex>(MAX_LABEL_OPERATION_LOCKS).swap(label_op_locks_);
+        std::vector<std::mutex>(labelOperationLockCount(max_elements_)).swap(label_op_locks_);
+        revSize_ = 1.0 / mult_;
+        ef_ = 10;
+        return header;
+    }
+
 
-        visited_list_pool_.reset(new VisitedListPool(1, max_elements));
+    /*
+    * Checks that the sections described by a mappable header lie inside the file.
+    * Then, in passes linear in the number of elements, that the link offsets grow by
+    * whole upper link lists, that no element is above the top level and that upper
+    * link lists only point to elements that reach their level, so that get_linklist
+    * stays inside the mapping whatever the file holds.
+    */
+    void checkMappableHeader(const MappableIndexHeader &header, const char *data, uint64_t file_size) const {
+        uint64_t count = header.element_count;
+        bool ok = count <= header.max_elements && count < (uint64_t) std::numeric_limits<tableint>::max() &&
+            header.size_data_per_element > 0 && header.max_m > 0 &&
+            header.max_m <= std::numeric_limits<unsigned short>::max() &&
+            (count == 0 || header.max_level >= 0) &&
+            header.level0_offset % MAPPABLE_ALIGNMENT == 0 &&
+            header.link_offsets_offset % MAPPABLE_ALIGNMENT == 0 &&
+            header.links_offset % MAPPABLE_ALIGNMENT == 0 &&
+            header.labels_offset % MAPPABLE_ALIGNMENT == 0 &&
+            header.level0_offset <= file_size && header.link_offsets_offset <= file_size &&
+            header.links_offset <= file_size && header.labels_offset <= file_size &&
+            count <= (file_size - header.level0_offset) / header.size_data_per_element &&
+            count + 1 <= (file_size - header.link_offsets_offset) / sizeof(uint64_t) &&
+            header.links_size <= file_size - header.links_offset &&
+            header.label_slots > count && (header.label_slots & (header.label_slots - 1)) == 0 &&
+            header.label_slots <= (file_size - header.labels_offset) / sizeof(MappableLabelSlot) &&
+            (count == 0 || header.enterpoint_node < count);
+        if (!ok)
+            throw std::runtime_error("Index seems to be corrupted or unsupported");
+
+        const uint64_t *link_offsets = (const uint64_t *) (data + header.link_offsets_offset);
+        uint64_t list_size = header.max_m * sizeof(tableint) + sizeof(linklistsizeint);
+        ok = link_offsets[0] == 0 && link_offsets[count] == header.links_size;
+        for (uint64_t i = 0; ok && i < count; i++) {
+            ok = link_offsets[i] <= link_offsets[i + 1] &&
+                (link_offsets[i + 1] - link_offsets[i]) % list_size == 0 &&
+                (link_offsets[i + 1] - link_offsets[i]) / list_size <= (uint64_t) header.max_level;
+        }
+        auto level = [&](uint64_t i) {
+            return (link_offsets[i + 1] - link_offsets[i]) / list_size;
+        };
+        ok = ok && (count == 0 || level(header.enterpoint_node) == (uint64_t) header.max_level);
+        const char *links = data + header.links_offset;
+        for (uint64_t i = 0; ok && i < count; i++) {
+            for (uint64_t l = 1; ok && l <= level(i); l++) {
+                const linklistsizeint *ll = (const linklistsizeint *) (links + link_offsets[i] + (l - 1) * list_size);
+                unsigned short size = *((const unsigned short *) ll);
+                const tableint *ids = (const tableint *) (ll + 1);
+                ok = size <= header.max_m;
+                for (unsigned short j = 0; ok && j < size; j++) {
+                    ok = ids[j] < count && level(ids[j]) >= l;
+                }
+            }
+        }
+        if (!ok)
+            throw std::runtime_error("Index seems to be corrupted or unsupported");
+    }
+
+
+    /*
+    * Saves the index in the compact layout described at CompactIndexHeader.
+    * loadIndex reads it back. `space` and `dim` are recorded in the header for
+    * the caller to check on load, see readCompactHeader.
+    */
+    void saveCompactIndex(const std::string &location, const std::string &space = "", size_t dim = 0) {
+        std::ofstream output(location, std::ios::binary);
+        if (!output.is_open())
+            throw std::runtime_error("Cannot open file");
+        saveCompactIndex(output, space, dim);
+        output.close();
+    }
+
+
+    void saveCompactIndex(std::ostream &output, const std::string &space = "", size_t dim = 0) {
+        size_t count = cur_element_count;
+        size_t block_count = (count + COMPACT_BLOCK_ELEMENTS - 1) / COMPACT_BLOCK_ELEMENTS;
+        std::vector<CompactLinkBlock> blocks(block_count + 1);
+        std::string links;
+        std::vector<tableint> neighbors;
+        uint64_t upper_levels = 0;
+        for (size_t i = 0; i < count; i++) {
+            if (i % COMPACT_BLOCK_ELEMENTS == 0)
+                blocks[i / COMPACT_BLOCK_ELEMENTS] = CompactLinkBlock{links.size(), upper_levels};
+            int level = getElementLevel(i);
+            writeVarint(links, (uint32_t) level * 2 + (isMarkedDeleted(i) ? 1 : 0));
+            for (int l = 0; l <= level; l++) {
+                linklistsizeint *ll = get_linklist_at_level(i, l);
+                tableint *ids = (tableint *) (ll + 1);
+                neighbors.assign(ids, ids + getListCount(ll));
+                std::sort(neighbors.begin(), neighbors.end());
+                writeVarint(links, (uint32_t) neighbors.size());
+                tableint previous = 0;
+                for (tableint id : neighbors) {
+                    writeVarint(links, id - previous);
+                    previous = id;
+                }
+            }
+            upper_levels += level;
+        }
+        blocks[block_count] = CompactLinkBlock{links.size(), upper_levels};
+
+        CompactIndexHeader header;
+        memset(&header, 0, sizeof(header));
+        header.magic = COMPACT_MAGIC;
+        header.version = COMPACT_VERSION;
+        header.max_elements = max_elements_;
+        header.element_count = count;
+        header.data_size = data_size_;
+        header.max_level = maxlevel_;
+        header.enterpoint_node = enterpoint_node_;
+        header.max_m = maxM_;
+        header.max_m0 = maxM0_;
+        header.m = M_;
+        header.mult = mult_;
+        header.ef_construction = ef_construction_;
+        header.block_count = block_count;
+        header.links_size = links.size();
+        header.dim = dim;
+        header.deleted_count = num_deleted_;
+        header.flags = alignedElements() ? COMPACT_ALIGNED_ELEMENTS : 0;
+        if (space.size() >= sizeof(header.space))
+            throw std::runtime_error("The name of the space is too long");
+        memcpy(header.space, space.data(), space.size());
+
+        // the output may not be seekable, so the labels and vectors are read
+        // once for their checksums before the header is written
+        header.section_crcs[0] = crc32c(blocks.data(), blocks.size() * sizeof(CompactLinkBlock));
+        header.section_crcs[1] = crc32c(links.data(), links.size());
+        std::vector<char> vector(data_size_);
+        for (tableint i = 0; i < count; i++) {
+            labeltype label = getExternalLabel(i);
+            header.section_crcs[2] = crc32c(&label, sizeof(label), header.section_crcs[2]);
+            copyVectors(&i, 1, vector.data());
+            header.section_crcs[3] = crc32c(vector.data(), data_size_, header.section_crcs[3]);
+        }
+        header.header_crc = crc32c(&header, sizeof(header));
+
+        output.write((const char *) &header, sizeof(header));
+        output.write((const char *) blocks.data(), blocks.size() * sizeof(CompactLinkBlock));
+        output.write(links.data(), links.size());
+        for (size_t i = 0; i < count; i++) {
+            labeltype label = getExternalLabel(i);
+            output.write((const char *) &label, sizeof(label));
+        }
+        for (tableint i = 0; i < count; i++) {
+            copyVectors(&i, 1, vector.data());
+            output.write(vector.data(), data_size_);
+        }
+
+        if (output.fail())
+            throw std::runtime_error("Cannot write index file");
+    }
 
-        linkLists_ = (char **) malloc(sizeof(void *) * max_elements);
-        if (linkLists_ == nullptr)
-            throw std::runtime_error("Not enough memory: loadIndex failed to allocate linklists");
-        element_levels_ = std::vector<int>(max_elements);
+
+    /*
+    * Serves a file written by saveCompactIndex with only the graph, the labels and a
+    * code of one byte per dimension of each vector in memory, see TieredVectors.
+    * Searches walk the graph on the codes, then read the full vectors of their best
+    * max(ef_, k) candidates from the file to return the k closest by exact distance.
+    * The last `cache_size` vectors read are kept in memory. The index is frozen.
+    * Only for indexes of float vectors.
+    */
+    void loadTieredIndex(
+        const std::string &location,
+        SpaceInterface<dist_t> *s,
+        size_t cache_size = 4096,
+        size_t num_threads = 1) {
+        size_t dim = *((size_t *) s->get_dist_func_param());
+        if (s->get_data_size() != dim * sizeof(float))
+            throw std::runtime_error("Only indexes of float vectors can keep their vectors on disk");
+        std::unique_ptr<TieredVectors> tiered(new TieredVectors(location, dim, cache_size));
+        MappedFile file(location);
+        CompactIndexHeader header;
+        if (!readCompactHeader(file.data(), file.size(), header))
+            throw std::runtime_error("The index file was not saved in the compact format");
+        loadCompactIndexFromBuffer(file.data(), file.size(), s, 0, 0, num_threads, std::move(tiered));
+
+        vector_dist_func_ = fstdistfunc_;
+        vector_dist_func_param_ = dist_func_param_;
+        if (dynamic_cast<InnerProductSpace *>(s) != nullptr)
+            fstdistfunc_ = TieredVectors::codeInnerProductDistance<dist_t>;
+        else
+            fstdistfunc_ = TieredVectors::codeL2Sqr<dist_t>;
+        dist_func_param_ = (void *) tiered_->codeParam();
+        freeze();
+    }
+
+
+    /*
+    * Loads the contents of a file written by saveCompactIndex into regular storage with
+    * room for `max_elements_i` elements, decoding blocks of elements on `num_threads`
+    * threads at once. With `tiered`, `data` must be the whole file it reads the vectors
+    * from, and only their codes are stored, see loadTieredIndex.
+    */
+    void loadCompactIndexFromBuffer(
+        const char *data,
+        size_t size,
+        SpaceInterface<dist_t> *s,
+        size_t max_elements_i = 0,
+        size_t segment_size = 0,
+        size_t num_threads = 1,
+        std::unique_ptr<TieredVectors> tiered = nullptr) {
+        CompactIndexHeader header;
+        readCompactHeader(data, size, header);
+        size_t header_size = compactHeaderSize(header.version);
+
+        uint64_t count = header.element_count;
+        uint64_t available = size - header_size;
+        bool ok = header.data_size == s->get_data_size() && count <= header.max_elements &&
+            count < (uint64_t) std::numeric_limits<tableint>::max() &&
+            header.max_m > 0 && header.max_m <= 0xffff && header.max_m0 <= 0xffff &&
+            header.block_count == (count + COMPACT_BLOCK_ELEMENTS - 1) / COMPACT_BLOCK_ELEMENTS &&
+            header.block_count + 1 <= available / sizeof(CompactLinkBlock) &&
+            (count == 0 || header.enterpoint_node < count);
+        if (ok) {
+            available -= (header.block_count + 1) * sizeof(CompactLinkBlock);
+            ok = header.links_size <= available &&
+                count <= (available - header.links_size) / (sizeof(labeltype) + header.data_size);
+        }
+        if (!ok)
+            throw std::runtime_error("Index seems to be corrupted or unsupported");
+
+        const CompactLinkBlock *blocks = (const CompactLinkBlock *) (data + header_size);
+        const char *links = (const char *) (blocks + header.block_count + 1);
+        const char *labels = links + header.links_size;
+        const char *vectors = labels + count * sizeof(labeltype);
+        if (header.version >= 2) {
+            const char *sections[] = {(const char *) blocks, links, labels, vectors};
+            size_t sizes[] = {(header.block_count + 1) * sizeof(CompactLinkBlock), header.links_size,
+                              count * sizeof(labeltype), count * header.data_size};
+            for (int i = 0; i < 4; i++) {
+                if (parallelCrc32c(sections[i], sizes[i], num_threads) != header.section_crcs[i])
+                    throw std::runtime_error("The index file is corrupted, a checksum does not match");
+            }
+        }
+        for (size_t b = 0; b < header.block_count; b++) {
+            if (blocks[b + 1].links_offset < blocks[b].links_offset || blocks[b + 1].upper_levels < blocks[b].upper_levels)
+                throw std::runtime_error("Index seems to be corrupted or unsupported");
+        }
+        if (blocks[0].links_offset != 0 || blocks[0].upper_levels != 0 ||
+            blocks[header.block_count].links_offset != header.links_size)
+            throw std::runtime_error("Index seems to be corrupted or unsupported");
+
+        clear();
+        max_elements_ = header.max_elements;
+        maxM_ = header.max_m;
+        maxM0_ = header.max_m0;
+        M_ = header.m;
+        mult_ = header.mult;
+        ef_construction_ = header.ef_construction;
         revSize_ = 1.0 / mult_;
         ef_ = 10;
-        for (size_t i = 0; i < cur_element_count; i++) {
-            label_lookup_[getExternalLabel(i)] = i;
-            unsigned int linkListSize;
-            readBinaryPOD(input, linkListSize);
-            if (linkListSize == 0) {
-                element_levels_[i] = 0;
-                linkLists_[i] = nullptr;
-            } else {
-                element_levels_[i] = linkListSize / size_links_per_element_;
-                linkLists_[i] = (char *) malloc(linkListSize);
-                if (linkLists_[i] == nullptr)
-                    throw std::runtime_error("Not enough memory: loadIndex failed to allocate linklist");
-                input.read(linkLists_[i], linkListSize);
+
+        // level 0 blocks get the layout the constructor gives them
+        data_size_ = s->get_data_size();
+        fstdistfunc_ = s->get_dist_func();
+        dist_func_param_ = s->get_dist_func_param();
+        size_links_per_element_ = maxM_ * sizeof(tableint) + sizeof(linklistsizeint);
+        setElementLayout((header.flags & COMPACT_ALIGNED_ELEMENTS) != 0);
+        maxlevel_ = (int) header.max_level;
+        enterpoint_node_ = (tableint) header.enterpoint_node;
+        if (tiered) {
+            tiered->setVectors(vectors - data, vectors, count);
+            tiered_ = std::move(tiered);
+            split_elements_ = true;
+        }
+
+        size_t max_elements = max_elements_i < count ? (size_t) max_elements_ : max_elements_i;
+        max_elements_ = max_elements;
+        segment_shift_ = getSegmentShift(segment_size);
+        allocateStorage(max_elements);
+        std::vector<std::mutex>(labelOperationLockCount(max_elements)).swap(label_op_locks_);
+
+        parallelRanges(header.block_count, num_threads, [&](size_t begin, size_t end, size_t part) {
+            for (size_t b = begin; b < end; b++) {
+                decodeCompactBlock(b, count, blocks, links, labels, vectors);
             }
+        });
+        cur_element_count = count;
+
+        rebuildLabelLookup(num_threads);
+        if (header.version >= 2 && num_deleted_ != header.deleted_count)
+            throw std::runtime_error("Index seems to be corrupted or unsupported");
+    }
+
+
+    /*
+    * Reads the header of a file written by saveCompactIndex and checks its own
+    * checksum. Returns false if the data is not in the compact format. Fields
+    * missing from version 1 headers are left zero.
+    */
+    static bool readCompactHeader(const char *data, size_t size, CompactIndexHeader &header) {
+        memset(&header, 0, sizeof(header));
+        if (size < 2 * sizeof(uint64_t))
+            return false;
+        memcpy(&header, data, 2 * sizeof(uint64_t));
+        if (header.magic != COMPACT_MAGIC)
+            return false;
+        if (header.version == 0 || header.version > COMPACT_VERSION)
+            throw std::runtime_error("Unsupported compact index format version");
+        size_t header_size = compactHeaderSize(header.version);
+        if (size < header_size)
+            throw std::runtime_error("Index seems to be corrupted or unsupported");
+        memcpy(&header, data, header_size);
+        if (header.version >= 2) {
+            uint32_t crc = header.header_crc;
+            header.header_crc = 0;
+            if (crc32c(&header, sizeof(header)) != crc)
+                throw std::runtime_error("The index file is corrupted, a checksum does not match");
+            header.header_crc = crc;
+        }
+        return true;
+    }
+
+
+    static size_t compactHeaderSize(uint64_t version) {
+        return version == 1 ? offsetof(CompactIndexHeader, dim) : sizeof(CompactIndexHeader);
+    }
+
+
+    /*
+    * CRC-32C of `size` bytes, computed in up to `parts` pieces of at least 1 MB
+    * on separate threads.
+    */
+    static uint32_t parallelCrc32c(const char *data, size_t size, size_t parts) {
+        parts = std::max((size_t) 1, std::min(parts, size >> 20));
+        std::vector<uint32_t> crcs(parts, 0);
+        std::vector<size_t> sizes(parts, 0);
+        parallelRanges(size, parts, [&](size_t begin, size_t end, size_t part) {
+            crcs[part] = crc32c(data + begin, end - begin);
+            sizes[part] = end - begin;
+        });
+        uint32_t crc = crcs[0];
+        for (size_t part = 1; part < parts; part++) {
+            crc = crc32cCombine(crc, crcs[part], sizes[part]);
         }
+        return crc;
+    }
+
 
-        for (size_t i = 0; i < cur_element_count; i++) {
-            if (isMarkedDeleted(i)) {
-                num_deleted_ += 1;
-                if (allow_replace_deleted_) deleted_elements.insert(i);
+    void decodeCompactBlock(
+        size_t block,
+        size_t count,
+        const CompactLinkBlock *blocks,
+        const char *links,
+        const char *labels,
+        const char *vectors) {
+        const char *position = links + blocks[block].links_offset;
+        const char *end = links + blocks[block + 1].links_offset;
+        uint64_t upper_levels = blocks[block].upper_levels;
+        auto next = [&]() {
+            uint32_t value;
+            if (!readVarint(position, end, value))
+                throw std::runtime_error("Index seems to be corrupted or unsupported");
+            return value;
+        };
+
+        size_t last = std::min(count, (block + 1) * COMPACT_BLOCK_ELEMENTS);
+        for (size_t i = block * COMPACT_BLOCK_ELEMENTS; i < last; i++) {
+            uint32_t head = next();
+            int level = (int) (head / 2);
+            upper_levels += level;
+            if (upper_levels > blocks[block + 1].upper_levels)
+                throw std::runtime_error("Index seems to be corrupted or unsupported");
+
+            memset(data_level0_memory_.at(i), 0, level0Stride());
+            memcpy(getExternalLabeLp(i), labels + i * sizeof(labeltype), sizeof(labeltype));
+            storeVector(i, vectors + i * data_size_);
+            element_levels_[i] = level;
+            linkLists_[i] = level ? allocateLinkLists(level) : nullptr;
+
+            for (int l = 0; l <= level; l++) {
+                linklistsizeint *ll = get_linklist_at_level(i, l);
+                uint32_t size = next();
+                if (size > (l ? maxM_ : maxM0_))
+                    throw std::runtime_error("Index seems to be corrupted or unsupported");
+                setListCount(ll, (unsigned short int) size);
+                tableint *ids = (tableint *) (ll + 1);
+                tableint id = 0;
+                for (uint32_t j = 0; j < size; j++) {
+                    uint32_t delta = next();
+                    if (delta >= count - id)
+                        throw std::runtime_error("Index seems to be corrupted or unsupported");
+                    id += delta;
+                    ids[j] = id;
+                }
             }
+            if (head % 2)
+                *((unsigned char *) get_linklist0(i) + 2) |= DELETE_MARK;
         }
+        if (position != end || upper_levels != blocks[block + 1].upper_levels)
+            throw std::runtime_error("Index seems to be corrupted or unsupported");
+    }
 
-        input.close();
 
-        return;
+    static void writeVarint(std::string &output, uint32_t value) {
+        while (value >= 0x80) {
+            output.push_back((char) (value | 0x80));
+            value >>= 7;
+        }
+        output.push_back((char) value);
+    }
+
+
+    static bool readVarint(const char *&position, const char *end, uint32_t &value) {
+        value = 0;
+        for (int shift = 0; shift < 35 && position < end; shift += 7) {
+            unsigned char byte = (unsigned char) *position++;
+            value |= (uint32_t) (byte & 0x7f) << shift;
+            if (!(byte & 0x80))
+                return true;
+        }
+        return false;
     }
 
 
     template<typename data_t>
     std::vector<data_t> getDataByLabel(labeltype label) const {
         // lock all operations with element by label
-        std::unique_lock <std::mutex> lock_label(getLabelOpMutex(label));
-        
-        std::unique_lock <std::mutex> lock_table(label_lookup_lock);
-        auto search = label_lookup_.find(label);
-        if (search == label_lookup_.end() || isMarkedDeleted(search->second)) {
+        std::unique_lock <std::mutex> lock_label;
+        if (!frozen_)
+            lock_label = std::unique_lock <std::mutex>(getLabelOpMutex(label));
+
+        tableint internalId;
+        if (!findInternalId(label, internalId) || isMarkedDeleted(internalId)) {
             throw std::runtime_error("Label not found");
         }
-        tableint internalId = search->second;
-        lock_table.unlock();
 
-        char* data_ptrv = getDataByInternalId(internalId);
+        std::vector<char> vector(data_size_);
+        copyVectors(&internalId, 1, vector.data());
         size_t dim = *((size_t *) dist_func_param_);
         std::vector<data_t> data;
-        data_t* data_ptr = (data_t*) data_ptrv;
+        data_t* data_ptr = (data_t*) vector.data();
         for (size_t i = 0; i < dim; i++) {
             data.push_back(*data_ptr);
             data_ptr += 1;
@@ -847,20 +2447,31 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
     }
 
 
+    /*
+    * Resolves a batch of labels to internal ids.
+    * Throws if any of the labels is unknown or marked deleted.
+    */
+    void getInternalIdsByLabels(const labeltype *labels, size_t count, tableint *internal_ids) const {
+        for (size_t i = 0; i < count; i++) {
+            if (!findInternalId(labels[i], internal_ids[i]) || isMarkedDeleted(internal_ids[i])) {
+                throw std::runtime_error("Label not found");
+            }
+        }
+    }
+
+
     /*
     * Marks an element with the given label deleted, does NOT really change the current graph.
     */
     void markDelete(labeltype label) {
+        checkWritable();
         // lock all operations with element by label
         std::unique_lock <std::mutex> lock_label(getLabelOpMutex(label));
 
-        std::unique_lock <std::mutex> lock_table(label_lookup_lock);
-        auto search = label_lookup_.find(label);
-        if (search == label_lookup_.end()) {
+        tableint internalId;
+        if (!findInternalId(label, internalId)) {
             throw std::runtime_error("Label not found");
         }
-        tableint internalId = search->second;
-        lock_table.unlock();
 
         markDeletedInternal(internalId);
     }
@@ -872,7 +2483,9 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
     */
     void markDeletedInternal(tableint internalId) {
         assert(internalId < cur_element_count);
+        std::unique_lock <ParkingLock> lock_el(link_list_locks_[internalId]);
         if (!isMarkedDeleted(internalId)) {
+            preserveElement(internalId);
             unsigned char *ll_cur = ((unsigned char *)get_linklist0(internalId))+2;
             *ll_cur |= DELETE_MARK;
             num_deleted_ += 1;
@@ -893,28 +2506,27 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
     *  because elements marked as deleted can be completely removed by addPoint
     */
     void unmarkDelete(labeltype label) {
+        checkWritable();
         // lock all operations with element by label
         std::unique_lock <std::mutex> lock_label(getLabelOpMutex(label));
 
-        std::unique_lock <std::mutex> lock_table(label_lookup_lock);
-        auto search = label_lookup_.find(label);
-        if (search == label_lookup_.end()) {
+        tableint internalId;
+        if (!findInternalId(label, internalId)) {
             throw std::runtime_error("Label not found");
         }
-        tableint internalId = search->second;
-        lock_table.unlock();
 
         unmarkDeletedInternal(internalId);
     }
 
 
-
     /*
     * Remove the deleted mark of the node.
     */
     void unmarkDeletedInternal(tableint internalId) {
         assert(internalId < cur_element_count);
+        std::unique_lock <ParkingLock> lock_el(link_list_locks_[internalId]);
         if (isMarkedDeleted(internalId)) {
+            preserveElement(internalId);
             unsigned char *ll_cur = ((unsigned char *)get_linklist0(internalId)) + 2;
             *ll_cur &= ~DELETE_MARK;
             num_deleted_ -= 1;
@@ -952,6 +2564,7 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
     * If replacement of deleted elements is enabled: replaces previously deleted point if any, updating it with new point
     */
     void addPoint(const void *data_point, labeltype label, bool replace_deleted = false) {
+        checkWritable();
         if ((allow_replace_deleted_ == false) && (replace_deleted == true)) {
             throw std::runtime_error("Replacement of deleted elements is disabled in constructor");
         }
@@ -979,12 +2592,22 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
         } else {
             // we assume that there are no concurrent operations on deleted element
             labeltype label_replaced = getExternalLabel(internal_id_replaced);
-            setExternalLabel(internal_id_replaced, label);
+            {
+                std::unique_lock <ParkingLock> lock_el(link_list_locks_[internal_id_replaced]);
+                preserveElement(internal_id_replaced);
+                setExternalLabel(internal_id_replaced, label);
+            }
 
-            std::unique_lock <std::mutex> lock_table(label_lookup_lock);
-            label_lookup_.erase(label_replaced);
-            label_lookup_[label] = internal_id_replaced;
-            lock_table.unlock();
+            LabelLookupShard &replaced_shard = getLabelLookupShard(label_replaced);
+            std::unique_lock <std::mutex> lock_replaced(replaced_shard.lock);
+            replaced_shard.labels.erase(label_replaced);
+            lock_replaced.unlock();
+
+            LabelLookupShard &shard = getLabelLookupShard(label);
+            std::unique_lock <std::mutex> lock_shard(shard.lock);
+            if (!shard.labels.set(label, internal_id_replaced))
+                throw std::runtime_error("Not enough memory: addPoint failed to grow the label lookup");
+            lock_shard.unlock();
 
             unmarkDeletedInternal(internal_id_replaced);
             updatePoint(data_point, internal_id_replaced, 1.0);
@@ -994,7 +2617,11 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
 
     void updatePoint(const void *dataPoint, tableint internalId, float updateNeighborProbability) {
         // update the feature vector associated with existing point with new vector
-        memcpy(getDataByInternalId(internalId), dataPoint, data_size_);
+        {
+            std::unique_lock <ParkingLock> lock_el(link_list_locks_[internalId]);
+            preserveElement(internalId);
+            memcpy(getDataByInternalId(internalId), dataPoint, data_size_);
+        }
 
         int maxLevelCopy = maxlevel_;
         tableint entryPointCopy = enterpoint_node_;
@@ -1053,7 +2680,8 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
                 getNeighborsByHeuristic2(candidates, layer == 0 ? maxM0_ : maxM_);
 
                 {
-                    std::unique_lock <std::mutex> lock(link_list_locks_[neigh]);
+                    std::unique_lock <ParkingLock> lock(link_list_locks_[neigh]);
+                    preserveElement(neigh);
                     linklistsizeint *ll_cur;
                     ll_cur = get_linklist_at_level(neigh, layer);
                     size_t candSize = candidates.size();
@@ -1085,17 +2713,13 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
                 while (changed) {
                     changed = false;
                     unsigned int *data;
-                    std::unique_lock <std::mutex> lock(link_list_locks_[currObj]);
+                    std::unique_lock <ParkingLock> lock(link_list_locks_[currObj]);
                     data = get_linklist_at_level(currObj, level);
                     int size = getListCount(data);
                     tableint *datal = (tableint *) (data + 1);
-#ifdef USE_SSE
-                    _mm_prefetch(getDataByInternalId(*datal), _MM_HINT_T0);
-#endif
+                    prefetchDataByInternalId(*datal);
                     for (int i = 0; i < size; i++) {
-#ifdef USE_SSE
-                        _mm_prefetch(getDataByInternalId(*(datal + i + 1)), _MM_HINT_T0);
-#endif
+                        prefetchDataByInternalId(*(datal + i + 1));
                         tableint cand = datal[i];
                         dist_t d = fstdistfunc_(dataPoint, getDataByInternalId(cand), dist_func_param_);
                         if (d < curdist) {
@@ -1140,7 +2764,7 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
 
 
     std::vector<tableint> getConnectionsWithLock(tableint internalId, int level) {
-        std::unique_lock <std::mutex> lock(link_list_locks_[internalId]);
+        std::unique_lock <ParkingLock> lock(link_list_locks_[internalId]);
         unsigned int *data = get_linklist_at_level(internalId, level);
         int size = getListCount(data);
         std::vector<tableint> result(size);
@@ -1155,16 +2779,16 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
         {
             // Checking if the element with the same label already exists
             // if so, updating it *instead* of creating a new element.
-            std::unique_lock <std::mutex> lock_table(label_lookup_lock);
-            auto search = label_lookup_.find(label);
-            if (search != label_lookup_.end()) {
-                tableint existingInternalId = search->second;
+            LabelLookupShard &shard = getLabelLookupShard(label);
+            std::unique_lock <std::mutex> lock_shard(shard.lock);
+            tableint existingInternalId;
+            if (shard.labels.find(label, existingInternalId)) {
                 if (allow_replace_deleted_) {
                     if (isMarkedDeleted(existingInternalId)) {
                         throw std::runtime_error("Can't use addPoint to update deleted elements if replacement of deleted elements is enabled.");
                     }
                 }
-                lock_table.unlock();
+                lock_shard.unlock();
 
                 if (isMarkedDeleted(existingInternalId)) {
                     unmarkDeletedInternal(existingInternalId);
@@ -1174,16 +2798,22 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
                 return existingInternalId;
             }
 
-            if (cur_element_count >= max_elements_) {
-                throw std::runtime_error("The number of elements exceeds the specified limit");
-            }
+            // grow first, so that an id is never taken without its label
+            if (!shard.labels.reserve(shard.labels.size() + 1))
+                throw std::runtime_error("Not enough memory: addPoint failed to grow the label lookup");
 
-            cur_c = cur_element_count;
-            cur_element_count++;
-            label_lookup_[label] = cur_c;
+            // other shards take ids at the same time, resizeSegments holds all shard locks
+            size_t count = cur_element_count;
+            do {
+                if (count >= max_elements_) {
+                    throw std::runtime_error("The number of elements exceeds the specified limit");
+                }
+            } while (!cur_element_count.compare_exchange_weak(count, count + 1));
+            cur_c = count;
+            shard.labels.set(label, cur_c);
         }
 
-        std::unique_lock <std::mutex> lock_el(link_list_locks_[cur_c]);
+        std::unique_lock <ParkingLock> lock_el(link_list_locks_[cur_c]);
         int curlevel = getRandomLevel(mult_);
         if (level > 0)
             curlevel = level;
@@ -1197,18 +2827,14 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
         tableint currObj = enterpoint_node_;
         tableint enterpoint_copy = enterpoint_node_;
 
-        memset(data_level0_memory_ + cur_c * size_data_per_element_ + offsetLevel0_, 0, size_data_per_element_);
+        memset(data_level0_memory_.at(cur_c) + offsetLevel0_, 0, level0Stride());
 
         // Initialisation of the data and label
         memcpy(getExternalLabeLp(cur_c), &label, sizeof(labeltype));
         memcpy(getDataByInternalId(cur_c), data_point, data_size_);
 
-        if (curlevel) {
-            linkLists_[cur_c] = (char *) malloc(size_links_per_element_ * curlevel + 1);
-            if (linkLists_[cur_c] == nullptr)
-                throw std::runtime_error("Not enough memory: addPoint failed to allocate linklist");
-            memset(linkLists_[cur_c], 0, size_links_per_element_ * curlevel + 1);
-        }
+        if (curlevel)
+            linkLists_[cur_c] = allocateLinkLists(curlevel);
 
         if ((signed)currObj != -1) {
             if (curlevel < maxlevelcopy) {
@@ -1218,7 +2844,7 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
                     while (changed) {
                         changed = false;
                         unsigned int *data;
-                        std::unique_lock <std::mutex> lock(link_list_locks_[currObj]);
+                        std::unique_lock <ParkingLock> lock(link_list_locks_[currObj]);
                         data = get_linklist(currObj, level);
                         int size = getListCount(data);
 
@@ -1311,6 +2937,8 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
             top_candidates = searchBaseLayerST<false>(
                     currObj, query_data, std::max(ef_, k), isIdAllowed);
         }
+        if (tiered_)
+            return rerankTiered(query_data, top_candidates, k);
 
         while (top_candidates.size() > k) {
             top_candidates.pop();
@@ -1324,6 +2952,36 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
     }
 
 
+    /*
+    * Orders the candidates of a search on the codes of a tiered index by their exact
+    * distance to the query and returns the `k` closest, see loadTieredIndex.
+    */
+    std::priority_queue<std::pair<dist_t, labeltype >> rerankTiered(
+        const void *query_data,
+        std::priority_queue<std::pair<dist_t, tableint>, std::vector<std::pair<dist_t, tableint>>, CompareByFirst> &candidates,
+        size_t k) const {
+        std::vector<tableint> ids;
+        ids.reserve(candidates.size());
+        while (!candidates.empty()) {
+            ids.push_back(candidates.top().second);
+            candidates.pop();
+        }
+        std::vector<char> vectors(ids.size() * data_size_);
+        copyVectors(ids.data(), ids.size(), vectors.data());
+
+        std::priority_queue<std::pair<dist_t, labeltype >> result;
+        for (size_t i = 0; i < ids.size(); i++) {
+            dist_t dist = vector_dist_func_(query_data, vectors.data() + i * data_size_, vector_dist_func_param_);
+            if (result.size() < k || dist < result.top().first) {
+                result.emplace(dist, getExternalLabel(ids[i]));
+                if (result.size() > k)
+                    result.pop();
+            }
+        }
+        return result;
+    }
+
+
     std::vector<std::pair<dist_t, labeltype >>
     searchStopConditionClosest(
         const void *query_data,
@@ -1382,7 +3040,7 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
         int connections_checked = 0;
         std::vector <int > inbound_connections_num(cur_element_count, 0);
         for (int i = 0; i < cur_element_count; i++) {
-            for (int l = 0; l <= element_levels_[i]; l++) {
+            for (int l = 0; l <= getElementLevel(i); l++) {
                 linklistsizeint *ll_cur = get_linklist_at_level(i, l);
                 int size = getListCount(ll_cur);
                 tableint *data = (tableint *) (ll_cur + 1);
@@ -1409,4 +3067,17 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
         std::cout << "integrity ok, checked " << connections_checked << " connections\n";
     }
 };
+
+template<typename dist_t> const uint64_t HierarchicalNSW<dist_t>::MAPPABLE_MAGIC;
+template<typename dist_t> const uint64_t HierarchicalNSW<dist_t>::MAPPABLE_VERSION;
+template<typename dist_t> const uint64_t HierarchicalNSW<dist_t>::MAPPABLE_ALIGNMENT;
+template<typename dist_t> const uint64_t HierarchicalNSW<dist_t>::EMPTY_LABEL_SLOT;
+template<typename dist_t> const uint64_t HierarchicalNSW<dist_t>::COMPACT_MAGIC;
+template<typename dist_t> const uint64_t HierarchicalNSW<dist_t>::COMPACT_VERSION;
+template<typename dist_t> const size_t HierarchicalNSW<dist_t>::COMPACT_BLOCK_ELEMENTS;
+template<typename dist_t> const size_t HierarchicalNSW<dist_t>::LABEL_LOOKUP_SHARDS;
+template<typename dist_t> const size_t HierarchicalNSW<dist_t>::IO_BLOCK_SIZE;
+template<typename dist_t> const unsigned char HierarchicalNSW<dist_t>::SNAPSHOT_PENDING;
+template<typename dist_t> const unsigned char HierarchicalNSW<dist_t>::SNAPSHOT_COPIED;
+template<typename dist_t> const unsigned char HierarchicalNSW<dist_t>::SNAPSHOT_WRITTEN;
 }  // namespace hnswlib
@@ -120,6 +120,8 @@ static bool AVX512Capable() {
 #include <vector>
 #include <iostream>
 #include <string.h>
+#include <stdlib.h>
+#include "page_memory.h"
 
 namespace hnswlib {
 typedef size_t labeltype;
@@ -224,5 +226,6 @@ AlgorithmInterface<dist_t>::searchKnnCloserFirst(const void* query_data, size_t
 #include "space_l2.h"
 #include "space_ip.h"
 #include "stop_condition.h"
+#include "crc32c.h"
 #include "bruteforce.h"
 #include "hnswalg.h"
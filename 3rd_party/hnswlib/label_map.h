@@ -0,0 +1,165 @@
+#pragma once
+
+#include <algorithm>
+#include <stdint.h>
+#include <stdlib.h>
+
+namespace hnswlib {
+#pragma pack(push, 4)
+struct LabelMapSlot {
+    uint64_t label;
+    uint32_t id;
+};
+#pragma pack(pop)
+
+/*
+ * Hash table from 64-bit labels to 32-bit internal ids.
+ *
+ * Uses open addressing with linear probing over a single array of 12-byte
+ * slots, where std::unordered_map spends a node allocation plus a bucket
+ * pointer on each entry. The table doubles when it gets 3/4 full. erase()
+ * shifts the rest of the probe sequence back instead of leaving tombstones,
+ * so lookups of absent labels stop at the first empty slot.
+ *
+ * Not thread-safe, callers serialize access.
+ */
+class LabelMap {
+ public:
+    static const uint32_t EMPTY = ~(uint32_t) 0;  // id of an empty slot
+    static const size_t MIN_SLOTS = 16;
+
+ private:
+    LabelMapSlot *slots_{nullptr};
+    size_t mask_{0};
+    size_t size_{0};
+
+ public:
+    LabelMap() {}
+
+    LabelMap(const LabelMap &) = delete;
+    LabelMap &operator=(const LabelMap &) = delete;
+
+    ~LabelMap() {
+        free(slots_);
+    }
+
+
+    // splitmix64 finalizer, labels are often sequential
+    static uint64_t hash(uint64_t label) {
+        uint64_t x = label;
+        x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+        return x ^ (x >> 31);
+    }
+
+
+    bool find(uint64_t label, uint32_t &id) const {
+        if (slots_ == nullptr)
+            return false;
+        for (size_t slot = hash(label) & mask_;; slot = (slot + 1) & mask_) {
+            if (slots_[slot].id == EMPTY)
+                return false;
+            if (slots_[slot].label == label) {
+                id = slots_[slot].id;
+                return true;
+            }
+        }
+    }
+
+
+    /*
+    * Maps `label` to `id`, replacing a previous mapping. Returns false when out
+    * of memory, leaving the map unchanged.
+    */
+    bool set(uint64_t label, uint32_t id) {
+        if ((size_ + 1) * 4 > slotCount() * 3 && !rehash(std::max(slotCount() * 2, (size_t) MIN_SLOTS)))
+            return false;
+        size_t slot = hash(label) & mask_;
+        while (slots_[slot].id != EMPTY && slots_[slot].label != label) {
+            slot = (slot + 1) & mask_;
+        }
+        if (slots_[slot].id == EMPTY)
+            size_++;
+        slots_[slot].label = label;
+        slots_[slot].id = id;
+        return true;
+    }
+
+
+    bool erase(uint64_t label) {
+        if (slots_ == nullptr)
+            return false;
+        size_t hole = hash(label) & mask_;
+        while (slots_[hole].label != label || slots_[hole].id == EMPTY) {
+            if (slots_[hole].id == EMPTY)
+                return false;
+            hole = (hole + 1) & mask_;
+        }
+        // pull back entries whose probe sequence passes through the hole
+        for (size_t next = (hole + 1) & mask_; slots_[next].id != EMPTY; next = (next + 1) & mask_) {
+            size_t home = hash(slots_[next].label) & mask_;
+            if (((next - home) & mask_) >= ((next - hole) & mask_)) {
+                slots_[hole] = slots_[next];
+                hole = next;
+            }
+        }
+        slots_[hole].id = EMPTY;
+        size_--;
+        return true;
+    }
+
+
+    // makes room for `count` entries without growing, returns false when out of memory
+    bool reserve(size_t count) {
+        if (count * 4 <= slotCount() * 3)
+            return true;
+        size_t slots = MIN_SLOTS;
+        while (slots * 3 < count * 4) {
+            slots *= 2;
+        }
+        return rehash(slots);
+    }
+
+
+    void clear() {
+        free(slots_);
+        slots_ = nullptr;
+        mask_ = 0;
+        size_ = 0;
+    }
+
+
+    size_t size() const {
+        return size_;
+    }
+
+ private:
+    size_t slotCount() const {
+        return slots_ ? mask_ + 1 : 0;
+    }
+
+
+    bool rehash(size_t slot_count) {
+        LabelMapSlot *slots = (LabelMapSlot *) malloc(slot_count * sizeof(LabelMapSlot));
+        if (slots == nullptr)
+            return false;
+        for (size_t i = 0; i < slot_count; i++) {
+            slots[i].id = EMPTY;
+        }
+        size_t mask = slot_count - 1;
+        for (size_t i = 0; i < slotCount(); i++) {
+            if (slots_[i].id == EMPTY)
+                continue;
+            size_t slot = hash(slots_[i].label) & mask;
+            while (slots[slot].id != EMPTY) {
+                slot = (slot + 1) & mask;
+            }
+            slots[slot] = slots_[i];
+        }
+        free(slots_);
+        slots_ = slots;
+        mask_ = mask;
+        return true;
+    }
+};
+}  // namespace hnswlib
@@ -0,0 +1,96 @@
+#pragma once
+
+#include <algorithm>
+#include <mutex>
+#include <vector>
+#include <stdlib.h>
+#include <string.h>
+
+namespace hnswlib {
+/*
+ * Memory for the upper-level link lists of an index.
+ *
+ * Lists are carved out of pages, and elements with the same top level share
+ * pages, so the few elements of the top levels, which the greedy descent of a
+ * search walks, are packed together instead of being scattered over the heap.
+ * Pages of a level double in size up to MAX_PAGE_BYTES as the level fills up.
+ *
+ * Lists are never freed one by one: release() drops all pages at once.
+ * allocate() may be called from several threads.
+ */
+class LinkListArena {
+ public:
+    static const size_t MIN_PAGE_BYTES = 4096;
+    static const size_t MAX_PAGE_BYTES = 1 << 20;
+
+ private:
+    struct Level {
+        char *next{nullptr};
+        size_t available{0};  // lists left in the current page
+        size_t page_lists{0};  // lists in the current page
+    };
+
+    size_t list_size_{0};
+    std::mutex lock_;
+    std::vector<Level> levels_;
+    std::vector<char *> pages_;
+
+ public:
+    LinkListArena() {}
+
+    LinkListArena(const LinkListArena &) = delete;
+    LinkListArena &operator=(const LinkListArena &) = delete;
+
+    ~LinkListArena() {
+        release();
+    }
+
+
+    /*
+    * Drops the previous contents. An element of level `level` gets
+    * level * list_size bytes, one list for each level above 0.
+    */
+    void init(size_t list_size) {
+        release();
+        list_size_ = list_size;
+    }
+
+
+    /*
+    * Returns zeroed memory for the link lists of an element of level `level` > 0,
+    * or nullptr when out of memory.
+    */
+    char *allocate(int level) {
+        size_t size = list_size_ * level;
+        std::unique_lock <std::mutex> lock(lock_);
+        if ((size_t) level >= levels_.size())
+            levels_.resize(level + 1);
+        Level &current = levels_[level];
+        if (current.available == 0) {
+            size_t lists = std::max(MIN_PAGE_BYTES / size, current.page_lists * 2);
+            lists = std::max(std::min(lists, MAX_PAGE_BYTES / size), (size_t) 1);
+            char *page = (char *) calloc(lists, size);
+            if (page == nullptr)
+                return nullptr;
+            pages_.push_back(page);
+            current.next = page;
+            current.available = lists;
+            current.page_lists = lists;
+        }
+        char *element = current.next;
+        current.next += size;
+        current.available--;
+        return element;
+    }
+
+
+    void release() {
+        for (char *page : pages_) {
+            free(page);
+        }
+        pages_.clear();
+        pages_.shrink_to_fit();
+        levels_.clear();
+    }
+};
+}  // namespace hnswlib
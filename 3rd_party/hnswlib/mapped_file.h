@@ -0,0 +1,106 @@
+#pragma once
+
+#include <string>
+#include <stdexcept>
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace hnswlib {
+/*
+ * Read-only mapping of a whole file. Pages are read on first access and
+ * the page cache is shared with every other process mapping the same file.
+ */
+class MappedFile {
+    char *data_{nullptr};
+    size_t size_{0};
+#ifdef _WIN32
+    HANDLE file_{INVALID_HANDLE_VALUE};
+    HANDLE mapping_{nullptr};
+#endif
+
+ public:
+    explicit MappedFile(const std::string &location) {
+#ifdef _WIN32
+        file_ = CreateFileA(location.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+                            OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (file_ == INVALID_HANDLE_VALUE)
+            throw std::runtime_error("Cannot open file");
+        LARGE_INTEGER size;
+        if (!GetFileSizeEx(file_, &size) || size.QuadPart == 0) {
+            close();
+            throw std::runtime_error("Index seems to be corrupted or unsupported");
+        }
+        size_ = (size_t) size.QuadPart;
+        mapping_ = CreateFileMappingA(file_, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (mapping_ != nullptr)
+            data_ = (char *) MapViewOfFile(mapping_, FILE_MAP_READ, 0, 0, 0);
+        if (data_ == nullptr) {
+            close();
+            throw std::runtime_error("Cannot map file");
+        }
+#else
+        int fd = open(location.c_str(), O_RDONLY);
+        if (fd < 0)
+            throw std::runtime_error("Cannot open file");
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size == 0) {
+            ::close(fd);
+            throw std::runtime_error("Index seems to be corrupted or unsupported");
+        }
+        size_ = (size_t) st.st_size;
+        void *data = mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd, 0);
+        // the mapping keeps its own reference to the file
+        ::close(fd);
+        if (data == MAP_FAILED)
+            throw std::runtime_error("Cannot map file");
+        data_ = (char *) data;
+#endif
+    }
+
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    ~MappedFile() {
+        close();
+    }
+
+    char *data() const {
+        return data_;
+    }
+
+    size_t size() const {
+        return size_;
+    }
+
+ private:
+    void close() {
+#ifdef _WIN32
+        if (data_)
+            UnmapViewOfFile(data_);
+        if (mapping_)
+            CloseHandle(mapping_);
+        if (file_ != INVALID_HANDLE_VALUE)
+            CloseHandle(file_);
+        mapping_ = nullptr;
+        file_ = INVALID_HANDLE_VALUE;
+#else
+        if (data_)
+            munmap(data_, size_);
+#endif
+        data_ = nullptr;
+        size_ = 0;
+    }
+};
+}  // namespace hnswlib
@@ -0,0 +1,187 @@
+#pragma once
+
+#include <algorithm>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef _MSC_VER
+#include <malloc.h>
+#endif
+#if defined(__linux__)
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace hnswlib {
+/*
+ * Placement of large blocks, e.g. the level 0 data of an index.
+ *
+ * MEMORY_HUGE_PAGES asks the kernel to back the block with transparent huge
+ * pages, so that random accesses across a large index miss the TLB less often.
+ * MEMORY_NUMA_INTERLEAVE spreads the pages of the block over all NUMA nodes,
+ * so that threads on every node see the same average latency and bandwidth
+ * instead of all reading from the node that happened to touch the block first.
+ *
+ * Both only apply on Linux and to blocks of at least MIN_PLACED_BYTES. Other
+ * blocks, and every block without flags, come from malloc.
+ * MEMORY_CACHE_ALIGNED makes blocks start on a CACHE_LINE_SIZE boundary.
+ * The same flags and sizes must be passed to free a block as to allocate it.
+ */
+enum MemoryFlags {
+    MEMORY_DEFAULT = 0,
+    MEMORY_HUGE_PAGES = 1,
+    MEMORY_NUMA_INTERLEAVE = 2,
+    MEMORY_CACHE_ALIGNED = 4,
+};
+
+static const size_t MIN_PLACED_BYTES = (size_t) 2 << 20;  // one x86 huge page
+static const size_t CACHE_LINE_SIZE = 64;
+
+// Allocates `size` bytes whose start address is a multiple of `alignment` (a power of two).
+// Memory obtained here must be released with alignedFree.
+inline void *alignedMalloc(size_t size, size_t alignment = CACHE_LINE_SIZE) {
+    // some allocators return nullptr for zero-sized requests
+    size = size ? (size + alignment - 1) & ~(alignment - 1) : alignment;
+#ifdef _MSC_VER
+    return _aligned_malloc(size, alignment);
+#else
+    void *ptr = nullptr;
+    if (posix_memalign(&ptr, alignment, size) != 0)
+        return nullptr;
+    return ptr;
+#endif
+}
+
+inline void alignedFree(void *ptr) {
+#ifdef _MSC_VER
+    _aligned_free(ptr);
+#else
+    free(ptr);
+#endif
+}
+
+
+#if defined(__linux__)
+inline bool placedMemory(size_t bytes, int flags) {
+    return (flags & (MEMORY_HUGE_PAGES | MEMORY_NUMA_INTERLEAVE)) && bytes >= MIN_PLACED_BYTES;
+}
+
+
+inline size_t placedSize(size_t bytes) {
+    return (bytes + MIN_PLACED_BYTES - 1) & ~(MIN_PLACED_BYTES - 1);
+}
+
+
+/*
+ * Reads the online NUMA nodes from sysfs, e.g. "0-1" or "0,2-3", into a mask.
+ * Returns 0 when there is a single node or the list cannot be read.
+ */
+inline uint64_t onlineNumaNodes() {
+    uint64_t nodes = 0;
+    FILE *file = fopen("/sys/devices/system/node/online", "r");
+    if (file == nullptr)
+        return 0;
+    char list[256] = {0};
+    if (fgets(list, sizeof(list), file) == nullptr)
+        list[0] = '\0';
+    fclose(file);
+    for (char *next = list; *next >= '0' && *next <= '9';) {
+        long first = strtol(next, &next, 10);
+        long last = first;
+        if (*next == '-')
+            last = strtol(next + 1, &next, 10);
+        for (long node = first; node <= last && node < 64; node++) {
+            nodes |= (uint64_t) 1 << node;
+        }
+        if (*next == ',')
+            next++;
+    }
+    return (nodes & (nodes - 1)) ? nodes : 0;
+}
+
+
+inline void placeMemory(void *block, size_t bytes, int flags) {
+#ifdef MADV_HUGEPAGE
+    if (flags & MEMORY_HUGE_PAGES)
+        madvise(block, bytes, MADV_HUGEPAGE);
+#endif
+#ifdef SYS_mbind
+    static const uint64_t nodes = onlineNumaNodes();
+    if ((flags & MEMORY_NUMA_INTERLEAVE) && nodes) {
+        const int MPOL_INTERLEAVE_MODE = 3;  // MPOL_INTERLEAVE of <numaif.h>
+        syscall(SYS_mbind, block, bytes, MPOL_INTERLEAVE_MODE, &nodes, (unsigned long) 64, 0);
+    }
+#endif
+}
+
+
+// maps a block aligned to MIN_PLACED_BYTES, so that it can be covered by huge pages
+inline void *mapPlacedMemory(size_t bytes, int flags) {
+    size_t size = placedSize(bytes);
+    char *mapped = (char *) mmap(nullptr, size + MIN_PLACED_BYTES, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mapped == (char *) MAP_FAILED)
+        return nullptr;
+    size_t head = (MIN_PLACED_BYTES - (uintptr_t) mapped % MIN_PLACED_BYTES) % MIN_PLACED_BYTES;
+    if (head)
+        munmap(mapped, head);
+    if (MIN_PLACED_BYTES - head)
+        munmap(mapped + head + size, MIN_PLACED_BYTES - head);
+    placeMemory(mapped + head, size, flags);
+    return mapped + head;
+}
+#endif
+
+
+inline void *allocateMemory(size_t bytes, int flags) {
+#if defined(__linux__)
+    if (placedMemory(bytes, flags))
+        return mapPlacedMemory(bytes, flags);
+#endif
+    if (flags & MEMORY_CACHE_ALIGNED)
+        return alignedMalloc(bytes);
+    return malloc(bytes);
+}
+
+
+inline void freeMemory(void *block, size_t bytes, int flags) {
+#if defined(__linux__)
+    if (block != nullptr && placedMemory(bytes, flags)) {
+        munmap(block, placedSize(bytes));
+        return;
+    }
+#endif
+    if (flags & MEMORY_CACHE_ALIGNED)
+        alignedFree(block);
+    else
+        free(block);
+}
+
+
+// Same as realloc, returns nullptr and keeps `block` when out of memory.
+inline void *reallocateMemory(void *block, size_t from_bytes, size_t to_bytes, int flags) {
+#if defined(__linux__)
+    if (block != nullptr && placedMemory(from_bytes, flags) && placedMemory(to_bytes, flags) &&
+        placedSize(to_bytes) <= placedSize(from_bytes)) {
+        if (placedSize(to_bytes) < placedSize(from_bytes))
+            munmap((char *) block + placedSize(to_bytes), placedSize(from_bytes) - placedSize(to_bytes));
+        return block;
+    }
+    bool placed = placedMemory(from_bytes, flags) || placedMemory(to_bytes, flags);
+#else
+    bool placed = false;
+#endif
+    if (!placed && !(flags & MEMORY_CACHE_ALIGNED))
+        return realloc(block, to_bytes);
+
+    void *moved = allocateMemory(to_bytes, flags);
+    if (moved == nullptr)
+        return nullptr;
+    if (block != nullptr)
+        memcpy(moved, block, std::min(from_bytes, to_bytes));
+    freeMemory(block, from_bytes, flags);
+    return moved;
+}
+}  // namespace hnswlib
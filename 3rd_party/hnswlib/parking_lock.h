@@ -0,0 +1,88 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#include <immintrin.h>
+#define HNSWLIB_SPIN_PAUSE() _mm_pause()
+#else
+#define HNSWLIB_SPIN_PAUSE() ((void) 0)
+#endif
+
+namespace hnswlib {
+/*
+ * One-byte lock for the per-element locks, where a std::mutex takes 40 bytes
+ * on Linux. Waiters spin for a short while, then sleep on one of a fixed set of
+ * condition variables shared by all locks, picked by the lock's address. An
+ * insertion holds the lock of an element for its whole search, so waiters must
+ * not keep the CPU busy.
+ *
+ * The state is 0 when unlocked, 1 when locked and 2 when locked with possible
+ * sleepers, which an unlock then wakes.
+ *
+ * Meets the Lockable requirements, so it works with std::unique_lock.
+ */
+class ParkingLock {
+    static const int SPINS_BEFORE_PARKING = 64;
+    static const size_t PARKING_BUCKETS = 64;
+
+    static const uint8_t UNLOCKED = 0;
+    static const uint8_t LOCKED = 1;
+    static const uint8_t PARKED = 2;
+
+    struct Bucket {
+        std::mutex lock;
+        std::condition_variable wake;
+    };
+
+    std::atomic<uint8_t> state_{UNLOCKED};
+
+    Bucket &bucket() const {
+        static Bucket buckets[PARKING_BUCKETS];
+        size_t address = (size_t) reinterpret_cast<uintptr_t>(this);
+        return buckets[(address ^ (address >> 6) ^ (address >> 12)) % PARKING_BUCKETS];
+    }
+
+ public:
+    ParkingLock() {}
+
+    ParkingLock(const ParkingLock &) = delete;
+    ParkingLock &operator=(const ParkingLock &) = delete;
+
+    void lock() {
+        for (int spins = 0; spins < SPINS_BEFORE_PARKING; spins++) {
+            if (try_lock())
+                return;
+            HNSWLIB_SPIN_PAUSE();
+        }
+
+        // the unlock takes the bucket lock before waking, so it cannot slip
+        // between the exchange and the wait
+        Bucket &parking = bucket();
+        std::unique_lock <std::mutex> lock_bucket(parking.lock);
+        while (state_.exchange(PARKED, std::memory_order_acquire) != UNLOCKED) {
+            parking.wake.wait(lock_bucket);
+        }
+    }
+
+
+    bool try_lock() {
+        uint8_t expected = UNLOCKED;
+        return state_.load(std::memory_order_relaxed) == UNLOCKED &&
+            state_.compare_exchange_strong(expected, LOCKED, std::memory_order_acquire);
+    }
+
+
+    void unlock() {
+        if (state_.exchange(UNLOCKED, std::memory_order_release) == PARKED) {
+            Bucket &parking = bucket();
+            std::lock_guard <std::mutex> lock_bucket(parking.lock);
+            parking.wake.notify_all();
+        }
+    }
+};
+
+static_assert(sizeof(ParkingLock) == 1, "ParkingLock should take one byte");
+}  // namespace hnswlib
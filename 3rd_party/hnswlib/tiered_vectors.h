@@ -0,0 +1,262 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <memory>
+#include <string>
+#include <stdexcept>
+#include <vector>
+#include <stdint.h>
+#include <string.h>
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#include "parking_lock.h"
+
+namespace hnswlib {
+// what the code distances get as their parameter, starts with the dimension like the spaces' one
+struct CodeSpaceParam {
+    size_t dim;
+    const float *min;
+    const float *scale;
+};
+
+/*
+ * Full-precision float vectors of an index kept in a file instead of memory.
+ *
+ * The file holds `count` vectors of `dim` floats back to back from some offset,
+ * as the vectors section of a compact index file does. Each vector is also
+ * quantized to a code of one byte per dimension, scaled between the smallest
+ * and largest value of that dimension over all vectors, which an index keeps
+ * in memory to search on. read() fetches full vectors with positioned reads,
+ * merging runs of consecutive ids into one read, and keeps the last vectors it
+ * read in a small direct-mapped cache.
+ *
+ * read() and the code distances may be called from several threads.
+ */
+class TieredVectors {
+    static const uint32_t EMPTY_SLOT = ~(uint32_t) 0;
+
+    size_t dim_;
+    size_t vector_size_;
+    uint64_t offset_{0};
+    size_t count_{0};
+    std::vector<float> min_;
+    std::vector<float> scale_;
+    CodeSpaceParam param_;
+
+    size_t cache_slots_;
+    std::vector<char> cache_;
+    std::vector<uint32_t> cache_ids_;
+    std::unique_ptr<ParkingLock[]> cache_locks_;
+
+#ifdef _WIN32
+    HANDLE file_{INVALID_HANDLE_VALUE};
+#else
+    int fd_{-1};
+#endif
+
+ public:
+    TieredVectors(const std::string &location, size_t dim, size_t cache_slots)
+        : dim_(dim), vector_size_(dim * sizeof(float)), min_(dim, 0.0f), scale_(dim, 0.0f),
+            cache_slots_(cache_slots), cache_(cache_slots * dim * sizeof(float)),
+            cache_ids_(cache_slots, (uint32_t) EMPTY_SLOT), cache_locks_(new ParkingLock[cache_slots]) {
+        param_ = CodeSpaceParam{dim_, min_.data(), scale_.data()};
+#ifdef _WIN32
+        file_ = CreateFileA(location.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+                            OPEN_EXISTING, FILE_FLAG_RANDOM_ACCESS, nullptr);
+        if (file_ == INVALID_HANDLE_VALUE)
+            throw std::runtime_error("Cannot open file");
+#else
+        fd_ = open(location.c_str(), O_RDONLY);
+        if (fd_ < 0)
+            throw std::runtime_error("Cannot open file");
+#ifdef POSIX_FADV_RANDOM
+        posix_fadvise(fd_, 0, 0, POSIX_FADV_RANDOM);
+#endif
+#endif
+    }
+
+    TieredVectors(const TieredVectors &) = delete;
+    TieredVectors &operator=(const TieredVectors &) = delete;
+
+    ~TieredVectors() {
+#ifdef _WIN32
+        if (file_ != INVALID_HANDLE_VALUE)
+            CloseHandle(file_);
+#else
+        if (fd_ >= 0)
+            close(fd_);
+#endif
+    }
+
+
+    size_t codeSize() const {
+        return dim_;
+    }
+
+
+    const CodeSpaceParam *codeParam() const {
+        return &param_;
+    }
+
+
+    /*
+    * Takes the `count` vectors at `offset` in the file, which `vectors` holds a
+    * copy of, e.g. a mapping of the file, and sets the range of the codes of
+    * each dimension from them.
+    */
+    void setVectors(uint64_t offset, const char *vectors, size_t count) {
+        offset_ = offset;
+        count_ = count;
+        std::vector<float> max(dim_, 0.0f);
+        for (size_t i = 0; i < count; i++) {
+            for (size_t d = 0; d < dim_; d++) {
+                float value = valueAt(vectors + i * vector_size_, d);
+                if (i == 0 || value < min_[d])
+                    min_[d] = value;
+                if (i == 0 || value > max[d])
+                    max[d] = value;
+            }
+        }
+        for (size_t d = 0; d < dim_; d++) {
+            scale_[d] = (max[d] - min_[d]) / 255.0f;
+        }
+    }
+
+
+    void encode(const char *vector, char *code) const {
+        uint8_t *codes = (uint8_t *) code;
+        for (size_t d = 0; d < dim_; d++) {
+            float level = scale_[d] > 0 ? (valueAt(vector, d) - min_[d]) / scale_[d] : 0.0f;
+            codes[d] = (uint8_t) std::min(255.0f, std::max(0.0f, std::round(level)));
+        }
+    }
+
+
+    // squared L2 distance between a float query and a code, see CodeSpaceParam
+    template<typename dist_t>
+    static dist_t codeL2Sqr(const void *query, const void *code, const void *param) {
+        const CodeSpaceParam *space = (const CodeSpaceParam *) param;
+        const float *values = (const float *) query;
+        const uint8_t *codes = (const uint8_t *) code;
+        float sum = 0;
+        for (size_t d = 0; d < space->dim; d++) {
+            float diff = values[d] - (space->min[d] + space->scale[d] * codes[d]);
+            sum += diff * diff;
+        }
+        return (dist_t) sum;
+    }
+
+
+    // inner product distance between a float query and a code, as in InnerProductSpace
+    template<typename dist_t>
+    static dist_t codeInnerProductDistance(const void *query, const void *code, const void *param) {
+        const CodeSpaceParam *space = (const CodeSpaceParam *) param;
+        const float *values = (const float *) query;
+        const uint8_t *codes = (const uint8_t *) code;
+        float sum = 0;
+        for (size_t d = 0; d < space->dim; d++) {
+            sum += values[d] * (space->min[d] + space->scale[d] * codes[d]);
+        }
+        return (dist_t) (1.0f - sum);
+    }
+
+
+    /*
+    * Copies the full vectors of the `n` elements `ids` into `out`, one after
+    * the other. Throws when the file cannot be read.
+    */
+    void read(const uint32_t *ids, size_t n, char *out) {
+        std::vector<size_t> missing;
+        for (size_t i = 0; i < n; i++) {
+            if (ids[i] >= count_)
+                throw std::runtime_error("Index seems to be corrupted or unsupported");
+            if (!readCached(ids[i], out + i * vector_size_))
+                missing.push_back(i);
+        }
+        std::sort(missing.begin(), missing.end(), [&](size_t a, size_t b) {
+            return ids[a] < ids[b];
+        });
+
+        std::vector<char> run;
+        for (size_t begin = 0, end; begin < missing.size(); begin = end) {
+            end = begin + 1;
+            while (end < missing.size() && ids[missing[end]] == ids[missing[end - 1]] + 1)
+                end++;
+            run.resize((end - begin) * vector_size_);
+            readAt(offset_ + (uint64_t) ids[missing[begin]] * vector_size_, run.data(), run.size());
+            for (size_t j = begin; j < end; j++) {
+                const char *vector = run.data() + (j - begin) * vector_size_;
+                memcpy(out + missing[j] * vector_size_, vector, vector_size_);
+                cache(ids[missing[j]], vector);
+            }
+        }
+    }
+
+ private:
+    // the vectors section of a compact file is not aligned to floats
+    static float valueAt(const char *vector, size_t d) {
+        float value;
+        memcpy(&value, vector + d * sizeof(float), sizeof(float));
+        return value;
+    }
+
+
+    bool readCached(uint32_t id, char *out) {
+        if (cache_slots_ == 0)
+            return false;
+        size_t slot = id % cache_slots_;
+        std::unique_lock <ParkingLock> lock(cache_locks_[slot]);
+        if (cache_ids_[slot] != id)
+            return false;
+        memcpy(out, cache_.data() + slot * vector_size_, vector_size_);
+        return true;
+    }
+
+
+    void cache(uint32_t id, const char *vector) {
+        if (cache_slots_ == 0)
+            return;
+        size_t slot = id % cache_slots_;
+        std::unique_lock <ParkingLock> lock(cache_locks_[slot]);
+        memcpy(cache_.data() + slot * vector_size_, vector, vector_size_);
+        cache_ids_[slot] = id;
+    }
+
+
+    void readAt(uint64_t offset, char *out, size_t size) {
+        while (size > 0) {
+#ifdef _WIN32
+            OVERLAPPED overlapped;
+            memset(&overlapped, 0, sizeof(overlapped));
+            overlapped.Offset = (DWORD) offset;
+            overlapped.OffsetHigh = (DWORD) (offset >> 32);
+            DWORD chunk = (DWORD) std::min(size, (size_t) 1 << 30);
+            DWORD done = 0;
+            if (!ReadFile(file_, out, chunk, &done, &overlapped) || done == 0)
+                throw std::runtime_error("Cannot read vectors from the index file");
+#else
+            ssize_t done = pread(fd_, out, size, (off_t) offset);
+            if (done < 0 && errno == EINTR)
+                continue;
+            if (done <= 0)
+                throw std::runtime_error("Cannot read vectors from the index file");
+#endif
+            out += done;
+            offset += done;
+            size -= done;
+        }
+    }
+};
+}  // namespace hnswlib
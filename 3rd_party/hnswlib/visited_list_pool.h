@@ -1,8 +1,9 @@
 #pragma once
 
-#include <mutex>
+#include <atomic>
+#include <functional>
 #include <string.h>
-#include <deque>
+#include <thread>
 
 namespace hnswlib {
 typedef unsigned short int vl_type;
@@ -35,44 +36,69 @@ class VisitedList {
 //
 /////////////////////////////////////////////////////////
 
+/*
+ * Free lists sit in a fixed number of atomic slots, so taking and returning one
+ * is a single exchange instead of a trip through a mutex that every concurrent
+ * search contends on. Each thread starts looking at a slot picked from its id.
+ * A list that is returned while every slot is taken is freed.
+ */
 class VisitedListPool {
-    std::deque<VisitedList *> pool;
-    std::mutex poolguard;
-    int numelements;
+    static const size_t SLOTS = 64;
+
+    std::atomic<VisitedList *> pool[SLOTS];
+    std::atomic<int> numelements;
+
+    static size_t firstSlot() {
+        return std::hash<std::thread::id>()(std::this_thread::get_id()) % SLOTS;
+    }
 
  public:
-    VisitedListPool(int initmaxpools, int numelements1) {
-        numelements = numelements1;
-        for (int i = 0; i < initmaxpools; i++)
-            pool.push_front(new VisitedList(numelements));
+    VisitedListPool(int initmaxpools, int numelements1) : numelements(numelements1) {
+        for (size_t i = 0; i < SLOTS; i++)
+            pool[i].store(i < (size_t) initmaxpools ? new VisitedList(numelements1) : nullptr);
     }
 
+    VisitedListPool(const VisitedListPool &) = delete;
+    VisitedListPool &operator=(const VisitedListPool &) = delete;
+
     VisitedList *getFreeVisitedList() {
-        VisitedList *rez;
-        {
-            std::unique_lock <std::mutex> lock(poolguard);
-            if (pool.size() > 0) {
-                rez = pool.front();
-                pool.pop_front();
-            } else {
-                rez = new VisitedList(numelements);
-            }
+        VisitedList *rez = nullptr;
+        size_t first = firstSlot();
+        for (size_t i = 0; i < SLOTS && rez == nullptr; i++) {
+            std::atomic<VisitedList *> &slot = pool[(first + i) % SLOTS];
+            if (slot.load(std::memory_order_relaxed) != nullptr)
+                rez = slot.exchange(nullptr, std::memory_order_acquire);
+        }
+        // the index has grown since this list was created
+        if (rez != nullptr && rez->numelements < (unsigned int) numelements.load()) {
+            delete rez;
+            rez = nullptr;
         }
+        if (rez == nullptr)
+            rez = new VisitedList(numelements.load());
         rez->reset();
         return rez;
     }
 
+    // Lists handed out from now on cover `numelements1` elements,
+    // lists that are in use keep their size.
+    void setNumElements(int numelements1) {
+        numelements.store(numelements1);
+    }
+
     void releaseVisitedList(VisitedList *vl) {
-        std::unique_lock <std::mutex> lock(poolguard);
-        pool.push_front(vl);
+        size_t first = firstSlot();
+        for (size_t i = 0; i < SLOTS; i++) {
+            VisitedList *empty = nullptr;
+            if (pool[(first + i) % SLOTS].compare_exchange_strong(empty, vl, std::memory_order_release))
+                return;
+        }
+        delete vl;
     }
 
     ~VisitedListPool() {
-        while (pool.size()) {
-            VisitedList *rez = pool.front();
-            pool.pop_front();
-            delete rez;
-        }
+        for (size_t i = 0; i < SLOTS; i++)
+            delete pool[i].load();
     }
 };
 }  // namespace hnswlib
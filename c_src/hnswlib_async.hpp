@@ -0,0 +1,470 @@
+#ifndef HNSWLIB_ASYNC_HPP
+#define HNSWLIB_ASYNC_HPP
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+#include <erl_nif.h>
+#include "hnswlib_index.hpp"
+
+/*
+ * A fixed-size pool of native threads that runs work submitted by NIFs
+ * which return immediately and reply later with enif_send.
+ *
+ * Threads are started on the first submit. Each task is called with
+ * `run = true`, or with `run = false` when the pool is stopped before the
+ * task got a chance to run, so that it can release what it holds.
+ */
+class WorkerPool {
+ public:
+    typedef std::function<void(bool run)> Task;
+
+    explicit WorkerPool(size_t num_threads) : num_threads_(num_threads), stopping_(false) {
+        if (num_threads_ == 0) {
+            num_threads_ = 1;
+        }
+    }
+
+
+    ~WorkerPool() {
+        stop();
+    }
+
+
+    void submit(Task task) {
+        std::unique_lock<std::mutex> lock(lock_);
+        if (stopping_) {
+            throw std::runtime_error("The worker pool is shutting down");
+        }
+        if (workers_.empty()) {
+            for (size_t i = 0; i < num_threads_; i++) {
+                workers_.push_back(std::thread([this] { work(); }));
+            }
+        }
+        tasks_.push_back(std::move(task));
+        cond_.notify_one();
+    }
+
+
+    void stop() {
+        {
+            std::unique_lock<std::mutex> lock(lock_);
+            if (stopping_) {
+                return;
+            }
+            stopping_ = true;
+        }
+        cond_.notify_all();
+        for (auto &worker : workers_) {
+            worker.join();
+        }
+        workers_.clear();
+
+        // tasks that never ran still own their resources
+        for (auto &task : tasks_) {
+            task(false);
+        }
+        tasks_.clear();
+    }
+
+ private:
+    void work() {
+        while (true) {
+            Task task;
+            {
+                std::unique_lock<std::mutex> lock(lock_);
+                cond_.wait(lock, [this] { return stopping_ || !tasks_.empty(); });
+                if (stopping_) {
+                    return;
+                }
+                task = std::move(tasks_.front());
+                tasks_.pop_front();
+            }
+            task(true);
+        }
+    }
+
+    size_t num_threads_;
+    bool stopping_;
+    std::mutex lock_;
+    std::condition_variable cond_;
+    std::deque<Task> tasks_;
+    std::vector<std::thread> workers_;
+};
+
+/*
+ * A knn query submitted with index_knn_query_async. The resource doubles as
+ * the reference handed back to the caller, which is also the tag of the
+ * `{:hnswlib_knn_query, ref, reply}` message.
+ *
+ * `env` owns a copy of the query binary and of the reference term, and is
+ * used to build the reply. `lock` orders replying against cancelling, so
+ * that once a cancel succeeds no message is ever sent.
+ */
+struct NifResHNSWLibAsyncQuery {
+    ErlNifEnv * env;
+    ErlNifPid caller;
+    NifResHNSWLibIndex * index;
+    ERL_NIF_TERM query;
+    ERL_NIF_TERM ref;
+    size_t k;
+    size_t rows;
+    size_t features;
+    long long num_threads;
+
+    std::mutex lock;
+    std::atomic<bool> cancelled;
+    bool replied;
+
+    static ErlNifResourceType * type;
+    static NifResHNSWLibAsyncQuery * allocate_resource(ErlNifEnv * env, ERL_NIF_TERM &error) {
+        void * mem = enif_alloc_resource(NifResHNSWLibAsyncQuery::type, sizeof(NifResHNSWLibAsyncQuery));
+        if (mem == nullptr) {
+            error = erlang::nif::error(env, "cannot allocate NifResHNSWLibAsyncQuery resource");
+            return nullptr;
+        }
+
+        NifResHNSWLibAsyncQuery * res = new (mem) NifResHNSWLibAsyncQuery();
+        res->index = nullptr;
+        res->cancelled = false;
+        res->replied = false;
+        res->env = enif_alloc_env();
+        if (res->env == nullptr) {
+            enif_release_resource(res);
+            error = erlang::nif::error(env, "cannot allocate environment for the NifResHNSWLibAsyncQuery resource");
+            return nullptr;
+        }
+        return res;
+    }
+
+    static NifResHNSWLibAsyncQuery * get_resource(ErlNifEnv * env, ERL_NIF_TERM term, ERL_NIF_TERM &error) {
+        NifResHNSWLibAsyncQuery * self_res = nullptr;
+        if (!enif_get_resource(env, term, NifResHNSWLibAsyncQuery::type, (void **)&self_res) || self_res == nullptr) {
+            error = erlang::nif::error(env, "cannot access NifResHNSWLibAsyncQuery resource");
+        }
+        return self_res;
+    }
+
+    static void destruct_resource(ErlNifEnv *env, void *args) {
+        auto res = (NifResHNSWLibAsyncQuery *)args;
+        if (res) {
+            if (res->env) {
+                enif_free_env(res->env);
+                res->env = nullptr;
+            }
+            if (res->index) {
+                enif_release_resource(res->index);
+                res->index = nullptr;
+            }
+            res->~NifResHNSWLibAsyncQuery();
+        }
+    }
+
+    // Runs on a pool thread. The pool holds one reference to this resource
+    // (and through it to the index) until the query has replied or been dropped.
+    void run(bool run) {
+        ERL_NIF_TERM reply = 0;
+        if (run && !cancelled) {
+            ErlNifBinary data;
+            enif_inspect_binary(env, query, &data);
+            bool locked = index->lock_for_search();
+            try {
+                index->val->knnQuery(env, (float *)data.data, rows, features, k, num_threads, reply, &cancelled);
+            } catch (std::exception &err) {
+                reply = erlang::nif::error(env, err.what());
+            }
+            index->unlock_for_search(locked);
+        }
+        finish(run, reply);
+    }
+
+    // Sends `reply` unless the query has been dropped or cancelled, then
+    // releases the references held while the query was pending.
+    void finish(bool send, ERL_NIF_TERM reply) {
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            if (send && !cancelled) {
+                ERL_NIF_TERM msg = enif_make_tuple3(env, erlang::nif::atom(env, "hnswlib_knn_query"), ref, reply);
+                enif_send(nullptr, &caller, env, msg);
+            } else {
+                enif_clear_env(env);
+            }
+            replied = true;
+        }
+
+        if (index) {
+            enif_release_resource(index);
+            index = nullptr;
+        }
+        enif_release_resource(this);
+    }
+
+    // Returns false if the reply has already been sent.
+    bool cancel() {
+        std::unique_lock<std::mutex> guard(lock);
+        if (replied) {
+            return false;
+        }
+        cancelled = true;
+        return true;
+    }
+};
+
+/*
+ * Progress of a knn query that runs in time slices on a normal scheduler.
+ * The output binaries are owned by the resource until the last slice turns
+ * them into the result.
+ */
+struct NifResHNSWLibQuerySlice {
+    ErlNifBinary labels;
+    ErlNifBinary dists;
+    size_t next_row;
+    bool owns_binaries;
+
+    static ErlNifResourceType * type;
+    static NifResHNSWLibQuerySlice * allocate_resource(ErlNifEnv * env, size_t label_bytes, size_t dist_bytes, ERL_NIF_TERM &error) {
+        NifResHNSWLibQuerySlice * res = (NifResHNSWLibQuerySlice *)enif_alloc_resource(NifResHNSWLibQuerySlice::type, sizeof(NifResHNSWLibQuerySlice));
+        if (res == nullptr) {
+            error = erlang::nif::error(env, "cannot allocate NifResHNSWLibQuerySlice resource");
+            return res;
+        }
+        res->next_row = 0;
+        res->owns_binaries = false;
+
+        if (!enif_alloc_binary(label_bytes, &res->labels)) {
+            enif_release_resource(res);
+            error = erlang::nif::error(env, "out of memory for storing labels");
+            return nullptr;
+        }
+        if (!enif_alloc_binary(dist_bytes, &res->dists)) {
+            enif_release_binary(&res->labels);
+            enif_release_resource(res);
+            error = erlang::nif::error(env, "out of memory for storing distances");
+            return nullptr;
+        }
+        res->owns_binaries = true;
+        return res;
+    }
+
+    static NifResHNSWLibQuerySlice * get_resource(ErlNifEnv * env, ERL_NIF_TERM term, ERL_NIF_TERM &error) {
+        NifResHNSWLibQuerySlice * self_res = nullptr;
+        if (!enif_get_resource(env, term, NifResHNSWLibQuerySlice::type, (void **)&self_res) || self_res == nullptr) {
+            error = erlang::nif::error(env, "cannot access NifResHNSWLibQuerySlice resource");
+        }
+        return self_res;
+    }
+
+    static void destruct_resource(ErlNifEnv *env, void *args) {
+        auto res = (NifResHNSWLibQuerySlice *)args;
+        if (res && res->owns_binaries) {
+            enif_release_binary(&res->labels);
+            enif_release_binary(&res->dists);
+            res->owns_binaries = false;
+        }
+    }
+};
+
+/*
+ * Collects single queries submitted by many processes and searches them as
+ * one batch: up to `max_rows` rows, or whatever has arrived `max_delay_us`
+ * microseconds after the first query of the batch. The batch takes the
+ * index read lock once and makes one thread-count decision, each query then
+ * gets its own reply.
+ *
+ * A batcher belongs to one index resource and is stopped by its destructor,
+ * so queued queries do not hold a reference to the index. Queries still
+ * queued then get an error reply, as their callers may wait without a
+ * timeout.
+ */
+class QueryBatcher {
+ public:
+    QueryBatcher(NifResHNSWLibIndex * index, size_t max_rows, uint64_t max_delay_us)
+        : index_(index), max_rows_(max_rows), max_delay_us_(max_delay_us), pending_rows_(0), stopping_(false) {
+    }
+
+
+    ~QueryBatcher() {
+        stop();
+    }
+
+
+    void configure(size_t max_rows, uint64_t max_delay_us) {
+        std::unique_lock<std::mutex> lock(lock_);
+        max_rows_ = max_rows;
+        max_delay_us_ = max_delay_us;
+        cond_.notify_one();
+    }
+
+
+    // Takes over one reference to `query`.
+    void submit(NifResHNSWLibAsyncQuery * query) {
+        std::unique_lock<std::mutex> lock(lock_);
+        if (stopping_) {
+            throw std::runtime_error("The query batcher is shutting down");
+        }
+        if (!worker_.joinable()) {
+            worker_ = std::thread([this] { work(); });
+        }
+        if (pending_.empty()) {
+            first_pending_at_ = std::chrono::steady_clock::now();
+        }
+        pending_.push_back(query);
+        pending_rows_ += query->rows;
+        cond_.notify_one();
+    }
+
+
+    void stop() {
+        {
+            std::unique_lock<std::mutex> lock(lock_);
+            if (stopping_) {
+                return;
+            }
+            stopping_ = true;
+        }
+        cond_.notify_all();
+        // the worker replies to the queries left, nothing is queued without it
+        if (worker_.joinable()) {
+            worker_.join();
+        }
+    }
+
+ private:
+    void work() {
+        std::unique_lock<std::mutex> lock(lock_);
+        while (true) {
+            cond_.wait(lock, [this] { return stopping_ || !pending_.empty(); });
+            if (stopping_) {
+                break;
+            }
+            cond_.wait_until(lock, first_pending_at_ + std::chrono::microseconds(max_delay_us_), [this] {
+                return stopping_ || pending_rows_ >= max_rows_;
+            });
+            if (stopping_) {
+                break;
+            }
+
+            std::vector<NifResHNSWLibAsyncQuery *> batch;
+            batch.swap(pending_);
+            pending_rows_ = 0;
+
+            lock.unlock();
+            run(batch);
+            lock.lock();
+        }
+
+        std::vector<NifResHNSWLibAsyncQuery *> dropped;
+        dropped.swap(pending_);
+        pending_rows_ = 0;
+        lock.unlock();
+        for (auto query : dropped) {
+            query->finish(true, erlang::nif::error(query->env, "query batching stopped"));
+        }
+    }
+
+
+    void run(std::vector<NifResHNSWLibAsyncQuery *> &batch) {
+        size_t count = batch.size();
+        std::vector<ErlNifBinary> labels(count);
+        std::vector<ErlNifBinary> dists(count);
+        std::vector<bool> allocated(count, false);
+        std::vector<const float *> inputs(count);
+        std::vector<std::string> errors(count);
+        std::unique_ptr<std::atomic<bool>[]> failed(new std::atomic<bool>[count]);
+        std::mutex errors_lock;
+        // (query, row) pairs of the whole batch
+        std::vector<std::pair<size_t, size_t>> rows;
+
+        for (size_t i = 0; i < count; i++) {
+            NifResHNSWLibAsyncQuery * query = batch[i];
+            ErlNifBinary data;
+            failed[i] = true;
+            if (query->cancelled) {
+                continue;
+            }
+            if (!enif_alloc_binary(sizeof(hnswlib::labeltype) * query->rows * query->k, &labels[i])) {
+                errors[i] = "out of memory for storing labels";
+                continue;
+            }
+            if (!enif_alloc_binary(sizeof(float) * query->rows * query->k, &dists[i])) {
+                enif_release_binary(&labels[i]);
+                errors[i] = "out of memory for storing distances";
+                continue;
+            }
+            allocated[i] = true;
+            enif_inspect_binary(query->env, query->query, &data);
+            inputs[i] = (const float *)data.data;
+            failed[i] = false;
+            for (size_t row = 0; row < query->rows; row++) {
+                rows.push_back(std::make_pair(i, row));
+            }
+        }
+
+        bool locked = index_->lock_for_search();
+        Index<float> * val = index_->val;
+        size_t num_threads = val->num_threads_default;
+        // avoid using threads when the number of searches is small:
+        if (rows.size() <= num_threads * 4) {
+            num_threads = 1;
+        }
+        std::vector<float> norm_array(val->normalize ? num_threads * val->dim : 0);
+        ParallelFor(0, rows.size(), num_threads, [&](size_t i, size_t threadId) {
+            size_t q = rows[i].first;
+            size_t row = rows[i].second;
+            NifResHNSWLibAsyncQuery * query = batch[q];
+            if (failed[q] || query->cancelled) {
+                return;
+            }
+            try {
+                float * norm_buffer = val->normalize ? norm_array.data() + threadId * val->dim : nullptr;
+                val->searchRow(inputs[q] + row * query->features, query->k, norm_buffer,
+                    (hnswlib::labeltype *)labels[q].data + row * query->k, (float *)dists[q].data + row * query->k);
+            } catch (std::exception &err) {
+                std::unique_lock<std::mutex> guard(errors_lock);
+                if (!failed[q]) {
+                    failed[q] = true;
+                    errors[q] = err.what();
+                }
+            }
+        });
+        index_->unlock_for_search(locked);
+
+        for (size_t i = 0; i < count; i++) {
+            NifResHNSWLibAsyncQuery * query = batch[i];
+            ERL_NIF_TERM reply;
+            if (failed[i] || query->cancelled) {
+                if (allocated[i]) {
+                    enif_release_binary(&labels[i]);
+                    enif_release_binary(&dists[i]);
+                }
+                reply = erlang::nif::error(query->env, errors[i].empty() ? "The query has been cancelled" : errors[i].c_str());
+            } else {
+                reply = val->knnQueryResult(query->env, labels[i], dists[i], query->rows, query->k);
+            }
+            query->finish(true, reply);
+        }
+    }
+
+    NifResHNSWLibIndex * index_;
+    size_t max_rows_;
+    uint64_t max_delay_us_;
+    size_t pending_rows_;
+    bool stopping_;
+    std::chrono::steady_clock::time_point first_pending_at_;
+    std::mutex lock_;
+    std::condition_variable cond_;
+    std::vector<NifResHNSWLibAsyncQuery *> pending_;
+    std::thread worker_;
+};
+
+#endif  /* HNSWLIB_ASYNC_HPP */
@@ -0,0 +1,137 @@
+#ifndef HNSWLIB_BUFFER_HPP
+#define HNSWLIB_BUFFER_HPP
+
+#pragma once
+
+#include <algorithm>
+#include <ios>
+#include <streambuf>
+#include <stdlib.h>
+#include <string.h>
+#include <erl_nif.h>
+#include "nif_utils.hpp"
+
+/*
+ * Read-only std::streambuf over a block of memory, so that an index can be
+ * loaded straight from a binary without copying it first.
+ */
+class MemoryInput : public std::streambuf {
+ public:
+    MemoryInput(const char * data, size_t size) {
+        char * begin = const_cast<char *>(data);
+        setg(begin, begin, begin + size);
+    }
+
+ protected:
+    pos_type seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which) override {
+        off_type base = dir == std::ios_base::beg ? 0 : dir == std::ios_base::cur ? gptr() - eback() : egptr() - eback();
+        off_type target = base + off;
+        if (target < 0 || target > egptr() - eback()) {
+            return pos_type(off_type(-1));
+        }
+        setg(eback(), eback() + target, egptr());
+        return pos_type(target);
+    }
+
+    pos_type seekpos(pos_type pos, std::ios_base::openmode which) override {
+        return seekoff(off_type(pos), std::ios_base::beg, which);
+    }
+};
+
+/*
+ * std::streambuf that collects everything written to it in one malloc'ed
+ * block. release() hands the block over, e.g. to a NifResHNSWLibBinary.
+ * A failed allocation makes the stream fail like a failed write would.
+ */
+class BufferOutput : public std::streambuf {
+    char * data_ = nullptr;
+    size_t size_ = 0;
+    size_t capacity_ = 0;
+
+ public:
+    explicit BufferOutput(size_t capacity = 0) {
+        reserve(capacity);
+    }
+
+    BufferOutput(const BufferOutput &) = delete;
+    BufferOutput &operator=(const BufferOutput &) = delete;
+
+    ~BufferOutput() {
+        free(data_);
+    }
+
+    bool reserve(size_t capacity) {
+        if (capacity <= capacity_) {
+            return true;
+        }
+        char * data = (char *)realloc(data_, capacity);
+        if (data == nullptr) {
+            return false;
+        }
+        data_ = data;
+        capacity_ = capacity;
+        return true;
+    }
+
+    char * release(size_t &size) {
+        char * data = data_;
+        size = size_;
+        data_ = nullptr;
+        size_ = 0;
+        capacity_ = 0;
+        return data;
+    }
+
+ protected:
+    std::streamsize xsputn(const char * s, std::streamsize n) override {
+        size_t count = (size_t)n;
+        if (count > capacity_ - size_ && !reserve(std::max(size_ + count, capacity_ * 2))) {
+            return 0;
+        }
+        memcpy(data_ + size_, s, count);
+        size_ += count;
+        return n;
+    }
+
+    int_type overflow(int_type c) override {
+        if (traits_type::eq_int_type(c, traits_type::eof())) {
+            return traits_type::not_eof(c);
+        }
+        char ch = traits_type::to_char_type(c);
+        return xsputn(&ch, 1) == 1 ? c : traits_type::eof();
+    }
+};
+
+/*
+ * Owns the memory of a binary made with enif_make_resource_binary, which
+ * lets index_dump and bfindex_dump return what they wrote without copying
+ * it into a regular binary.
+ */
+struct NifResHNSWLibBinary {
+    char * data;
+
+    static ErlNifResourceType * type;
+
+    // takes over the contents of `buffer`
+    static ERL_NIF_TERM make_binary(ErlNifEnv * env, BufferOutput &buffer) {
+        NifResHNSWLibBinary * res = (NifResHNSWLibBinary *)enif_alloc_resource(NifResHNSWLibBinary::type, sizeof(NifResHNSWLibBinary));
+        if (res == nullptr) {
+            return erlang::nif::error(env, "cannot allocate NifResHNSWLibBinary resource");
+        }
+        size_t size = 0;
+        res->data = buffer.release(size);
+        ERL_NIF_TERM ret = enif_make_resource_binary(env, res, res->data, size);
+        enif_release_resource(res);
+        return erlang::nif::ok(env, ret);
+    }
+
+    static void destruct_resource(ErlNifEnv *env, void *args) {
+        auto res = (NifResHNSWLibBinary *)args;
+        if (res) {
+            free(res->data);
+            res->data = nullptr;
+        }
+    }
+};
+
+#endif  /* HNSWLIB_BUFFER_HPP */
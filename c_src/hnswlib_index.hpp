@@ -6,12 +6,15 @@
 #include <iostream>
 #include <hnswlib.h>
 #include <thread>
+#include <chrono>
 #include <atomic>
 #include <stdlib.h>
 #include <assert.h>
 #include <erl_nif.h>
 #include <functional>
 #include "nif_utils.hpp"
+#include "hnswlib_buffer.hpp"
+#include "hnswlib_wal.hpp"
 
 /*
  * replacement for the openmp '#pragma omp parallel for' directive
@@ -105,10 +108,32 @@ class Index {
     size_t default_ef;
 
     bool index_inited;
-    bool ep_added;
+    // addItems may run concurrently with itself, see NifResHNSWLibIndex::concurrent_writes
+    std::atomic<bool> ep_added;
+    std::mutex ep_lock;
     bool normalize;
     int num_threads_default;
-    hnswlib::labeltype cur_l;
+    std::atomic<hnswlib::labeltype> cur_l;
+    // grow the index instead of failing when addItems runs out of room, set
+    // without the index lock
+    std::atomic<bool> auto_grow;
+    std::mutex grow_lock;
+    std::atomic<size_t> pending_rows;
+    // hnswlib::MemoryFlags for the level 0 data of indexes created or loaded from now on
+    int memory_flags;
+    // store vectors and labels apart from the level 0 links, see HierarchicalNSW::split_elements_
+    bool split_elements;
+    // read full vectors from the index file on load, see HierarchicalNSW::loadTieredIndex
+    bool tiered;
+    size_t vector_cache_size;
+    // size of the file read by the last loadIndex and how long it took
+    size_t load_bytes;
+    double load_seconds;
+    // writes are appended to the log when set, see openLog
+    std::shared_ptr<WriteAheadLog> log;
+    // while a log is open, concurrent writes are applied and appended under
+    // this lock, so the log holds them in the order they were applied
+    std::mutex log_order;
     hnswlib::HierarchicalNSW<dist_t>* appr_alg;
     hnswlib::SpaceInterface<float>* l2space;
 
@@ -127,6 +152,14 @@ class Index {
         }
         appr_alg = NULL;
         ep_added = true;
+        auto_grow = true;
+        pending_rows = 0;
+        memory_flags = hnswlib::MEMORY_DEFAULT;
+        split_elements = false;
+        tiered = false;
+        vector_cache_size = 4096;
+        load_bytes = 0;
+        load_seconds = 0;
         index_inited = false;
         num_threads_default = std::thread::hardware_concurrency();
 
@@ -146,12 +179,14 @@ class Index {
         size_t M,
         size_t efConstruction,
         size_t random_seed,
-        bool allow_replace_deleted) {
+        bool allow_replace_deleted,
+        size_t segment_size = 0,
+        bool align_elements = false) {
         if (appr_alg) {
             throw std::runtime_error("The index is already initiated.");
         }
         cur_l = 0;
-        appr_alg = new hnswlib::HierarchicalNSW<dist_t>(l2space, maxElements, M, efConstruction, random_seed, allow_replace_deleted);
+        appr_alg = new hnswlib::HierarchicalNSW<dist_t>(l2space, maxElements, M, efConstruction, random_seed, allow_replace_deleted, segment_size, memory_flags, align_elements, split_elements);
         index_inited = true;
         ep_added = false;
         appr_alg->ef_ = default_ef;
@@ -174,18 +209,312 @@ class Index {
         return appr_alg->indexFileSize();
     }
 
-    void saveIndex(const std::string &path_to_index) {
-        appr_alg->saveIndex(path_to_index);
+    /*
+    * `format` is "default", "mappable" or "compact". A mappable file is written
+    * next to `path_to_index` and renamed over it, as other processes may still
+    * have the old file mapped and truncating it would pull the pages from under them.
+    */
+    void saveIndex(const std::string &path_to_index, const std::string &format = "default") {
+        if (format == "mappable") {
+            std::string tmp = path_to_index + ".tmp";
+            try {
+                std::ofstream output(tmp, std::ios::binary | std::ios::trunc);
+                if (!output.is_open())
+                    throw std::runtime_error("Cannot open file");
+                appr_alg->saveMappableIndex(output);
+                output.close();
+                if (output.fail())
+                    throw std::runtime_error("Cannot write index file");
+                if (!WriteAheadLog::installFile(tmp, path_to_index))
+                    throw std::runtime_error("Cannot replace the index file");
+            } catch (...) {
+                remove(tmp.c_str());
+                throw;
+            }
+        } else if (format == "compact") {
+            appr_alg->saveCompactIndex(path_to_index, space_name, dim);
+        } else {
+            appr_alg->saveIndex(path_to_index);
+        }
+    }
+
+
+    void saveIndex(std::ostream &output, const std::string &format = "default") {
+        if (format == "mappable") {
+            appr_alg->saveMappableIndex(output);
+        } else if (format == "compact") {
+            appr_alg->saveCompactIndex(output, space_name, dim);
+        } else {
+            appr_alg->saveIndex(output);
+        }
+    }
+
+
+    // Takes a point-in-time snapshot, see HierarchicalNSW::beginSnapshot.
+    void beginSnapshot() {
+        appr_alg->beginSnapshot();
+    }
+
+
+    /*
+    * Writes the snapshot started by beginSnapshot to `path`. The file is written
+    * next to it first, so `path` is either left as it was or fully replaced.
+    */
+    void writeSnapshot(const std::string &path) {
+        std::string tmp = path + ".tmp";
+        try {
+            std::ofstream output(tmp, std::ios::binary | std::ios::trunc);
+            if (!output.is_open())
+                throw std::runtime_error("Cannot open file");
+            appr_alg->writeSnapshot(output);
+            output.close();
+            if (output.fail())
+                throw std::runtime_error("Cannot write index file");
+            if (!WriteAheadLog::installFile(tmp, path))
+                throw std::runtime_error("Cannot replace the index file");
+        } catch (...) {
+            appr_alg->endSnapshot();
+            remove(tmp.c_str());
+            throw;
+        }
     }
 
 
-    void loadIndex(const std::string &path_to_index, size_t max_elements, bool allow_replace_deleted) {
+    void endSnapshot() {
+        appr_alg->endSnapshot();
+    }
+
+
+    /*
+    * With `mmap` the index is served read-only from the memory-mapped file,
+    * which must have been saved with `mappable` set. Otherwise the file is read
+    * with num_threads_default threads. With `tiered` set, only the graph and
+    * compressed vectors are kept in memory and the index is read-only.
+    *
+    * A log written by openLog is loaded by replaying its records on top of its
+    * snapshot. With `keep_log` set, later writes are appended to it.
+    */
+    void loadIndex(const std::string &path_to_index, size_t max_elements, bool allow_replace_deleted, size_t segment_size = 0, bool mmap = false, bool keep_log = false, bool sync_log = true) {
       if (appr_alg) {
           fprintf(stderr, "Warning: Calling load_index for an already inited index. Old index is being deallocated.\r\n");
           delete appr_alg;
+          appr_alg = nullptr;
+      }
+      if (mmap) {
+          if (keep_log)
+              throw std::runtime_error("The index is memory-mapped and read-only");
+          auto start = std::chrono::steady_clock::now();
+          std::unique_ptr<hnswlib::HierarchicalNSW<dist_t>> alg(new hnswlib::HierarchicalNSW<dist_t>(l2space));
+          alg->allow_replace_deleted_ = allow_replace_deleted;
+          alg->loadMappableIndex(path_to_index, l2space);
+          appr_alg = alg.release();
+          load_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+          load_bytes = fileSize(path_to_index);
+          cur_l = appr_alg->cur_element_count.load();
+          index_inited = true;
+          return;
+      }
+      if (tiered) {
+          if (keep_log)
+              throw std::runtime_error("The index keeps its vectors on disk and is read-only");
+          auto start = std::chrono::steady_clock::now();
+          char head[sizeof(hnswlib::CompactIndexHeader)];
+          checkHeader(head, readFileHead(path_to_index, head, sizeof(head)));
+          size_t num_threads = num_threads_default > 0 ? num_threads_default : std::thread::hardware_concurrency();
+          std::unique_ptr<hnswlib::HierarchicalNSW<dist_t>> alg(new hnswlib::HierarchicalNSW<dist_t>(l2space));
+          alg->allow_replace_deleted_ = allow_replace_deleted;
+          alg->memory_flags_ = memory_flags;
+          alg->loadTieredIndex(path_to_index, l2space, vector_cache_size, num_threads);
+          appr_alg = alg.release();
+          load_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+          load_bytes = fileSize(path_to_index);
+          cur_l = appr_alg->cur_element_count.load();
+          index_inited = true;
+          return;
+      }
+
+      char head[sizeof(hnswlib::CompactIndexHeader)];
+      size_t head_size = readFileHead(path_to_index, head, sizeof(head));
+      if (!WriteAheadLog::isLog(head, head_size)) {
+          if (keep_log)
+              throw std::runtime_error("The file is not an index log");
+          loadIndexFile(path_to_index, head, head_size, max_elements, allow_replace_deleted, segment_size);
+          return;
+      }
+
+      hnswlib::MappedFile file(path_to_index);
+      auto start = std::chrono::steady_clock::now();
+      size_t snapshot_size;
+      const char *snapshot = WriteAheadLog::readSnapshot(file.data(), file.size(), dim, snapshot_size);
+      // records of adds that replaced deleted items replay whatever the index is loaded with
+      loadIndexFromBuffer(snapshot, snapshot_size, max_elements, true, segment_size);
+      size_t end = WriteAheadLog::replay(file.data(), file.size(), snapshot - file.data() + snapshot_size, dim, [&](WriteAheadLog::Record &record) {
+          try {
+              replayRecord(record);
+          } catch (std::runtime_error &err) {
+              throw std::runtime_error(std::string("Cannot replay the log: ") + err.what());
+          }
+      });
+      if (!allow_replace_deleted) {
+          appr_alg->allow_replace_deleted_ = false;
+          appr_alg->deleted_elements.clear();
       }
-      appr_alg = new hnswlib::HierarchicalNSW<dist_t>(l2space, path_to_index, false, max_elements, allow_replace_deleted);
-      cur_l = appr_alg->cur_element_count;
+      if (keep_log) {
+          log = std::make_shared<WriteAheadLog>(path_to_index, dim, sync_log);
+          log->open(end);
+      }
+      load_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+      load_bytes = file.size();
+    }
+
+
+    void replayRecord(WriteAheadLog::Record &record) {
+        switch (record.operation) {
+        case WriteAheadLog::ADD_ITEMS:
+            addItems(record.vectors.data(), record.ids.size(), dim, record.ids.data(), record.ids.size(), -1, record.replace_deleted);
+            break;
+        case WriteAheadLog::MARK_DELETED:
+            markDeleted(record.ids[0]);
+            break;
+        case WriteAheadLog::UNMARK_DELETED:
+            unmarkDeleted(record.ids[0]);
+            break;
+        }
+    }
+
+
+    /*
+    * Starts logging the writes to `path`, which is replaced by a log holding a
+    * snapshot of the index. With `sync` set, a write only returns once its
+    * record is on disk, see NifResHNSWLibIndex.
+    */
+    void openLog(const std::string &path, bool sync) {
+        appr_alg->checkWritable();
+        std::shared_ptr<WriteAheadLog> opened = std::make_shared<WriteAheadLog>(path, dim, sync);
+        opened->create([&](std::ostream &output) { appr_alg->saveIndex(output); });
+        if (log)
+            log->close();
+        log = opened;
+    }
+
+
+    // Folds the records of the log into a new snapshot.
+    void compactLog() {
+        if (!log)
+            throw std::runtime_error("The index has no log");
+        log->create([&](std::ostream &output) { appr_alg->saveIndex(output); });
+    }
+
+
+    void closeLog() {
+        if (!log)
+            throw std::runtime_error("The index has no log");
+        std::shared_ptr<WriteAheadLog> closed = log;
+        log.reset();
+        closed->close();
+    }
+
+
+    /*
+    * Files in the compact format record the space and dimension of the index,
+    * so loading one into an index of another kind fails up front.
+    */
+    void checkHeader(const char *data, size_t size) const {
+        hnswlib::CompactIndexHeader header;
+        if (!hnswlib::HierarchicalNSW<dist_t>::readCompactHeader(data, size, header) || header.version < 2)
+            return;
+        if (strncmp(header.space, space_name.c_str(), sizeof(header.space)) != 0)
+            throw std::runtime_error("The index file was saved for another space");
+        if (header.dim != (uint64_t) dim)
+            throw std::runtime_error("The index file was saved for an index of another dimension");
+    }
+
+
+    /*
+    * Reads the space and dimension recorded in a file saved in the compact format.
+    * Only the spaces an Index can be created with are returned, so that callers
+    * can turn `space` into an atom without letting files grow the atom table.
+    */
+    static void readHeader(const std::string &path, std::string &space, size_t &dim) {
+        char data[sizeof(hnswlib::CompactIndexHeader)];
+        std::ifstream input(path, std::ios::binary);
+        if (!input.is_open())
+            throw std::runtime_error("Cannot open file");
+        input.read(data, sizeof(data));
+        hnswlib::CompactIndexHeader header;
+        if (!hnswlib::HierarchicalNSW<dist_t>::readCompactHeader(data, (size_t) input.gcount(), header) || header.version < 2)
+            throw std::runtime_error("The index file does not record its space and dimension");
+        space.assign(header.space, strnlen(header.space, sizeof(header.space)));
+        if (space != "l2" && space != "ip" && space != "cosine")
+            throw std::runtime_error("The index file was saved for an unknown space");
+        dim = header.dim;
+    }
+
+
+    /*
+    * Loads a file written by saveIndex with HierarchicalNSW::loadIndex, which reads
+    * files in the default layout with num_threads_default streams. `head` holds the
+    * first `head_size` bytes of the file.
+    */
+    void loadIndexFile(const std::string &path, const char *head, size_t head_size, size_t max_elements, bool allow_replace_deleted, size_t segment_size) {
+      if (appr_alg) {
+          fprintf(stderr, "Warning: Calling load_index for an already inited index. Old index is being deallocated.\r\n");
+          delete appr_alg;
+          appr_alg = nullptr;
+      }
+      auto start = std::chrono::steady_clock::now();
+      checkHeader(head, head_size);
+      size_t num_threads = num_threads_default > 0 ? num_threads_default : std::thread::hardware_concurrency();
+      std::unique_ptr<hnswlib::HierarchicalNSW<dist_t>> alg(new hnswlib::HierarchicalNSW<dist_t>(l2space));
+      alg->allow_replace_deleted_ = allow_replace_deleted;
+      alg->memory_flags_ = memory_flags;
+      alg->split_elements_ = split_elements;
+      alg->loadIndex(path, l2space, max_elements, segment_size, num_threads);
+      appr_alg = alg.release();
+      load_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+      load_bytes = fileSize(path);
+      cur_l = appr_alg->cur_element_count.load();
+      index_inited = true;
+    }
+
+
+    // reads up to `size` bytes from the start of `path` into `head`, returns how many were read
+    static size_t readFileHead(const std::string &path, char *head, size_t size) {
+        std::ifstream input(path, std::ios::binary);
+        if (!input.is_open())
+            throw std::runtime_error("Cannot open file");
+        input.read(head, size);
+        return (size_t) input.gcount();
+    }
+
+
+    static size_t fileSize(const std::string &path) {
+        std::ifstream file(path, std::ios::binary | std::ios::ate);
+        return file.is_open() ? (size_t) file.tellg() : 0;
+    }
+
+
+    /*
+    * Loads an index from the contents of a file written by saveIndex, e.g. a binary.
+    */
+    void loadIndexFromBuffer(const char *data, size_t size, size_t max_elements, bool allow_replace_deleted, size_t segment_size = 0) {
+      if (appr_alg) {
+          fprintf(stderr, "Warning: Calling load_index for an already inited index. Old index is being deallocated.\r\n");
+          delete appr_alg;
+          appr_alg = nullptr;
+      }
+      auto start = std::chrono::steady_clock::now();
+      checkHeader(data, size);
+      size_t num_threads = num_threads_default > 0 ? num_threads_default : std::thread::hardware_concurrency();
+      std::unique_ptr<hnswlib::HierarchicalNSW<dist_t>> alg(new hnswlib::HierarchicalNSW<dist_t>(l2space));
+      alg->allow_replace_deleted_ = allow_replace_deleted;
+      alg->memory_flags_ = memory_flags;
+      alg->split_elements_ = split_elements;
+      alg->loadIndexFromBuffer(data, size, l2space, max_elements, segment_size, num_threads);
+      appr_alg = alg.release();
+      load_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+      load_bytes = size;
+      cur_l = appr_alg->cur_element_count.load();
       index_inited = true;
     }
 
@@ -200,12 +529,80 @@ class Index {
     }
 
 
-    void addItems(float * input, size_t rows, size_t features, const uint64_t * ids, size_t ids_count, int num_threads = -1, bool replace_deleted = false) {
-        if (num_threads <= 0)
-            num_threads = num_threads_default;
+    /*
+    * Makes room for the rows that are being added when auto_grow is set.
+    * Segmented storage grows by whole segments while other threads keep
+    * using the index. Flat storage has to be reallocated, so it only grows
+    * when the caller holds the index exclusively, to twice its capacity or
+    * to fit the batch, whichever is larger.
+    */
+    void reserveItems(bool exclusive) {
+        if (!auto_grow)
+            return;
+
+        std::unique_lock<std::mutex> lock(grow_lock);
+        // rows of concurrent batches that are already in the index are counted
+        // twice, so this over-estimates but never falls short
+        size_t needed = appr_alg->cur_element_count + pending_rows;
+        size_t capacity = appr_alg->max_elements_;
+        if (needed <= capacity)
+            return;
+
+        size_t segment_size = appr_alg->getSegmentSize();
+        if (segment_size) {
+            appr_alg->resizeIndex((needed + segment_size - 1) / segment_size * segment_size);
+        } else if (exclusive) {
+            appr_alg->resizeIndex(std::max(needed, capacity * 2));
+        }
+    }
 
+
+    // Returns the sequence number of the log record, 0 without a log.
+    uint64_t addItems(float * input, size_t rows, size_t features, const uint64_t * ids, size_t ids_count, int num_threads = -1, bool replace_deleted = false, bool exclusive = true) {
         if (features != dim)
             throw std::runtime_error("Wrong dimensionality of the vectors");
+        // before any default id is taken
+        appr_alg->checkWritable();
+        std::unique_lock<std::mutex> lock_log(log_order, std::defer_lock);
+        if (log) {
+            lock_log.lock();
+            log->checkWritable();
+        }
+
+        hnswlib::labeltype base;
+        pending_rows += rows;
+        try {
+            reserveItems(exclusive);
+            // reserve the default ids of this batch up front
+            base = cur_l.fetch_add(rows);
+            try {
+                addReservedItems(input, rows, ids, ids_count, base, num_threads, replace_deleted);
+            } catch (...) {
+                // rows, or parts of a row, may be in the index already but
+                // will never be in the log
+                if (log)
+                    log->fail();
+                // Rows added before the failure keep their default ids, so those
+                // are only given back when the batch brought its own ids and no
+                // later batch has reserved past them.
+                hnswlib::labeltype end = base + rows;
+                if (ids_count)
+                    cur_l.compare_exchange_strong(end, base);
+                throw;
+            }
+        } catch (...) {
+            pending_rows -= rows;
+            throw;
+        }
+        pending_rows -= rows;
+        // only writes that succeeded are logged
+        return log ? log->appendAddItems(input, rows, ids_count ? ids : nullptr, base, replace_deleted) : 0;
+    }
+
+
+    void addReservedItems(float * input, size_t rows, const uint64_t * ids, size_t ids_count, hnswlib::labeltype base, int num_threads, bool replace_deleted) {
+        if (num_threads <= 0)
+            num_threads = num_threads_default;
 
         // avoid using threads when the number of additions is small:
         if (rows <= num_threads * 4) {
@@ -214,22 +611,25 @@ class Index {
 
         {
             int start = 0;
-            if (!ep_added) {
-                uint64_t id = ids_count ? ids[0] : (cur_l);
-                float* vector_data = input;
-                std::vector<float> norm_array(dim);
-                if (normalize) {
-                    normalize_vector(vector_data, norm_array.data());
-                    vector_data = norm_array.data();
+            if (!ep_added && rows > 0) {
+                std::unique_lock<std::mutex> lock(ep_lock);
+                if (!ep_added) {
+                    uint64_t id = ids_count ? ids[0] : (base);
+                    float* vector_data = input;
+                    std::vector<float> norm_array(dim);
+                    if (normalize) {
+                        normalize_vector(vector_data, norm_array.data());
+                        vector_data = norm_array.data();
+                    }
+                    appr_alg->addPoint((void *)vector_data, (size_t)id, replace_deleted);
+                    start = 1;
+                    ep_added = true;
                 }
-                appr_alg->addPoint((void *)vector_data, (size_t)id, replace_deleted);
-                start = 1;
-                ep_added = true;
             }
 
             if (normalize == false) {
                 ParallelFor(start, rows, num_threads, [&](size_t row, size_t threadId) {
-                    uint64_t id = ids_count ? ids[row] : (cur_l + row);
+                    uint64_t id = ids_count ? ids[row] : (base + row);
                     appr_alg->addPoint((void *)(input + row * dim), (size_t)id, replace_deleted);
                     });
             } else {
@@ -239,36 +639,129 @@ class Index {
                     size_t start_idx = threadId * dim;
                     normalize_vector((float *)(input + row * dim), (norm_array.data() + start_idx));
 
-                    uint64_t id = ids_count ? ids[row] : (cur_l + row);
+                    uint64_t id = ids_count ? ids[row] : (base + row);
                     appr_alg->addPoint((void *)(norm_array.data() + start_idx), (size_t)id, replace_deleted);
                     });
             }
-            cur_l += rows;
         }
     }
 
 
-    std::vector<std::vector<data_t>> getDataReturnList(const uint64_t* ids, size_t ids_count) {
-        std::vector<std::vector<data_t>> data;
-        for (size_t i = 0; i < ids_count; i++) {
-            data.push_back(appr_alg->template getDataByLabel<data_t>((size_t)ids[i]));
+    // Copies the vectors of `ids_count` labels into `out` as one row-major
+    // `ids_count x dim` matrix, straight from the level 0 storage or, for a
+    // tiered index, from its file.
+    void getItems(const uint64_t* ids, size_t ids_count, data_t* out, int num_threads = -1) {
+        std::vector<hnswlib::tableint> internal_ids(ids_count);
+        appr_alg->getInternalIdsByLabels((const hnswlib::labeltype *)ids, ids_count, internal_ids.data());
+
+        if (num_threads <= 0)
+            num_threads = num_threads_default;
+
+        const size_t row_size = appr_alg->data_size_;
+        const size_t rows_per_block = 1024;
+        size_t blocks = (ids_count + rows_per_block - 1) / rows_per_block;
+        // avoid using threads when there are only a few blocks to copy:
+        if (blocks <= num_threads * 4) {
+            num_threads = 1;
         }
-        return data;
+
+        char* dst = (char *)out;
+        ParallelFor(0, blocks, num_threads, [&](size_t block, size_t threadId) {
+            size_t begin = block * rows_per_block;
+            size_t end = std::min(ids_count, begin + rows_per_block);
+            appr_alg->copyVectors(internal_ids.data() + begin, end - begin, dst + begin * row_size);
+        });
     }
 
 
-    std::vector<hnswlib::labeltype> getIdsList() {
+    // Returns up to `limit` labels starting at position `offset`. With `sort`
+    // the labels are ordered ascending, otherwise they come in insertion
+    // (internal id) order, which only reads the requested page.
+    std::vector<hnswlib::labeltype> getIdsList(size_t offset = 0, size_t limit = SIZE_MAX, bool sort = true) {
         std::vector<hnswlib::labeltype> ids;
+        size_t count = appr_alg->cur_element_count;
+        if (offset >= count) {
+            return ids;
+        }
+        limit = std::min(limit, count - offset);
 
-        for (auto kv : appr_alg->label_lookup_) {
-            ids.push_back(kv.first);
+        if (!sort) {
+            ids.resize(limit);
+            for (size_t i = 0; i < limit; i++) {
+                ids[i] = appr_alg->getExternalLabel(offset + i);
+            }
+            return ids;
+        }
+
+        ids.resize(count);
+        for (size_t i = 0; i < count; i++) {
+            ids[i] = appr_alg->getExternalLabel(i);
+        }
+        if (offset == 0 && limit == count) {
+            std::sort(ids.begin(), ids.end());
+        } else {
+            // only order the requested page
+            if (offset > 0) {
+                std::nth_element(ids.begin(), ids.begin() + offset, ids.end());
+            }
+            std::partial_sort(ids.begin() + offset, ids.begin() + offset + limit, ids.end());
+            ids.erase(ids.begin() + offset + limit, ids.end());
+            ids.erase(ids.begin(), ids.begin() + offset);
         }
-        std::sort(ids.begin(), ids.end());
         return ids;
     }
 
 
+    // Searches the `k` nearest neighbors of one vector and stores them closest
+    // first. `norm_buffer` holds `dim` floats used to normalize the vector in
+    // cosine space.
+    void searchRow(const float * vector, size_t k, float * norm_buffer, hnswlib::labeltype * labels, dist_t * dists) {
+        // CustomFilterFunctor idFilter;
+        CustomFilterFunctor* p_idFilter = nullptr;
+
+        if (normalize) {
+            normalize_vector((float *)vector, norm_buffer);
+            vector = norm_buffer;
+        }
+
+        std::priority_queue<std::pair<dist_t, hnswlib::labeltype >> result = appr_alg->searchKnn(
+            (void *)vector, k, p_idFilter);
+        if (result.size() != k) {
+            throw std::runtime_error(
+                "Cannot return the results in a contigious 2D array. Probably ef or M is too small");
+        }
+
+        for (int i = k - 1; i >= 0; i--) {
+            auto& result_tuple = result.top();
+            dists[i] = result_tuple.first;
+            labels[i] = result_tuple.second;
+            result.pop();
+        }
+    }
+
+
+    // Makes `{:ok, labels, dists, rows, k, label_bits, dist_bits}`, taking
+    // ownership of both binaries.
+    ERL_NIF_TERM knnQueryResult(ErlNifEnv * env, ErlNifBinary &data_l_bin, ErlNifBinary &data_d_bin, size_t rows, size_t k) {
+        ERL_NIF_TERM labels_out = enif_make_binary(env, &data_l_bin);
+        ERL_NIF_TERM dists_out = enif_make_binary(env, &data_d_bin);
+
+        ERL_NIF_TERM label_size = enif_make_uint(env, sizeof(hnswlib::labeltype) * 8);
+        ERL_NIF_TERM dist_size = enif_make_uint(env, sizeof(dist_t) * 8);
+        return enif_make_tuple7(env,
+            hnswlib_atom(env, "ok"),
+            labels_out,
+            dists_out, 
+            enif_make_uint64(env, rows), 
+            enif_make_uint64(env, k),
+            label_size,
+            dist_size);
+    }
+
+
     // return true if no error, false otherwise (the `{:error, reason}`-tuple will be saved in `out`)
+    // When `cancelled` is given, it is checked before each row and the query
+    // stops with an error once it is set.
     bool knnQuery(
         ErlNifEnv * env,
         float * input,
@@ -277,7 +770,8 @@ class Index {
         size_t k,
         int num_threads,
         // const std::function<bool(hnswlib::labeltype)>& filter,
-        ERL_NIF_TERM& out) {
+        ERL_NIF_TERM& out,
+        const std::atomic<bool> * cancelled = nullptr) {
         ErlNifBinary data_l_bin;
         ErlNifBinary data_d_bin;
 
@@ -306,63 +800,17 @@ class Index {
         }
         data_d = (dist_t *)data_d_bin.data;
 
-        // CustomFilterFunctor idFilter;
-        CustomFilterFunctor* p_idFilter = nullptr;
-
         try {
-            if (normalize == false) {
-                ParallelFor(0, rows, num_threads, [&](size_t row, size_t threadId) {
-                    std::priority_queue<std::pair<dist_t, hnswlib::labeltype >> result = appr_alg->searchKnn(
-                        (void *)(input + row * features), k, p_idFilter);
-                    if (result.size() != k) {
-                        throw std::runtime_error(
-                            "Cannot return the results in a contigious 2D array. Probably ef or M is too small");
-                    }
-
-                    for (int i = k - 1; i >= 0; i--) {
-                        auto& result_tuple = result.top();
-                        data_d[row * k + i] = result_tuple.first;
-                        data_l[row * k + i] = result_tuple.second;
-                        result.pop();
-                    }
-                });
-            } else {
-                std::vector<float> norm_array(num_threads * features);
-                ParallelFor(0, rows, num_threads, [&](size_t row, size_t threadId) {
-                    float* data = input + row * features;
-
-                    size_t start_idx = threadId * dim;
-                    normalize_vector(data, (norm_array.data() + start_idx));
-
-                    std::priority_queue<std::pair<dist_t, hnswlib::labeltype >> result = appr_alg->searchKnn(
-                        (void*)(norm_array.data() + start_idx), k, p_idFilter);
-                    if (result.size() != k) {
-                        throw std::runtime_error(
-                            "Cannot return the results in a contigious 2D array. Probably ef or M is too small");
-                    }
-
-                    for (int i = k - 1; i >= 0; i--) {
-                        auto& result_tuple = result.top();
-                        data_d[row * k + i] = result_tuple.first;
-                        data_l[row * k + i] = result_tuple.second;
-                        result.pop();
-                    }
-                });
-            }
-
-            ERL_NIF_TERM labels_out = enif_make_binary(env, &data_l_bin);
-            ERL_NIF_TERM dists_out = enif_make_binary(env, &data_d_bin);
+            std::vector<float> norm_array(normalize ? num_threads * features : 0);
+            ParallelFor(0, rows, num_threads, [&](size_t row, size_t threadId) {
+                if (cancelled && *cancelled) {
+                    throw std::runtime_error("The query has been cancelled");
+                }
+                float * norm_buffer = normalize ? norm_array.data() + threadId * dim : nullptr;
+                searchRow(input + row * features, k, norm_buffer, data_l + row * k, data_d + row * k);
+            });
 
-            ERL_NIF_TERM label_size = enif_make_uint(env, sizeof(hnswlib::labeltype) * 8);
-            ERL_NIF_TERM dist_size = enif_make_uint(env, sizeof(dist_t) * 8);
-            out = enif_make_tuple7(env,
-                hnswlib_atom(env, "ok"),
-                labels_out,
-                dists_out, 
-                enif_make_uint64(env, rows), 
-                enif_make_uint64(env, k),
-                label_size,
-                dist_size);
+            out = knnQueryResult(env, data_l_bin, data_d_bin, rows, k);
         } catch (std::runtime_error &err) {
             out = hnswlib_error(env, err.what());
 
@@ -374,13 +822,25 @@ class Index {
     }
 
 
-    void markDeleted(size_t label) {
+    uint64_t markDeleted(size_t label) {
+        std::unique_lock<std::mutex> lock_log(log_order, std::defer_lock);
+        if (log) {
+            lock_log.lock();
+            log->checkWritable();
+        }
         appr_alg->markDelete(label);
+        return log ? log->appendLabel(WriteAheadLog::MARK_DELETED, label) : 0;
     }
 
 
-    void unmarkDeleted(size_t label) {
+    uint64_t unmarkDeleted(size_t label) {
+        std::unique_lock<std::mutex> lock_log(log_order, std::defer_lock);
+        if (log) {
+            lock_log.lock();
+            log->checkWritable();
+        }
         appr_alg->unmarkDelete(label);
+        return log ? log->appendLabel(WriteAheadLog::UNMARK_DELETED, label) : 0;
     }
 
 
@@ -389,6 +849,16 @@ class Index {
     }
 
 
+    void freeze() {
+        appr_alg->freeze();
+    }
+
+
+    void reorder() {
+        appr_alg->reorder(num_threads_default);
+    }
+
+
     size_t getMaxElements() const {
         return appr_alg->max_elements_;
     }
@@ -528,12 +998,36 @@ class BFIndex {
     }
 
 
+    void saveIndex(std::ostream &output) {
+        alg->saveIndex(output);
+    }
+
+
     void loadIndex(const std::string &path_to_index, size_t max_elements) {
         if (alg) {
             fprintf(stderr, "Warning: Calling load_index for an already inited index. Old index is being deallocated.\r\n");
             delete alg;
         }
-        alg = new hnswlib::BruteforceSearch<dist_t>(space, path_to_index);
+        alg = new hnswlib::BruteforceSearch<dist_t>(space, path_to_index, max_elements);
+        cur_l = alg->cur_element_count;
+        index_inited = true;
+    }
+
+
+    /*
+    * Loads an index from the contents of a file written by saveIndex, e.g. a binary.
+    */
+    void loadIndexFromBuffer(const char *data, size_t size, size_t max_elements) {
+        if (alg) {
+            fprintf(stderr, "Warning: Calling load_index for an already inited index. Old index is being deallocated.\r\n");
+            delete alg;
+            alg = nullptr;
+        }
+        MemoryInput buffer(data, size);
+        std::istream input(&buffer);
+        std::unique_ptr<hnswlib::BruteforceSearch<dist_t>> loaded(new hnswlib::BruteforceSearch<dist_t>(space));
+        loaded->loadIndex(input, space, max_elements);
+        alg = loaded.release();
         cur_l = alg->cur_element_count;
         index_inited = true;
     }
@@ -629,9 +1123,23 @@ class BFIndex {
     }
 };
 
+class QueryBatcher;
+// defined in hnswlib_nif.cpp, where QueryBatcher is a complete type
+void delete_query_batcher(QueryBatcher * batcher);
+
 struct NifResHNSWLibIndex {
     Index<float> * val;
     ErlNifRWLock * rwlock;
+    // created once by index_set_query_batching, nullptr until then
+    std::atomic<QueryBatcher *> batcher;
+    // When set, writes that HierarchicalNSW synchronizes on its own (adding
+    // items, marking and unmarking deletions) only take the read side of
+    // `rwlock`, so they run alongside searches. Resizing, loading, saving and
+    // dumping still take it exclusively.
+    std::atomic<bool> concurrent_writes;
+    // Set once the index is frozen. Nothing writes to a frozen index, so
+    // searches and lookups skip `rwlock` altogether.
+    std::atomic<bool> frozen;
 
     static ErlNifResourceType * type;
     static NifResHNSWLibIndex * allocate_resource(ErlNifEnv * env, ERL_NIF_TERM &error) {
@@ -640,6 +1148,9 @@ struct NifResHNSWLibIndex {
             error = erlang::nif::error(env, "cannot allocate NifResHNSWLibIndex resource");
             return res;
         }
+        res->batcher = nullptr;
+        res->concurrent_writes = false;
+        res->frozen = false;
         
         res->rwlock = enif_rwlock_create((char *)"hnswlib.index");
         if (res->rwlock == nullptr) {
@@ -650,6 +1161,69 @@ struct NifResHNSWLibIndex {
         return res;
     }
 
+    // Locks the index for adding items or (un)marking deletions, returns
+    // whether the lock was taken exclusively.
+    bool lock_for_update() {
+        bool exclusive = !concurrent_writes;
+        if (exclusive) {
+            enif_rwlock_rwlock(rwlock);
+        } else {
+            enif_rwlock_rlock(rwlock);
+        }
+        return exclusive;
+    }
+
+    void unlock_for_update(bool exclusive) {
+        if (exclusive) {
+            enif_rwlock_rwunlock(rwlock);
+        } else {
+            enif_rwlock_runlock(rwlock);
+        }
+    }
+
+    // Locks the index for reading it as a whole, as a save or dump does, and
+    // returns whether the lock was taken exclusively. Concurrent writers only
+    // take the read side, so they are held off by the write side instead.
+    // Switching concurrent_writes takes the write side, so the flag cannot
+    // change while the read side is held.
+    bool lock_for_save() {
+        while (true) {
+            if (concurrent_writes) {
+                enif_rwlock_rwlock(rwlock);
+                return true;
+            }
+            enif_rwlock_rlock(rwlock);
+            if (!concurrent_writes)
+                return false;
+            enif_rwlock_runlock(rwlock);
+        }
+    }
+
+    void unlock_for_save(bool exclusive) {
+        unlock_for_update(exclusive);
+    }
+
+    // Locks the index for a search or lookup, returns whether the read lock
+    // was taken, which it is not once the index is frozen.
+    bool lock_for_search() {
+        if (frozen.load(std::memory_order_acquire))
+            return false;
+        enif_rwlock_rlock(rwlock);
+        return true;
+    }
+
+    // Same as lock_for_search, but returns false when the lock is busy.
+    bool try_lock_for_search(bool &locked) {
+        locked = !frozen.load(std::memory_order_acquire);
+        return !locked || enif_rwlock_tryrlock(rwlock) == 0;
+    }
+
+    void unlock_for_search(bool locked) {
+        if (locked) {
+            enif_rwlock_runlock(rwlock);
+        }
+    }
+
     static NifResHNSWLibIndex * get_resource(ErlNifEnv * env, ERL_NIF_TERM term, ERL_NIF_TERM &error) {
         NifResHNSWLibIndex * self_res = nullptr;
         if (!enif_get_resource(env, term, NifResHNSWLibIndex::type, (void **)&self_res) || self_res == nullptr || self_res->val == nullptr) {
@@ -661,6 +1235,12 @@ struct NifResHNSWLibIndex {
     static void destruct_resource(ErlNifEnv *env, void *args) {
         auto res = (NifResHNSWLibIndex *)args;
         if (res) {
+            // stop batching first, a running batch still reads the index
+            if (res->batcher.load()) {
+                delete_query_batcher(res->batcher.load());
+                res->batcher = nullptr;
+            }
+
             if (res->val) {
                 delete res->val;
                 res->val = nullptr;
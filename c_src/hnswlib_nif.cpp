@@ -4,6 +4,7 @@
 #include <climits>
 #include "nif_utils.hpp"
 #include "hnswlib_index.hpp"
+#include "hnswlib_async.hpp"
 
 #ifdef __GNUC__
 #pragma GCC diagnostic ignored "-Wunused-parameter"
@@ -14,6 +15,29 @@
 
 ErlNifResourceType * NifResHNSWLibIndex::type = nullptr;
 ErlNifResourceType * NifResHNSWLibBFIndex::type = nullptr;
+ErlNifResourceType * NifResHNSWLibAsyncQuery::type = nullptr;
+ErlNifResourceType * NifResHNSWLibQuerySlice::type = nullptr;
+ErlNifResourceType * NifResHNSWLibBinary::type = nullptr;
+
+// runs index_knn_query_async requests off the BEAM schedulers
+static WorkerPool * async_pool = nullptr;
+// writes the snapshots taken by index_save_snapshot, apart from the queries,
+// one at a time as they are bound by the disk rather than the CPU
+static WorkerPool * snapshot_pool = nullptr;
+
+void delete_query_batcher(QueryBatcher * batcher) {
+    delete batcher;
+}
+
+// reads the huge_pages and numa_interleave options into hnswlib::MemoryFlags
+static bool get_memory_flags(ErlNifEnv *env, const ERL_NIF_TERM huge_pages_term, const ERL_NIF_TERM numa_interleave_term, int &flags) {
+    bool huge_pages, numa_interleave;
+    if (!erlang::nif::get(env, huge_pages_term, &huge_pages) || !erlang::nif::get(env, numa_interleave_term, &numa_interleave)) {
+        return false;
+    }
+    flags = (huge_pages ? hnswlib::MEMORY_HUGE_PAGES : 0) | (numa_interleave ? hnswlib::MEMORY_NUMA_INTERLEAVE : 0);
+    return true;
+}
 
 static ERL_NIF_TERM hnswlib_index_new(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
     std::string space;
@@ -23,6 +47,10 @@ static ERL_NIF_TERM hnswlib_index_new(ErlNifEnv *env, int argc, const ERL_NIF_TE
     size_t ef_construction = 200;
     size_t random_seed = 100;
     bool allow_replace_deleted = false;
+    size_t segment_size = 0;
+    int memory_flags;
+    bool align_elements = false;
+    bool split_elements = false;
     NifResHNSWLibIndex * index = nullptr;
     ERL_NIF_TERM ret, error;
 
@@ -47,6 +75,18 @@ static ERL_NIF_TERM hnswlib_index_new(ErlNifEnv *env, int argc, const ERL_NIF_TE
     if (!erlang::nif::get(env, argv[6], &allow_replace_deleted)) {
         return enif_make_badarg(env);
     }
+    if (!erlang::nif::get(env, argv[7], &segment_size)) {
+        return enif_make_badarg(env);
+    }
+    if (!get_memory_flags(env, argv[8], argv[9], memory_flags)) {
+        return enif_make_badarg(env);
+    }
+    if (!erlang::nif::get(env, argv[10], &align_elements)) {
+        return enif_make_badarg(env);
+    }
+    if (!erlang::nif::get(env, argv[11], &split_elements)) {
+        return enif_make_badarg(env);
+    }
 
     if ((index = NifResHNSWLibIndex::allocate_resource(env, error)) == nullptr) {
         return error;
@@ -55,7 +95,9 @@ static ERL_NIF_TERM hnswlib_index_new(ErlNifEnv *env, int argc, const ERL_NIF_TE
     index->val = nullptr;
     try {
         index->val = new Index<float>(space, dim);
-        index->val->init_new_index(max_elements, m, ef_construction, random_seed, allow_replace_deleted);
+        index->val->memory_flags = memory_flags;
+        index->val->split_elements = split_elements;
+        index->val->init_new_index(max_elements, m, ef_construction, random_seed, allow_replace_deleted, segment_size, align_elements);
     } catch (std::runtime_error &err) {
         if (index->val) {
             delete index->val;
@@ -103,14 +145,365 @@ static ERL_NIF_TERM hnswlib_index_knn_query(ErlNifEnv *env, int argc, const ERL_
     if (!erlang::nif::get(env, argv[6], &features)) {
         return enif_make_badarg(env);
     }
+    // re-ranking a tiered index reads its vectors from the file
+    if (index->val->tiered && enif_thread_type() != ERL_NIF_THR_DIRTY_IO_SCHEDULER) {
+        return enif_schedule_nif(env, "index_knn_query", ERL_NIF_DIRTY_JOB_IO_BOUND, hnswlib_index_knn_query, argc, argv);
+    }
 
-    enif_rwlock_rlock(index->rwlock);
+    bool locked = index->lock_for_search();
     index->val->knnQuery(env, (float *)data.data, rows, features, k, num_threads, ret);
-    enif_rwlock_runlock(index->rwlock);
+    index->unlock_for_search(locked);
+
+    return ret;
+}
+
+// Queries estimated to take more than this many distance-component
+// evaluations (rows * max(ef, k) * dim) go to a dirty scheduler. Queries of a
+// tiered index always do, as they read from its file.
+static const size_t SMALL_QUERY_MAX_COST = 1 << 20;
+// a normal scheduler timeslice is about one millisecond
+static const ErlNifTime TIMESLICE_USEC = 1000;
+
+// Searches the rows of a query from where the previous slice stopped,
+// rescheduling itself whenever the timeslice of the calling process runs out.
+// argv is the argv of index_knn_query followed by a NifResHNSWLibQuerySlice.
+static ERL_NIF_TERM hnswlib_index_knn_query_slice(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
+    NifResHNSWLibIndex * index = nullptr;
+    NifResHNSWLibQuerySlice * slice = nullptr;
+    ErlNifBinary data;
+    size_t k;
+    size_t rows, features;
+    ERL_NIF_TERM ret, error;
+
+    if ((index = NifResHNSWLibIndex::get_resource(env, argv[0], error)) == nullptr) {
+        return enif_make_badarg(env);
+    }
+    if (!enif_inspect_binary(env, argv[1], &data)) {
+        return enif_make_badarg(env);
+    }
+    if (!erlang::nif::get(env, argv[2], &k)) {
+        return enif_make_badarg(env);
+    }
+    if (!erlang::nif::get(env, argv[5], &rows)) {
+        return enif_make_badarg(env);
+    }
+    if (!erlang::nif::get(env, argv[6], &features)) {
+        return enif_make_badarg(env);
+    }
+    if ((slice = NifResHNSWLibQuerySlice::get_resource(env, argv[7], error)) == nullptr) {
+        return enif_make_badarg(env);
+    }
+    if (index->val->tiered) {
+        return enif_schedule_nif(env, "index_knn_query", ERL_NIF_DIRTY_JOB_IO_BOUND, hnswlib_index_knn_query, 7, argv);
+    }
+
+    // never block a normal scheduler on the index lock
+    bool locked;
+    if (!index->try_lock_for_search(locked)) {
+        return enif_schedule_nif(env, "index_knn_query", ERL_NIF_DIRTY_JOB_CPU_BOUND, hnswlib_index_knn_query, 7, argv);
+    }
+
+    Index<float> * val = index->val;
+    if (slice->next_row == 0) {
+        size_t cost = rows * std::max(val->appr_alg->ef_, k) * features;
+        if (cost > SMALL_QUERY_MAX_COST) {
+            index->unlock_for_search(locked);
+            return enif_schedule_nif(env, "index_knn_query", ERL_NIF_DIRTY_JOB_CPU_BOUND, hnswlib_index_knn_query, 7, argv);
+        }
+    }
+
+    std::vector<float> norm_array(val->normalize ? val->dim : 0);
+    float * norm_buffer = val->normalize ? norm_array.data() : nullptr;
+    hnswlib::labeltype * data_l = (hnswlib::labeltype *)slice->labels.data;
+    float * data_d = (float *)slice->dists.data;
+    const float * input = (const float *)data.data;
+    ErlNifTime start = enif_monotonic_time(ERL_NIF_USEC);
+    try {
+        while (slice->next_row < rows) {
+            size_t row = slice->next_row++;
+            val->searchRow(input + row * features, k, norm_buffer, data_l + row * k, data_d + row * k);
+
+            ErlNifTime elapsed = enif_monotonic_time(ERL_NIF_USEC) - start;
+            if (slice->next_row < rows && elapsed >= TIMESLICE_USEC / 10) {
+                int percent = (int)std::min<ErlNifTime>(100, elapsed * 100 / TIMESLICE_USEC);
+                start += elapsed;
+                if (enif_consume_timeslice(env, percent)) {
+                    index->unlock_for_search(locked);
+                    return enif_schedule_nif(env, "index_knn_query_slice", 0, hnswlib_index_knn_query_slice, argc, argv);
+                }
+            }
+        }
+        slice->owns_binaries = false;
+        ret = val->knnQueryResult(env, slice->labels, slice->dists, rows, k);
+    } catch (std::runtime_error &err) {
+        ret = erlang::nif::error(env, err.what());
+    }
+    index->unlock_for_search(locked);
 
     return ret;
 }
 
+static ERL_NIF_TERM hnswlib_index_knn_query_yielding(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
+    NifResHNSWLibIndex * index = nullptr;
+    NifResHNSWLibQuerySlice * slice = nullptr;
+    ErlNifBinary data;
+    size_t k;
+    long long num_threads;
+    size_t rows, features;
+    ERL_NIF_TERM slice_argv[8];
+    ERL_NIF_TERM error;
+
+    if ((index = NifResHNSWLibIndex::get_resource(env, argv[0], error)) == nullptr) {
+        return enif_make_badarg(env);
+    }
+    if (!enif_inspect_binary(env, argv[1], &data)) {
+        return enif_make_badarg(env);
+    }
+    if (data.size % sizeof(float) != 0) {
+        return enif_make_badarg(env);
+    }
+    if (!erlang::nif::get(env, argv[2], &k) || k == 0) {
+        return enif_make_badarg(env);
+    }
+    if (!erlang::nif::get(env, argv[3], &num_threads)) {
+        return enif_make_badarg(env);
+    }
+    if (!enif_is_fun(env, argv[4]) && !erlang::nif::check_nil(env, argv[4])) {
+        return enif_make_badarg(env);
+    }
+    if (!erlang::nif::get(env, argv[5], &rows)) {
+        return enif_make_badarg(env);
+    }
+    if (!erlang::nif::get(env, argv[6], &features)) {
+        return enif_make_badarg(env);
+    }
+    if (rows * features * sizeof(float) != data.size) {
+        return enif_make_badarg(env);
+    }
+
+    if ((slice = NifResHNSWLibQuerySlice::allocate_resource(env, sizeof(hnswlib::labeltype) * rows * k, sizeof(float) * rows * k, error)) == nullptr) {
+        return error;
+    }
+    for (int i = 0; i < 7; i++) {
+        slice_argv[i] = argv[i];
+    }
+    slice_argv[7] = enif_make_resource(env, slice);
+    enif_release_resource(slice);
+
+    return hnswlib_index_knn_query_slice(env, 8, slice_argv);
+}
+
+static ERL_NIF_TERM hnswlib_index_knn_query_async(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
+    NifResHNSWLibIndex * index = nullptr;
+    NifResHNSWLibAsyncQuery * query = nullptr;
+    ErlNifBinary data;
+    size_t k;
+    long long num_threads;
+    size_t rows, features;
+    ERL_NIF_TERM ret, error;
+
+    if ((index = NifResHNSWLibIndex::get_resource(env, argv[0], error)) == nullptr) {
+        return enif_make_badarg(env);
+    }
+    if (!enif_inspect_binary(env, argv[1], &data)) {
+        return enif_make_badarg(env);
+    }
+    if (data.size % sizeof(float) != 0) {
+        return enif_make_badarg(env);
+    }
+    if (!erlang::nif::get(env, argv[2], &k) || k == 0) {
+        return enif_make_badarg(env);
+    }
+    if (!erlang::nif::get(env, argv[3], &num_threads)) {
+        return enif_make_badarg(env);
+    }
+    if (!erlang::nif::get(env, argv[4], &rows)) {
+        return enif_make_badarg(env);
+    }
+    if (!erlang::nif::get(env, argv[5], &features)) {
+        return enif_make_badarg(env);
+    }
+    if (rows * features * sizeof(float) != data.size) {
+        return enif_make_badarg(env);
+    }
+    if (async_pool == nullptr) {
+        return erlang::nif::error(env, "async queries are not available");
+    }
+
+    if ((query = NifResHNSWLibAsyncQuery::allocate_resource(env, error)) == nullptr) {
+        return error;
+    }
+
+    enif_self(env, &query->caller);
+    enif_keep_resource(index);
+    query->index = index;
+    // copying a large binary into the query env only takes a reference to it
+    query->query = enif_make_copy(query->env, argv[1]);
+    query->ref = enif_make_resource(query->env, query);
+    query->k = k;
+    query->rows = rows;
+    query->features = features;
+    query->num_threads = num_threads;
+
+    ret = enif_make_resource(env, query);
+    // the pool owns this reference until the query replies
+    enif_keep_resource(query);
+    try {
+        async_pool->submit([query](bool run) { query->run(run); });
+    } catch (std::runtime_error &err) {
+        enif_clear_env(query->env);
+        enif_release_resource(query);
+        enif_release_resource(query);
+        return erlang::nif::error(env, err.what());
+    }
+    enif_release_resource(query);
+
+    return erlang::nif::ok(env, ret);
+}
+
+static ERL_NIF_TERM hnswlib_index_knn_query_batched(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
+    NifResHNSWLibIndex * index = nullptr;
+    NifResHNSWLibAsyncQuery * query = nullptr;
+    ErlNifBinary data;
+    size_t k;
+    size_t rows, features;
+    ERL_NIF_TERM ret, error;
+
+    if ((index = NifResHNSWLibIndex::get_resource(env, argv[0], error)) == nullptr) {
+        return enif_make_badarg(env);
+    }
+    if (!enif_inspect_binary(env, argv[1], &data)) {
+        return enif_make_badarg(env);
+    }
+    if (data.size % sizeof(float) != 0) {
+        return enif_make_badarg(env);
+    }
+    if (!erlang::nif::get(env, argv[2], &k) || k == 0) {
+        return enif_make_badarg(env);
+    }
+    if (!erlang::nif::get(env, argv[3], &rows)) {
+        return enif_make_badarg(env);
+    }
+    if (!erlang::nif::get(env, argv[4], &features)) {
+        return enif_make_badarg(env);
+    }
+    if (rows * features * sizeof(float) != data.size) {
+        return enif_make_badarg(env);
+    }
+
+    if ((query = NifResHNSWLibAsyncQuery::allocate_resource(env, error)) == nullptr) {
+        return error;
+    }
+
+    enif_self(env, &query->caller);
+    query->query = enif_make_copy(query->env, argv[1]);
+    query->ref = enif_make_resource(query->env, query);
+    query->k = k;
+    query->rows = rows;
+    query->features = features;
+    query->num_threads = 1;
+
+    ret = enif_make_resource(env, query);
+    // no index lock here: the batcher is never replaced once created
+    QueryBatcher * batcher = index->batcher.load();
+    if (batcher == nullptr) {
+        ret = erlang::nif::error(env, "Query batching is not enabled for this index");
+        enif_clear_env(query->env);
+    } else {
+        // the batcher owns this reference until the query replies
+        enif_keep_resource(query);
+        try {
+            batcher->submit(query);
+            ret = erlang::nif::ok(env, ret);
+        } catch (std::runtime_error &err) {
+            enif_clear_env(query->env);
+            enif_release_resource(query);
+            ret = erlang::nif::error(env, err.what());
+        }
+    }
+    enif_release_resource(query);
+
+    return ret;
+}
+
+static ERL_NIF_TERM hnswlib_index_set_query_batching(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
+    NifResHNSWLibIndex * index = nullptr;
+    size_t max_rows;
+    uint64_t max_delay_us;
+    ERL_NIF_TERM ret, error;
+
+    if ((index = NifResHNSWLibIndex::get_resource(env, argv[0], error)) == nullptr) {
+        return enif_make_badarg(env);
+    }
+    if (!erlang::nif::get(env, argv[1], &max_rows) || max_rows == 0) {
+        return enif_make_badarg(env);
+    }
+    if (!erlang::nif::get(env, argv[2], &max_delay_us)) {
+        return enif_make_badarg(env);
+    }
+
+    QueryBatcher * batcher = index->batcher.load();
+    if (batcher == nullptr) {
+        QueryBatcher * created = new QueryBatcher(index, max_rows, max_delay_us);
+        if (index->batcher.compare_exchange_strong(batcher, created)) {
+            return erlang::nif::ok(env);
+        }
+        // another process enabled batching first
+        delete created;
+    }
+    batcher->configure(max_rows, max_delay_us);
+
+    return erlang::nif::ok(env);
+}
+
+static ERL_NIF_TERM hnswlib_index_knn_query_cancel(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
+    NifResHNSWLibAsyncQuery * query = nullptr;
+    ERL_NIF_TERM error;
+
+    if ((query = NifResHNSWLibAsyncQuery::get_resource(env, argv[0], error)) == nullptr) {
+        return enif_make_badarg(env);
+    }
+
+    if (!query->cancel()) {
+        return erlang::nif::error(env, "The query has already completed");
+    }
+    return erlang::nif::ok(env);
+}
+
+// Waits until the log record `seq` of a write is on disk, see WriteAheadLog::sync.
+static ERL_NIF_TERM hnswlib_index_sync_log(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
+    NifResHNSWLibIndex * index = nullptr;
+    ErlNifUInt64 seq;
+    ERL_NIF_TERM error;
+
+    if ((index = NifResHNSWLibIndex::get_resource(env, argv[0], error)) == nullptr) {
+        return enif_make_badarg(env);
+    }
+    if (!enif_get_uint64(env, argv[1], &seq)) {
+        return enif_make_badarg(env);
+    }
+
+    enif_rwlock_rlock(index->rwlock);
+    std::shared_ptr<WriteAheadLog> log = index->val->log;
+    enif_rwlock_runlock(index->rwlock);
+    // closing the log flushed it
+    if (log) {
+        try {
+            log->sync(seq);
+        } catch (std::runtime_error &err) {
+            return erlang::nif::error(env, err.what());
+        }
+    }
+    return erlang::nif::ok(env);
+}
+
+// Writes wait for their log record on a dirty I/O scheduler, where waiting
+// for the disk does not hold up anything else.
+static ERL_NIF_TERM schedule_sync_log(ErlNifEnv *env, ERL_NIF_TERM index, uint64_t seq) {
+    ERL_NIF_TERM args[] = {index, enif_make_uint64(env, seq)};
+    return enif_schedule_nif(env, "index_sync_log", ERL_NIF_DIRTY_JOB_IO_BOUND, hnswlib_index_sync_log, 2, args);
+}
+
 static ERL_NIF_TERM hnswlib_index_add_items(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
     NifResHNSWLibIndex * index = nullptr;
     ErlNifBinary f32_data;
@@ -144,34 +537,332 @@ static ERL_NIF_TERM hnswlib_index_add_items(ErlNifEnv *env, int argc, const ERL_
             ids_count = ids_binary.size / sizeof(uint64_t);
         }
     }
-    if (!erlang::nif::get(env, argv[3], &num_threads)) {
+    if (!erlang::nif::get(env, argv[3], &num_threads)) {
+        return enif_make_badarg(env);
+    }
+    if (!erlang::nif::get(env, argv[4], &replace_deleted)) {
+        return enif_make_badarg(env);
+    }
+    if (!erlang::nif::get(env, argv[5], &rows)) {
+        return enif_make_badarg(env);
+    }
+    if (!erlang::nif::get(env, argv[6], &features)) {
+        return enif_make_badarg(env);
+    }
+
+    uint64_t seq = 0;
+    bool exclusive = index->lock_for_update();
+    try {
+        seq = index->val->addItems((float *)f32_data.data, rows, features, (const uint64_t *)ids_binary.data, ids_count, num_threads, replace_deleted, exclusive);
+        ret = erlang::nif::ok(env);
+    } catch (std::runtime_error &err) {
+        ret = erlang::nif::error(env, err.what());
+    }
+    bool sync = seq != 0 && index->val->log->syncs();
+    index->unlock_for_update(exclusive);
+
+    if (sync) {
+        return schedule_sync_log(env, argv[0], seq);
+    }
+    return ret;
+}
+
+static ERL_NIF_TERM hnswlib_index_save_index(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
+    NifResHNSWLibIndex * index = nullptr;
+    std::string path;
+    std::string format;
+    ERL_NIF_TERM ret, error;
+
+    if ((index = NifResHNSWLibIndex::get_resource(env, argv[0], error)) == nullptr) {
+        return enif_make_badarg(env);
+    }
+    if (!erlang::nif::get(env, argv[1], path)) {
+        return enif_make_badarg(env);
+    }
+    if (!erlang::nif::get_atom(env, argv[2], format) || (format != "default" && format != "mappable" && format != "compact")) {
+        return enif_make_badarg(env);
+    }
+
+    bool exclusive = index->lock_for_save();
+    try {
+        index->val->saveIndex(path, format);
+        ret = erlang::nif::ok(env);
+    } catch (std::runtime_error &err) {
+        ret = erlang::nif::error(env, err.what());
+    } catch (...) {
+        ret = erlang::nif::error(env, "cannot save index: unknown reason");
+    }
+    index->unlock_for_save(exclusive);
+
+    return ret;
+}
+
+static ERL_NIF_TERM hnswlib_index_save_snapshot(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
+    NifResHNSWLibIndex * index = nullptr;
+    std::string path;
+    ERL_NIF_TERM ret, error;
+
+    if ((index = NifResHNSWLibIndex::get_resource(env, argv[0], error)) == nullptr) {
+        return enif_make_badarg(env);
+    }
+    if (!erlang::nif::get(env, argv[1], path)) {
+        return enif_make_badarg(env);
+    }
+    if (snapshot_pool == nullptr) {
+        return erlang::nif::error(env, "snapshots are not available");
+    }
+
+    ErlNifEnv * msg_env = enif_alloc_env();
+    if (msg_env == nullptr) {
+        return erlang::nif::error(env, "cannot allocate environment for the snapshot");
+    }
+
+    // writers are held off only while the snapshot is taken
+    enif_rwlock_rwlock(index->rwlock);
+    try {
+        index->val->beginSnapshot();
+    } catch (std::runtime_error &err) {
+        enif_rwlock_rwunlock(index->rwlock);
+        enif_free_env(msg_env);
+        return erlang::nif::error(env, err.what());
+    }
+    enif_rwlock_rwunlock(index->rwlock);
+
+    ErlNifPid caller;
+    enif_self(env, &caller);
+    ret = enif_make_ref(env);
+    ERL_NIF_TERM ref = enif_make_copy(msg_env, ret);
+    // the task owns this reference until the snapshot is written
+    enif_keep_resource(index);
+    auto task = [index, path, caller, msg_env, ref](bool run) mutable {
+        if (run) {
+            ERL_NIF_TERM reply;
+            try {
+                index->val->writeSnapshot(path);
+                reply = erlang::nif::atom(msg_env, "ok");
+            } catch (std::runtime_error &err) {
+                reply = erlang::nif::error(msg_env, err.what());
+            }
+            ERL_NIF_TERM msg = enif_make_tuple3(msg_env, erlang::nif::atom(msg_env, "hnswlib_snapshot"), ref, reply);
+            enif_send(nullptr, &caller, msg_env, msg);
+        } else {
+            index->val->endSnapshot();
+        }
+        enif_free_env(msg_env);
+        enif_release_resource(index);
+    };
+    try {
+        snapshot_pool->submit(task);
+    } catch (std::runtime_error &err) {
+        task(false);
+        return erlang::nif::error(env, err.what());
+    }
+
+    return erlang::nif::ok(env, ret);
+}
+
+static ERL_NIF_TERM hnswlib_index_dump(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
+    NifResHNSWLibIndex * index = nullptr;
+    std::string format;
+    ERL_NIF_TERM ret, error;
+
+    if ((index = NifResHNSWLibIndex::get_resource(env, argv[0], error)) == nullptr) {
+        return enif_make_badarg(env);
+    }
+    if (!erlang::nif::get_atom(env, argv[1], format) || (format != "default" && format != "mappable" && format != "compact")) {
+        return enif_make_badarg(env);
+    }
+
+    bool exclusive = index->lock_for_save();
+    try {
+        // the default format is written in one go
+        BufferOutput buffer(format == "default" ? index->val->indexFileSize() : 0);
+        std::ostream output(&buffer);
+        index->val->saveIndex(output, format);
+        ret = NifResHNSWLibBinary::make_binary(env, buffer);
+    } catch (std::runtime_error &err) {
+        ret = erlang::nif::error(env, err.what());
+    } catch (...) {
+        ret = erlang::nif::error(env, "cannot dump index: unknown reason");
+    }
+    index->unlock_for_save(exclusive);
+
+    return ret;
+}
+
+static ERL_NIF_TERM hnswlib_index_read_header(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
+    std::string path;
+    std::string space;
+    size_t dim;
+
+    if (!erlang::nif::get(env, argv[0], path)) {
+        return enif_make_badarg(env);
+    }
+
+    try {
+        Index<float>::readHeader(path, space, dim);
+    } catch (std::runtime_error &err) {
+        return erlang::nif::error(env, err.what());
+    }
+
+    return enif_make_tuple3(env, erlang::nif::atom(env, "ok"), erlang::nif::atom(env, space.c_str()), erlang::nif::make(env, (unsigned long long)dim));
+}
+
+static ERL_NIF_TERM hnswlib_index_load_index(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
+    NifResHNSWLibIndex * index = nullptr;
+    std::string space;
+    size_t dim;
+    std::string path;
+    size_t max_elements;
+    bool allow_replace_deleted;
+    size_t segment_size;
+    bool mmap;
+    bool log;
+    bool sync_log;
+    int memory_flags;
+    bool split_elements;
+    bool tiered;
+    size_t vector_cache_size;
+    ERL_NIF_TERM ret, error;
+
+    if (!erlang::nif::get_atom(env, argv[0], space)) {
+        return enif_make_badarg(env);
+    }
+    if (!erlang::nif::get(env, argv[1], &dim)) {
+        return enif_make_badarg(env);
+    }
+    if (!erlang::nif::get(env, argv[2], path)) {
+        return enif_make_badarg(env);
+    }
+    if (!erlang::nif::get(env, argv[3], &max_elements)) {
+        return enif_make_badarg(env);
+    }
+    if (!erlang::nif::get(env, argv[4], &allow_replace_deleted)) {
+        return enif_make_badarg(env);
+    }
+    if (!erlang::nif::get(env, argv[5], &segment_size)) {
+        return enif_make_badarg(env);
+    }
+    if (!erlang::nif::get(env, argv[6], &mmap)) {
+        return enif_make_badarg(env);
+    }
+    if (!erlang::nif::get(env, argv[7], &log)) {
+        return enif_make_badarg(env);
+    }
+    if (!erlang::nif::get(env, argv[8], &sync_log)) {
+        return enif_make_badarg(env);
+    }
+    if (!get_memory_flags(env, argv[9], argv[10], memory_flags)) {
+        return enif_make_badarg(env);
+    }
+    if (!erlang::nif::get(env, argv[11], &split_elements)) {
+        return enif_make_badarg(env);
+    }
+    if (!erlang::nif::get(env, argv[12], &tiered)) {
+        return enif_make_badarg(env);
+    }
+    if (!erlang::nif::get(env, argv[13], &vector_cache_size)) {
+        return enif_make_badarg(env);
+    }
+
+    if ((index = NifResHNSWLibIndex::allocate_resource(env, error)) == nullptr) {
+        return error;
+    }
+
+    enif_rwlock_rwlock(index->rwlock);
+    try {
+        index->val = new Index<float>(space, dim);
+        index->val->memory_flags = memory_flags;
+        index->val->split_elements = split_elements;
+        index->val->tiered = tiered;
+        index->val->vector_cache_size = vector_cache_size;
+        index->val->loadIndex(path, max_elements, allow_replace_deleted, segment_size, mmap, log, sync_log);
+        // a tiered index is read-only, so its searches skip the lock
+        if (tiered)
+            index->frozen.store(true, std::memory_order_release);
+
+        ret = erlang::nif::ok(env, enif_make_resource(env, index));
+    } catch (std::runtime_error &err) {
+        if (index->val) {
+            delete index->val;
+            index->val = nullptr;
+        }
+        ret = erlang::nif::error(env, err.what());
+    }
+    enif_rwlock_rwunlock(index->rwlock);
+    enif_release_resource(index);
+
+    return ret;
+}
+
+static ERL_NIF_TERM hnswlib_index_from_binary(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
+    NifResHNSWLibIndex * index = nullptr;
+    std::string space;
+    size_t dim;
+    ErlNifBinary data;
+    size_t max_elements;
+    bool allow_replace_deleted;
+    size_t segment_size;
+    int memory_flags;
+    bool split_elements;
+    ERL_NIF_TERM ret, error;
+
+    if (!erlang::nif::get_atom(env, argv[0], space)) {
+        return enif_make_badarg(env);
+    }
+    if (!erlang::nif::get(env, argv[1], &dim)) {
         return enif_make_badarg(env);
     }
-    if (!erlang::nif::get(env, argv[4], &replace_deleted)) {
+    if (!enif_inspect_binary(env, argv[2], &data)) {
         return enif_make_badarg(env);
     }
-    if (!erlang::nif::get(env, argv[5], &rows)) {
+    if (!erlang::nif::get(env, argv[3], &max_elements)) {
         return enif_make_badarg(env);
     }
-    if (!erlang::nif::get(env, argv[6], &features)) {
+    if (!erlang::nif::get(env, argv[4], &allow_replace_deleted)) {
+        return enif_make_badarg(env);
+    }
+    if (!erlang::nif::get(env, argv[5], &segment_size)) {
+        return enif_make_badarg(env);
+    }
+    if (!get_memory_flags(env, argv[6], argv[7], memory_flags)) {
         return enif_make_badarg(env);
     }
+    if (!erlang::nif::get(env, argv[8], &split_elements)) {
+        return enif_make_badarg(env);
+    }
+
+    if ((index = NifResHNSWLibIndex::allocate_resource(env, error)) == nullptr) {
+        return error;
+    }
 
     enif_rwlock_rwlock(index->rwlock);
     try {
-        index->val->addItems((float *)f32_data.data, rows, features, (const uint64_t *)ids_binary.data, ids_count, num_threads, replace_deleted);
-        ret = erlang::nif::ok(env);
+        index->val = new Index<float>(space, dim);
+        index->val->memory_flags = memory_flags;
+        index->val->split_elements = split_elements;
+        index->val->loadIndexFromBuffer((const char *)data.data, data.size, max_elements, allow_replace_deleted, segment_size);
+
+        ret = erlang::nif::ok(env, enif_make_resource(env, index));
     } catch (std::runtime_error &err) {
+        delete index->val;
+        index->val = nullptr;
         ret = erlang::nif::error(env, err.what());
+    } catch (...) {
+        delete index->val;
+        index->val = nullptr;
+        ret = erlang::nif::error(env, "cannot load index: unknown reason");
     }
     enif_rwlock_rwunlock(index->rwlock);
+    enif_release_resource(index);
 
     return ret;
 }
 
-static ERL_NIF_TERM hnswlib_index_save_index(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
+static ERL_NIF_TERM hnswlib_index_open_log(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
     NifResHNSWLibIndex * index = nullptr;
     std::string path;
+    bool sync;
     ERL_NIF_TERM ret, error;
 
     if ((index = NifResHNSWLibIndex::get_resource(env, argv[0], error)) == nullptr) {
@@ -180,65 +871,63 @@ static ERL_NIF_TERM hnswlib_index_save_index(ErlNifEnv *env, int argc, const ERL
     if (!erlang::nif::get(env, argv[1], path)) {
         return enif_make_badarg(env);
     }
+    if (!erlang::nif::get(env, argv[2], &sync)) {
+        return enif_make_badarg(env);
+    }
 
-    enif_rwlock_rlock(index->rwlock);
+    enif_rwlock_rwlock(index->rwlock);
     try {
-        index->val->saveIndex(path);
+        index->val->openLog(path, sync);
         ret = erlang::nif::ok(env);
     } catch (std::runtime_error &err) {
         ret = erlang::nif::error(env, err.what());
     } catch (...) {
-        ret = erlang::nif::error(env, "cannot save index: unknown reason");
+        ret = erlang::nif::error(env, "cannot open log: unknown reason");
     }
-    enif_rwlock_runlock(index->rwlock);
+    enif_rwlock_rwunlock(index->rwlock);
 
     return ret;
 }
 
-static ERL_NIF_TERM hnswlib_index_load_index(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
+static ERL_NIF_TERM hnswlib_index_compact_log(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
     NifResHNSWLibIndex * index = nullptr;
-    std::string space;
-    size_t dim;
-    std::string path;
-    size_t max_elements;
-    bool allow_replace_deleted;
     ERL_NIF_TERM ret, error;
 
-    if (!erlang::nif::get_atom(env, argv[0], space)) {
-        return enif_make_badarg(env);
-    }
-    if (!erlang::nif::get(env, argv[1], &dim)) {
-        return enif_make_badarg(env);
-    }
-    if (!erlang::nif::get(env, argv[2], path)) {
-        return enif_make_badarg(env);
-    }
-    if (!erlang::nif::get(env, argv[3], &max_elements)) {
+    if ((index = NifResHNSWLibIndex::get_resource(env, argv[0], error)) == nullptr) {
         return enif_make_badarg(env);
     }
-    if (!erlang::nif::get(env, argv[4], &allow_replace_deleted)) {
-        return enif_make_badarg(env);
+
+    // the snapshot has to match the log, so writes wait until it is taken
+    enif_rwlock_rwlock(index->rwlock);
+    try {
+        index->val->compactLog();
+        ret = erlang::nif::ok(env);
+    } catch (std::runtime_error &err) {
+        ret = erlang::nif::error(env, err.what());
+    } catch (...) {
+        ret = erlang::nif::error(env, "cannot compact log: unknown reason");
     }
+    enif_rwlock_rwunlock(index->rwlock);
 
-    if ((index = NifResHNSWLibIndex::allocate_resource(env, error)) == nullptr) {
-        return error;
+    return ret;
+}
+
+static ERL_NIF_TERM hnswlib_index_close_log(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
+    NifResHNSWLibIndex * index = nullptr;
+    ERL_NIF_TERM ret, error;
+
+    if ((index = NifResHNSWLibIndex::get_resource(env, argv[0], error)) == nullptr) {
+        return enif_make_badarg(env);
     }
 
     enif_rwlock_rwlock(index->rwlock);
     try {
-        index->val = new Index<float>(space, dim);
-        index->val->loadIndex(path, max_elements, allow_replace_deleted);
-
-        ret = erlang::nif::ok(env, enif_make_resource(env, index));
+        index->val->closeLog();
+        ret = erlang::nif::ok(env);
     } catch (std::runtime_error &err) {
-        if (index->val) {
-            delete index->val;
-            index->val = nullptr;
-        }
         ret = erlang::nif::error(env, err.what());
     }
     enif_rwlock_rwunlock(index->rwlock);
-    enif_release_resource(index);
 
     return ret;
 }
@@ -255,15 +944,20 @@ static ERL_NIF_TERM hnswlib_index_mark_deleted(ErlNifEnv *env, int argc, const E
         return enif_make_badarg(env);
     }
 
-    enif_rwlock_rwlock(index->rwlock);
+    uint64_t seq = 0;
+    bool exclusive = index->lock_for_update();
     try {
-        index->val->markDeleted(label);
+        seq = index->val->markDeleted(label);
         ret = erlang::nif::ok(env);
     } catch (std::runtime_error &err) {
         ret = erlang::nif::error(env, err.what());
     }
-    enif_rwlock_rwunlock(index->rwlock);
+    bool sync = seq != 0 && index->val->log->syncs();
+    index->unlock_for_update(exclusive);
 
+    if (sync) {
+        return schedule_sync_log(env, argv[0], seq);
+    }
     return ret;
 }
 
@@ -279,15 +973,20 @@ static ERL_NIF_TERM hnswlib_index_unmark_deleted(ErlNifEnv *env, int argc, const
         return enif_make_badarg(env);
     }
 
-    enif_rwlock_rwlock(index->rwlock);
+    uint64_t seq = 0;
+    bool exclusive = index->lock_for_update();
     try {
-        index->val->unmarkDeleted(label);
+        seq = index->val->unmarkDeleted(label);
         ret = erlang::nif::ok(env);
     } catch (std::runtime_error &err) {
         ret = erlang::nif::error(env, err.what());
     }
-    enif_rwlock_rwunlock(index->rwlock);
+    bool sync = seq != 0 && index->val->log->syncs();
+    index->unlock_for_update(exclusive);
 
+    if (sync) {
+        return schedule_sync_log(env, argv[0], seq);
+    }
     return ret;
 }
 
@@ -303,7 +1002,13 @@ static ERL_NIF_TERM hnswlib_index_resize_index(ErlNifEnv *env, int argc, const E
         return enif_make_badarg(env);
     }
 
-    enif_rwlock_rwlock(index->rwlock);
+    // segmented storage is resized in place, searches and writes can go on
+    bool exclusive = !index->val->appr_alg->isSegmented();
+    if (exclusive) {
+        enif_rwlock_rwlock(index->rwlock);
+    } else {
+        enif_rwlock_rlock(index->rwlock);
+    }
     try {
         index->val->resizeIndex(new_size);
         ret = erlang::nif::ok(env);
@@ -312,11 +1017,135 @@ static ERL_NIF_TERM hnswlib_index_resize_index(ErlNifEnv *env, int argc, const E
     } catch (std::bad_alloc&) {
         ret = erlang::nif::error(env, "no enough memory available to resize the index");
     }
+    if (exclusive) {
+        enif_rwlock_rwunlock(index->rwlock);
+    } else {
+        enif_rwlock_runlock(index->rwlock);
+    }
+
+    return ret;
+}
+
+static ERL_NIF_TERM hnswlib_index_freeze(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
+    NifResHNSWLibIndex * index = nullptr;
+    ERL_NIF_TERM ret, error;
+
+    if ((index = NifResHNSWLibIndex::get_resource(env, argv[0], error)) == nullptr) {
+        return enif_make_badarg(env);
+    }
+
+    enif_rwlock_rwlock(index->rwlock);
+    try {
+        index->val->freeze();
+        // searches that come after this skip the lock
+        index->frozen.store(true, std::memory_order_release);
+        ret = erlang::nif::ok(env);
+    } catch (std::runtime_error &err) {
+        ret = erlang::nif::error(env, err.what());
+    } catch (std::bad_alloc&) {
+        ret = erlang::nif::error(env, "no enough memory available to freeze the index");
+    }
+    enif_rwlock_rwunlock(index->rwlock);
+
+    return ret;
+}
+
+static ERL_NIF_TERM hnswlib_index_reorder(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
+    NifResHNSWLibIndex * index = nullptr;
+    ERL_NIF_TERM ret, error;
+
+    if ((index = NifResHNSWLibIndex::get_resource(env, argv[0], error)) == nullptr) {
+        return enif_make_badarg(env);
+    }
+
+    enif_rwlock_rwlock(index->rwlock);
+    try {
+        index->val->reorder();
+        ret = erlang::nif::ok(env);
+    } catch (std::runtime_error &err) {
+        ret = erlang::nif::error(env, err.what());
+    } catch (std::bad_alloc&) {
+        ret = erlang::nif::error(env, "no enough memory available to reorder the index");
+    }
     enif_rwlock_rwunlock(index->rwlock);
 
     return ret;
 }
 
+static ERL_NIF_TERM hnswlib_index_set_auto_grow(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
+    NifResHNSWLibIndex * index = nullptr;
+    bool auto_grow;
+    ERL_NIF_TERM error;
+
+    if ((index = NifResHNSWLibIndex::get_resource(env, argv[0], error)) == nullptr) {
+        return enif_make_badarg(env);
+    }
+    if (!erlang::nif::get(env, argv[1], &auto_grow)) {
+        return enif_make_badarg(env);
+    }
+
+    // a batch that already checked the old value finishes with it
+    index->val->auto_grow = auto_grow;
+    return erlang::nif::ok(env);
+}
+
+static ERL_NIF_TERM hnswlib_index_set_concurrent_writes(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
+    NifResHNSWLibIndex * index = nullptr;
+    bool concurrent_writes;
+    ERL_NIF_TERM error;
+
+    if ((index = NifResHNSWLibIndex::get_resource(env, argv[0], error)) == nullptr) {
+        return enif_make_badarg(env);
+    }
+    if (!erlang::nif::get(env, argv[1], &concurrent_writes)) {
+        return enif_make_badarg(env);
+    }
+
+    // writers that read the old value either hold the lock exclusively or
+    // still hold the read side, in both cases they finish before this one.
+    // Saves check the flag under the read side, so it changes under the
+    // write side, which is only waited for on a dirty scheduler. new/4 and
+    // the loads set it every time, mostly to the value it already has.
+    if (index->concurrent_writes == concurrent_writes)
+        return erlang::nif::ok(env);
+    if (enif_thread_type() == ERL_NIF_THR_NORMAL_SCHEDULER) {
+        return enif_schedule_nif(env, "index_set_concurrent_writes", ERL_NIF_DIRTY_JOB_CPU_BOUND, hnswlib_index_set_concurrent_writes, argc, argv);
+    }
+    enif_rwlock_rwlock(index->rwlock);
+    index->concurrent_writes = concurrent_writes;
+    enif_rwlock_rwunlock(index->rwlock);
+    return erlang::nif::ok(env);
+}
+
+static ERL_NIF_TERM hnswlib_index_get_load_stats(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
+    NifResHNSWLibIndex * index = nullptr;
+    ERL_NIF_TERM ret, error;
+
+    if ((index = NifResHNSWLibIndex::get_resource(env, argv[0], error)) == nullptr) {
+        return enif_make_badarg(env);
+    }
+
+    enif_rwlock_rlock(index->rwlock);
+    size_t bytes = index->val->load_bytes;
+    double seconds = index->val->load_seconds;
+    enif_rwlock_runlock(index->rwlock);
+
+    ERL_NIF_TERM keys[] = {
+        erlang::nif::atom(env, "bytes"),
+        erlang::nif::atom(env, "seconds"),
+        erlang::nif::atom(env, "bytes_per_second"),
+    };
+    ERL_NIF_TERM values[] = {
+        erlang::nif::make(env, (unsigned long long)bytes),
+        erlang::nif::make(env, seconds),
+        erlang::nif::make(env, seconds > 0 ? bytes / seconds : 0.0),
+    };
+    if (!enif_make_map_from_arrays(env, keys, values, 3, &ret)) {
+        return erlang::nif::error(env, "cannot make load stats");
+    }
+    return erlang::nif::ok(env, ret);
+}
+
 static ERL_NIF_TERM hnswlib_index_get_max_elements(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
     NifResHNSWLibIndex * index = nullptr;
     ERL_NIF_TERM ret, error;
@@ -431,48 +1260,56 @@ static ERL_NIF_TERM hnswlib_index_get_items(ErlNifEnv *env, int argc, const ERL_
         }
     }
 
-    std::vector<std::vector<float>> data;
-    bool has_error = false;
-    enif_rwlock_rwlock(index->rwlock);
+    ErlNifBinary data;
+    if (!enif_alloc_binary(ids_count * index->val->dim * sizeof(float), &data)) {
+        return erlang::nif::error(env, "cannot allocate enough memory to hold the items");
+    }
+
+    bool locked = index->lock_for_search();
     try {
-        data = index->val->getDataReturnList((const uint64_t *)ids_binary.data, ids_count);
+        index->val->getItems((const uint64_t *)ids_binary.data, ids_count, (float *)data.data);
+        ret = erlang::nif::ok(env, enif_make_binary(env, &data));
     } catch (std::runtime_error &err) {
+        enif_release_binary(&data);
         ret = erlang::nif::error(env, err.what());
-        has_error = true;
-    }
-    enif_rwlock_rwunlock(index->rwlock);
-    if (has_error) return ret;
-
-    std::vector<ERL_NIF_TERM> ret_list;
-    for (auto& d : data) {
-        ErlNifBinary bin;
-        size_t bin_size = d.size() * sizeof(float);
-        if (!enif_alloc_binary(bin_size, &bin)) {
-            return erlang::nif::error(env, "cannot allocate enough memory to hold the list");
-        }
-        memcpy(bin.data, d.data(), bin_size);
-        ret_list.push_back(enif_make_binary(env, &bin));
     }
+    index->unlock_for_search(locked);
 
-    return erlang::nif::ok(env, enif_make_list_from_array(env, ret_list.data(), (unsigned)ret_list.size()));
+    return ret;
 }
 
 static ERL_NIF_TERM hnswlib_index_get_ids_list(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
     NifResHNSWLibIndex * index = nullptr;
+    size_t offset;
+    size_t limit = SIZE_MAX;
+    bool sort;
     ERL_NIF_TERM ret, error;
 
     if ((index = NifResHNSWLibIndex::get_resource(env, argv[0], error)) == nullptr) {
         return enif_make_badarg(env);
     }
+    if (!erlang::nif::get(env, argv[1], &offset)) {
+        return enif_make_badarg(env);
+    }
+    if (!erlang::nif::get(env, argv[2], &limit) && !erlang::nif::check_nil(env, argv[2])) {
+        return enif_make_badarg(env);
+    }
+    if (!erlang::nif::get(env, argv[3], &sort)) {
+        return enif_make_badarg(env);
+    }
 
     enif_rwlock_rlock(index->rwlock);
-    std::vector<hnswlib::labeltype> ids = index->val->getIdsList();
+    std::vector<hnswlib::labeltype> ids = index->val->getIdsList(offset, limit, sort);
     enif_rwlock_runlock(index->rwlock);
-    if (erlang::nif::make(env, ids, ret)) {
+
+    ErlNifBinary ids_binary;
+    size_t ids_size = ids.size() * sizeof(hnswlib::labeltype);
+    if (!enif_alloc_binary(ids_size, &ids_binary)) {
         return erlang::nif::error(env, "cannot allocate enough memory to hold the list");
     }
+    memcpy(ids_binary.data, ids.data(), ids_size);
 
-    return erlang::nif::ok(env, ret);
+    return erlang::nif::ok(env, enif_make_binary(env, &ids_binary));
 }
 
 static ERL_NIF_TERM hnswlib_index_get_ef_construction(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
@@ -685,6 +1522,30 @@ static ERL_NIF_TERM hnswlib_bfindex_save_index(ErlNifEnv *env, int argc, const E
     return ret;
 }
 
+static ERL_NIF_TERM hnswlib_bfindex_dump(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
+    NifResHNSWLibBFIndex * index = nullptr;
+    ERL_NIF_TERM ret, error;
+
+    if ((index = NifResHNSWLibBFIndex::get_resource(env, argv[0], error)) == nullptr) {
+        return enif_make_badarg(env);
+    }
+
+    enif_rwlock_rlock(index->rwlock);
+    try {
+        BufferOutput buffer;
+        std::ostream output(&buffer);
+        index->val->saveIndex(output);
+        ret = NifResHNSWLibBinary::make_binary(env, buffer);
+    } catch (std::runtime_error &err) {
+        ret = erlang::nif::error(env, err.what());
+    } catch (...) {
+        ret = erlang::nif::error(env, "cannot dump index: unknown reason");
+    }
+    enif_rwlock_runlock(index->rwlock);
+
+    return ret;
+}
+
 static ERL_NIF_TERM hnswlib_bfindex_load_index(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
     NifResHNSWLibBFIndex * index = nullptr;
     std::string space;
@@ -729,6 +1590,52 @@ static ERL_NIF_TERM hnswlib_bfindex_load_index(ErlNifEnv *env, int argc, const E
     return ret;
 }
 
+static ERL_NIF_TERM hnswlib_bfindex_from_binary(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
+    NifResHNSWLibBFIndex * index = nullptr;
+    std::string space;
+    size_t dim;
+    ErlNifBinary data;
+    size_t max_elements;
+    ERL_NIF_TERM ret, error;
+
+    if (!erlang::nif::get_atom(env, argv[0], space)) {
+        return enif_make_badarg(env);
+    }
+    if (!erlang::nif::get(env, argv[1], &dim)) {
+        return enif_make_badarg(env);
+    }
+    if (!enif_inspect_binary(env, argv[2], &data)) {
+        return enif_make_badarg(env);
+    }
+    if (!erlang::nif::get(env, argv[3], &max_elements)) {
+        return enif_make_badarg(env);
+    }
+
+    if ((index = NifResHNSWLibBFIndex::allocate_resource(env, error)) == nullptr) {
+        return error;
+    }
+
+    enif_rwlock_rwlock(index->rwlock);
+    try {
+        index->val = new BFIndex<float>(space, dim);
+        index->val->loadIndexFromBuffer((const char *)data.data, data.size, max_elements);
+
+        ret = erlang::nif::ok(env, enif_make_resource(env, index));
+    } catch (std::runtime_error &err) {
+        delete index->val;
+        index->val = nullptr;
+        ret = erlang::nif::error(env, err.what());
+    } catch (...) {
+        delete index->val;
+        index->val = nullptr;
+        ret = erlang::nif::error(env, "cannot load index: unknown reason");
+    }
+    enif_rwlock_rwunlock(index->rwlock);
+    enif_release_resource(index);
+
+    return ret;
+}
+
 static ERL_NIF_TERM hnswlib_bfindex_get_max_elements(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
     ERL_NIF_TERM error;
     NifResHNSWLibBFIndex * index = nullptr;
@@ -778,9 +1685,35 @@ static int on_load(ErlNifEnv *env, void **, ERL_NIF_TERM) {
     if (!rt) return -1;
     NifResHNSWLibBFIndex::type = rt;
 
+    rt = enif_open_resource_type(env, "Elixir.HNSWLib.Nif", "NifResHNSWLibAsyncQuery", NifResHNSWLibAsyncQuery::destruct_resource, ERL_NIF_RT_CREATE, NULL);
+    if (!rt) return -1;
+    NifResHNSWLibAsyncQuery::type = rt;
+
+    rt = enif_open_resource_type(env, "Elixir.HNSWLib.Nif", "NifResHNSWLibQuerySlice", NifResHNSWLibQuerySlice::destruct_resource, ERL_NIF_RT_CREATE, NULL);
+    if (!rt) return -1;
+    NifResHNSWLibQuerySlice::type = rt;
+
+    rt = enif_open_resource_type(env, "Elixir.HNSWLib.Nif", "NifResHNSWLibBinary", NifResHNSWLibBinary::destruct_resource, ERL_NIF_RT_CREATE, NULL);
+    if (!rt) return -1;
+    NifResHNSWLibBinary::type = rt;
+
+    async_pool = new WorkerPool(std::thread::hardware_concurrency());
+    snapshot_pool = new WorkerPool(1);
+
     return 0;
 }
 
+static void on_unload(ErlNifEnv *, void *) {
+    if (async_pool) {
+        delete async_pool;
+        async_pool = nullptr;
+    }
+    if (snapshot_pool) {
+        delete snapshot_pool;
+        snapshot_pool = nullptr;
+    }
+}
+
 static int on_reload(ErlNifEnv *, void **, ERL_NIF_TERM) {
     return 0;
 }
@@ -790,21 +1723,38 @@ static int on_upgrade(ErlNifEnv *, void **, void **, ERL_NIF_TERM) {
 }
 
 static ErlNifFunc nif_functions[] = {
-    {"index_new", 7, hnswlib_index_new, 0},
+    {"index_new", 12, hnswlib_index_new, 0},
     {"index_knn_query", 7, hnswlib_index_knn_query, ERL_NIF_DIRTY_JOB_CPU_BOUND},
+    {"index_knn_query_yielding", 7, hnswlib_index_knn_query_yielding, 0},
+    {"index_knn_query_async", 6, hnswlib_index_knn_query_async, 0},
+    {"index_knn_query_cancel", 1, hnswlib_index_knn_query_cancel, 0},
+    {"index_knn_query_batched", 5, hnswlib_index_knn_query_batched, 0},
+    {"index_set_query_batching", 3, hnswlib_index_set_query_batching, 0},
     {"index_add_items", 7, hnswlib_index_add_items, ERL_NIF_DIRTY_JOB_CPU_BOUND},
     {"index_get_items", 2, hnswlib_index_get_items, ERL_NIF_DIRTY_JOB_CPU_BOUND},
-    {"index_get_ids_list", 1, hnswlib_index_get_ids_list, 0},
+    {"index_get_ids_list", 4, hnswlib_index_get_ids_list, ERL_NIF_DIRTY_JOB_CPU_BOUND},
     {"index_get_ef", 1, hnswlib_index_get_ef, 0},
     {"index_set_ef", 2, hnswlib_index_set_ef, 0},
     {"index_get_num_threads", 1, hnswlib_index_get_num_threads, 0},
     {"index_set_num_threads", 2, hnswlib_index_set_num_threads, 0},
     {"index_index_file_size", 1, hnswlib_index_index_file_size, 0},
-    {"index_save_index", 2, hnswlib_index_save_index, ERL_NIF_DIRTY_JOB_IO_BOUND},
-    {"index_load_index", 5, hnswlib_index_load_index, ERL_NIF_DIRTY_JOB_IO_BOUND},
+    {"index_save_index", 3, hnswlib_index_save_index, ERL_NIF_DIRTY_JOB_IO_BOUND},
+    {"index_save_snapshot", 2, hnswlib_index_save_snapshot, ERL_NIF_DIRTY_JOB_IO_BOUND},
+    {"index_read_header", 1, hnswlib_index_read_header, ERL_NIF_DIRTY_JOB_IO_BOUND},
+    {"index_load_index", 14, hnswlib_index_load_index, ERL_NIF_DIRTY_JOB_IO_BOUND},
+    {"index_dump", 2, hnswlib_index_dump, ERL_NIF_DIRTY_JOB_CPU_BOUND},
+    {"index_from_binary", 9, hnswlib_index_from_binary, ERL_NIF_DIRTY_JOB_CPU_BOUND},
+    {"index_open_log", 3, hnswlib_index_open_log, ERL_NIF_DIRTY_JOB_IO_BOUND},
+    {"index_compact_log", 1, hnswlib_index_compact_log, ERL_NIF_DIRTY_JOB_IO_BOUND},
+    {"index_close_log", 1, hnswlib_index_close_log, ERL_NIF_DIRTY_JOB_IO_BOUND},
     {"index_mark_deleted", 2, hnswlib_index_mark_deleted, 0},
     {"index_unmark_deleted", 2, hnswlib_index_unmark_deleted, 0},
     {"index_resize_index", 2, hnswlib_index_resize_index, 0},
+    {"index_freeze", 1, hnswlib_index_freeze, ERL_NIF_DIRTY_JOB_CPU_BOUND},
+    {"index_reorder", 1, hnswlib_index_reorder, ERL_NIF_DIRTY_JOB_CPU_BOUND},
+    {"index_set_concurrent_writes", 2, hnswlib_index_set_concurrent_writes, 0},
+    {"index_set_auto_grow", 2, hnswlib_index_set_auto_grow, 0},
+    {"index_get_load_stats", 1, hnswlib_index_get_load_stats, 0},
     {"index_get_max_elements", 1, hnswlib_index_get_max_elements, 0},
     {"index_get_current_count", 1, hnswlib_index_get_current_count, 0},
     {"index_get_ef_construction", 1, hnswlib_index_get_ef_construction, 0},
@@ -817,6 +1767,8 @@ static ErlNifFunc nif_functions[] = {
     {"bfindex_set_num_threads", 2, hnswlib_bfindex_set_num_threads, 0},
     {"bfindex_save_index", 2, hnswlib_bfindex_save_index, ERL_NIF_DIRTY_JOB_IO_BOUND},
     {"bfindex_load_index", 4, hnswlib_bfindex_load_index, ERL_NIF_DIRTY_JOB_IO_BOUND},
+    {"bfindex_dump", 1, hnswlib_bfindex_dump, ERL_NIF_DIRTY_JOB_CPU_BOUND},
+    {"bfindex_from_binary", 4, hnswlib_bfindex_from_binary, ERL_NIF_DIRTY_JOB_CPU_BOUND},
     {"bfindex_get_max_elements", 1, hnswlib_bfindex_get_max_elements, 0},
     {"bfindex_get_current_count", 1, hnswlib_bfindex_get_current_count, 0},
     {"bfindex_get_num_threads", 1, hnswlib_bfindex_get_num_threads, 0},
@@ -824,7 +1776,7 @@ static ErlNifFunc nif_functions[] = {
     {"float_size", 0, hnswlib_float_size, 0}
 };
 
-ERL_NIF_INIT(Elixir.HNSWLib.Nif, nif_functions, on_load, on_reload, on_upgrade, NULL);
+ERL_NIF_INIT(Elixir.HNSWLib.Nif, nif_functions, on_load, on_reload, on_upgrade, on_unload);
 
 #if defined(__GNUC__)
 #pragma GCC visibility push(default)
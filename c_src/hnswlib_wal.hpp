@@ -0,0 +1,512 @@
+#ifndef HNSWLIB_WAL_HPP
+#define HNSWLIB_WAL_HPP
+
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <fstream>
+#include <functional>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <string.h>
+#include <hnswlib.h>
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+/*
+ * Append-only log of the writes to an index.
+ *
+ * A log file starts with a header and a snapshot of the index in the format
+ * saveIndex writes, followed by one record per write made since the snapshot:
+ *
+ *   uint64 payload size | uint32 CRC-32C of the payload | uint32 0 | payload
+ *
+ * Records are handed to the OS as they are appended and made durable by
+ * sync(). Writers waiting in sync() at the same time share one fsync, so the
+ * cost of flushing is spread over every write that arrived meanwhile (group
+ * commit). A record torn by a crash fails its checksum and ends the replay.
+ *
+ * Compaction writes the current index as the snapshot of a new file without
+ * records and renames it over the log, so a crash leaves either the old or
+ * the new log behind, never a mix of both.
+ *
+ * Records are appended after the write they describe has been applied, in
+ * the order the index applied them. When a record cannot be written or
+ * flushed, or a write stops partway, the index already holds a write the log
+ * may not, so the log refuses further records until compaction has replaced
+ * it with a snapshot of the index.
+ */
+class WriteAheadLog {
+ public:
+    static const uint64_t MAGIC = 0x314c415757534e48;  // "HNSWWAL1"
+    static const uint64_t VERSION = 1;
+
+    enum Operation : uint8_t {
+        ADD_ITEMS = 1,
+        MARK_DELETED = 2,
+        UNMARK_DELETED = 3,
+    };
+
+    struct Header {
+        uint64_t magic;
+        uint64_t version;
+        uint64_t dim;
+        uint64_t snapshot_size;
+    };
+
+    struct RecordHeader {
+        uint64_t payload_size;
+        uint32_t crc;
+        uint32_t reserved;
+    };
+
+    struct Record {
+        uint8_t operation;
+        bool replace_deleted;
+        // the labels written, a single one for (un)marking deletions
+        std::vector<uint64_t> ids;
+        // ids.size() x dim vectors for ADD_ITEMS
+        std::vector<float> vectors;
+    };
+
+ private:
+    std::string path_;
+    size_t dim_;
+    bool sync_;
+    int fd_{-1};
+    size_t size_{0};
+
+    std::mutex lock_;
+    std::condition_variable synced_;
+    // sequence numbers of the last appended and the last durable record
+    uint64_t appended_{0};
+    uint64_t durable_{0};
+    // set while a writer flushes the file or compaction replaces it
+    bool syncing_{false};
+    // set when a record could not be written or flushed, or a write was only
+    // partly applied, cleared by create()
+    bool failed_{false};
+
+ public:
+    /*
+    * With `sync` unset the records are left to the OS to write back, which
+    * survives a crash of the VM but not of the machine.
+    */
+    WriteAheadLog(const std::string &path, size_t dim, bool sync)
+        : path_(path), dim_(dim), sync_(sync) {}
+
+    WriteAheadLog(const WriteAheadLog &) = delete;
+    WriteAheadLog &operator=(const WriteAheadLog &) = delete;
+
+    ~WriteAheadLog() {
+        closeFile(fd_);
+    }
+
+
+    /*
+    * Replaces the log with one that only holds a snapshot written by `save`.
+    * Every record appended so far is covered by the snapshot, so it counts as
+    * durable once the new file is in place. The caller must keep other threads
+    * from appending meanwhile.
+    */
+    void create(const std::function<void(std::ostream &)> &save) {
+        beginExclusive();
+        std::string tmp = path_ + ".tmp";
+        try {
+            Header header = {MAGIC, VERSION, dim_, 0};
+            {
+                std::ofstream output(tmp, std::ios::binary | std::ios::trunc);
+                if (!output.is_open())
+                    throw std::runtime_error("Cannot open file");
+                output.write((const char *) &header, sizeof(header));
+                save(output);
+                header.snapshot_size = (uint64_t) output.tellp() - sizeof(header);
+                output.seekp(0);
+                output.write((const char *) &header, sizeof(header));
+                output.close();
+                if (output.fail())
+                    throw std::runtime_error("Cannot write the log");
+            }
+            int fd = openFile(tmp);
+            if (fd < 0 || !syncFile(fd)) {
+                closeFile(fd);
+                throw std::runtime_error("Cannot write the log");
+            }
+            if (!replaceFile(tmp, path_)) {
+                closeFile(fd);
+                throw std::runtime_error("Cannot replace the log");
+            }
+            closeFile(fd_);
+            fd_ = fd;
+            size_ = sizeof(Header) + header.snapshot_size;
+            if (!syncDirectory(path_))
+                throw std::runtime_error("Cannot sync the log");
+        } catch (...) {
+            remove(tmp.c_str());
+            endExclusive(false);
+            throw;
+        }
+        {
+            std::lock_guard<std::mutex> lock(lock_);
+            failed_ = false;
+        }
+        endExclusive(true);
+    }
+
+
+    /*
+    * Continues an existing log after its last valid record at `end`, dropping
+    * whatever a crash left behind it.
+    */
+    void open(size_t end) {
+        int fd = openFile(path_);
+        if (fd < 0)
+            throw std::runtime_error("Cannot open file");
+        if (!truncateFile(fd, end)) {
+            closeFile(fd);
+            throw std::runtime_error("Cannot write the log");
+        }
+        closeFile(fd_);
+        fd_ = fd;
+        size_ = end;
+    }
+
+
+    /*
+    * Flushes every record and closes the file.
+    */
+    void close() {
+        beginExclusive();
+        bool synced = fd_ < 0 || syncFile(fd_);
+        closeFile(fd_);
+        fd_ = -1;
+        endExclusive(synced);
+        if (!synced)
+            throw std::runtime_error("Cannot sync the log");
+    }
+
+
+    // Returns the sequence number to pass to sync().
+    uint64_t appendAddItems(const float *vectors, size_t rows, const uint64_t *ids, uint64_t base, bool replace_deleted) {
+        size_t ids_size = rows * sizeof(uint64_t);
+        size_t vectors_size = rows * dim_ * sizeof(float);
+        std::vector<char> record(sizeof(RecordHeader) + 2 + sizeof(uint64_t) + ids_size + vectors_size);
+        char *p = record.data() + sizeof(RecordHeader);
+        *p++ = ADD_ITEMS;
+        *p++ = replace_deleted;
+        uint64_t count = rows;
+        memcpy(p, &count, sizeof(count));
+        p += sizeof(count);
+        for (size_t row = 0; row < rows; row++) {
+            uint64_t id = ids ? ids[row] : base + row;
+            memcpy(p, &id, sizeof(id));
+            p += sizeof(id);
+        }
+        memcpy(p, vectors, vectors_size);
+        return append(record);
+    }
+
+
+    uint64_t appendLabel(Operation operation, uint64_t label) {
+        std::vector<char> record(sizeof(RecordHeader) + 1 + sizeof(label));
+        record[sizeof(RecordHeader)] = operation;
+        memcpy(record.data() + sizeof(RecordHeader) + 1, &label, sizeof(label));
+        return append(record);
+    }
+
+
+    bool syncs() const {
+        return sync_;
+    }
+
+
+    // Throws when the log may be missing a write the index holds, see failed_.
+    void checkWritable() {
+        std::lock_guard<std::mutex> lock(lock_);
+        if (failed_)
+            throw failedError();
+    }
+
+
+    // Records that the index holds a write that could not be appended, such
+    // as a batch that failed after some of its rows were added.
+    void fail() {
+        std::lock_guard<std::mutex> lock(lock_);
+        failed_ = true;
+    }
+
+
+    /*
+    * Returns once the record with sequence number `seq` is on disk. The
+    * first writer to arrive flushes everything appended until then while the
+    * others wait for it, then the next one flushes what arrived meanwhile.
+    */
+    void sync(uint64_t seq) {
+        if (!sync_ || seq == 0)
+            return;
+
+        std::unique_lock<std::mutex> lock(lock_);
+        // `seq` may come from a log closed since then, which flushed it
+        seq = std::min(seq, appended_);
+        while (durable_ < seq) {
+            if (syncing_) {
+                synced_.wait(lock);
+                continue;
+            }
+            syncing_ = true;
+            uint64_t target = appended_;
+            int fd = fd_;
+            lock.unlock();
+            bool synced = syncFile(fd);
+            lock.lock();
+            syncing_ = false;
+            if (synced && target > durable_)
+                durable_ = target;
+            if (!synced)
+                failed_ = true;
+            synced_.notify_all();
+            if (!synced)
+                throw std::runtime_error("Cannot sync the log");
+        }
+    }
+
+
+    /*
+    * Puts the finished file `tmp` in place of `path` the way compaction replaces
+    * the log: its contents and then the rename are flushed to disk.
+    */
+    static bool installFile(const std::string &tmp, const std::string &path) {
+        int fd = openFile(tmp);
+        bool synced = fd >= 0 && syncFile(fd);
+        closeFile(fd);
+        return synced && replaceFile(tmp, path) && syncDirectory(path);
+    }
+
+
+    static bool isLog(const char *data, size_t size) {
+        uint64_t magic = 0;
+        if (size < sizeof(magic))
+            return false;
+        memcpy(&magic, data, sizeof(magic));
+        return magic == MAGIC;
+    }
+
+
+    /*
+    * Validates the header of a log file and returns its snapshot, which is
+    * followed by the records.
+    */
+    static const char *readSnapshot(const char *data, size_t size, size_t dim, size_t &snapshot_size) {
+        Header header;
+        if (size < sizeof(header))
+            throw std::runtime_error("Index seems to be corrupted or unsupported");
+        memcpy(&header, data, sizeof(header));
+        if (header.magic != MAGIC || header.version != VERSION)
+            throw std::runtime_error("Unsupported log format version");
+        if (header.dim != dim)
+            throw std::runtime_error("The log was written for an index of another dimension");
+        if (header.snapshot_size > size - sizeof(header))
+            throw std::runtime_error("Index seems to be corrupted or unsupported");
+        snapshot_size = header.snapshot_size;
+        return data + sizeof(header);
+    }
+
+
+    /*
+    * Calls fn(record) for each record from `offset` on and returns the offset
+    * past the last valid one.
+    */
+    static size_t replay(const char *data, size_t size, size_t offset, size_t dim, const std::function<void(Record &)> &fn) {
+        Record record;
+        while (size - offset >= sizeof(RecordHeader)) {
+            RecordHeader header;
+            memcpy(&header, data + offset, sizeof(header));
+            const char *payload = data + offset + sizeof(header);
+            if (header.payload_size > size - offset - sizeof(header) || hnswlib::crc32c(payload, header.payload_size) != header.crc)
+                break;
+            if (!decode(payload, header.payload_size, dim, record))
+                throw std::runtime_error("Index seems to be corrupted or unsupported");
+            fn(record);
+            offset += sizeof(header) + header.payload_size;
+        }
+        return offset;
+    }
+
+ private:
+    static std::runtime_error failedError() {
+        return std::runtime_error("The log could not be written, compact or close it before writing again");
+    }
+
+
+    // fills in the header of `record` and writes it
+    uint64_t append(std::vector<char> &record) {
+        RecordHeader header;
+        header.payload_size = record.size() - sizeof(header);
+        header.crc = hnswlib::crc32c(record.data() + sizeof(header), header.payload_size);
+        header.reserved = 0;
+        memcpy(record.data(), &header, sizeof(header));
+
+        std::lock_guard<std::mutex> lock(lock_);
+        if (failed_)
+            throw failedError();
+        if (!writeFile(fd_, record.data(), record.size())) {
+            // don't leave a torn record in front of the next ones
+            truncateFile(fd_, size_);
+            failed_ = true;
+            throw std::runtime_error("Cannot write the log");
+        }
+        size_ += record.size();
+        return ++appended_;
+    }
+
+
+    static bool decode(const char *payload, size_t size, size_t dim, Record &record) {
+        if (size == 0)
+            return false;
+        record.operation = payload[0];
+        record.ids.clear();
+        record.vectors.clear();
+        if (record.operation == MARK_DELETED || record.operation == UNMARK_DELETED) {
+            if (size != 1 + sizeof(uint64_t))
+                return false;
+            record.ids.resize(1);
+            memcpy(record.ids.data(), payload + 1, sizeof(uint64_t));
+            return true;
+        }
+        uint64_t rows;
+        if (record.operation != ADD_ITEMS || size < 2 + sizeof(rows))
+            return false;
+        record.replace_deleted = payload[1] != 0;
+        memcpy(&rows, payload + 2, sizeof(rows));
+        size_t row_size = sizeof(uint64_t) + dim * sizeof(float);
+        if (rows != (size - 2 - sizeof(rows)) / row_size || (size - 2 - sizeof(rows)) % row_size != 0)
+            return false;
+        record.ids.resize(rows);
+        record.vectors.resize(rows * dim);
+        memcpy(record.ids.data(), payload + 2 + sizeof(rows), rows * sizeof(uint64_t));
+        memcpy(record.vectors.data(), payload + 2 + sizeof(rows) + rows * sizeof(uint64_t), rows * dim * sizeof(float));
+        return true;
+    }
+
+
+    // Waits for a running flush and keeps new ones out until endExclusive.
+    void beginExclusive() {
+        std::unique_lock<std::mutex> lock(lock_);
+        synced_.wait(lock, [this] { return !syncing_; });
+        syncing_ = true;
+    }
+
+
+    void endExclusive(bool synced) {
+        std::lock_guard<std::mutex> lock(lock_);
+        if (synced)
+            durable_ = appended_;
+        syncing_ = false;
+        synced_.notify_all();
+    }
+
+
+#ifdef _WIN32
+    static int openFile(const std::string &path) {
+        return _open(path.c_str(), _O_WRONLY | _O_APPEND | _O_BINARY);
+    }
+
+    static void closeFile(int fd) {
+        if (fd >= 0)
+            _close(fd);
+    }
+
+    static bool writeFile(int fd, const char *data, size_t size) {
+        while (size > 0) {
+            int written = _write(fd, data, (unsigned int) std::min(size, (size_t) INT_MAX));
+            if (written <= 0)
+                return false;
+            data += written;
+            size -= written;
+        }
+        return true;
+    }
+
+    static bool syncFile(int fd) {
+        return _commit(fd) == 0;
+    }
+
+    static bool truncateFile(int fd, size_t size) {
+        return _chsize_s(fd, (__int64) size) == 0;
+    }
+
+    // MOVEFILE_WRITE_THROUGH only returns once the rename is on disk
+    static bool replaceFile(const std::string &from, const std::string &to) {
+        return MoveFileExA(from.c_str(), to.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+    }
+
+    static bool syncDirectory(const std::string &) {
+        return true;
+    }
+#else
+    static int openFile(const std::string &path) {
+        return ::open(path.c_str(), O_WRONLY | O_APPEND);
+    }
+
+    static void closeFile(int fd) {
+        if (fd >= 0)
+            ::close(fd);
+    }
+
+    static bool writeFile(int fd, const char *data, size_t size) {
+        while (size > 0) {
+            ssize_t written = ::write(fd, data, size);
+            if (written < 0 && errno == EINTR)
+                continue;
+            if (written <= 0)
+                return false;
+            data += written;
+            size -= written;
+        }
+        return true;
+    }
+
+    static bool syncFile(int fd) {
+#ifdef __APPLE__
+        return fsync(fd) == 0;
+#else
+        return fdatasync(fd) == 0;
+#endif
+    }
+
+    static bool truncateFile(int fd, size_t size) {
+        return ftruncate(fd, (off_t) size) == 0;
+    }
+
+    static bool replaceFile(const std::string &from, const std::string &to) {
+        return rename(from.c_str(), to.c_str()) == 0;
+    }
+
+    // makes a rename into the directory of `path` durable
+    static bool syncDirectory(const std::string &path) {
+        size_t slash = path.find_last_of('/');
+        std::string dir = slash == std::string::npos ? "." : slash == 0 ? "/" : path.substr(0, slash);
+        int fd = ::open(dir.c_str(), O_RDONLY);
+        if (fd < 0)
+            return false;
+        bool synced = fsync(fd) == 0;
+        ::close(fd);
+        return synced;
+    }
+#endif
+};
+
+#endif  /* HNSWLIB_WAL_HPP */
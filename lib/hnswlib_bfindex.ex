@@ -217,9 +217,11 @@ defmodule HNSWLib.BFIndex do
 
   - *max_elements*: `non_neg_integer()`.
 
-    Maximum number of elements to load from the index.
+    Capacity of the loaded index. All saved elements are always loaded,
+    this only controls how much room is left for new ones.
 
-    If set to 0, all elements will be loaded.
+    If set to a value smaller than the number of saved elements (e.g. 0),
+    the capacity of the saved index is used.
 
     Defaults to 0.
   """
@@ -244,6 +246,68 @@ defmodule HNSWLib.BFIndex do
     end
   end
 
+  @doc """
+  Serialize the index to a binary.
+
+  The binary has the same contents as the file written by `save_index/2`, so it
+  can be stored or sent to another node and turned back into an index with
+  `from_binary/4`. It is written in place without going through a file.
+  """
+  @spec dump(%T{}) :: {:ok, binary()} | {:error, String.t()}
+  def dump(self = %T{}) do
+    HNSWLib.Nif.bfindex_dump(self.reference)
+  end
+
+  @doc """
+  Load an index from a binary returned by `dump/1`.
+
+  The contents of a file written by `save_index/2` can be loaded as well.
+
+  ##### Positional Parameters
+
+  - *space*: `:cosine` | `:ip` | `:l2`.
+
+    An atom that indicates the vector space. Valid values are
+
+      - `:cosine`, cosine space
+      - `:ip`, inner product space
+      - `:l2`, L2 space
+
+  - *dim*: `non_neg_integer()`.
+
+    Number of dimensions for each vector.
+
+  - *binary*: `binary()`.
+
+    The serialized index.
+
+  ##### Keyword Parameters
+
+  - *max_elements*: `non_neg_integer()`.
+
+    See `load_index/4`. Defaults to 0.
+  """
+  @spec from_binary(:cosine | :ip | :l2, non_neg_integer(), binary(), [
+          {:max_elements, non_neg_integer()}
+        ]) :: {:ok, %T{}} | {:error, String.t()}
+  def from_binary(space, dim, binary, opts \\ [])
+      when (space == :l2 or space == :ip or space == :cosine) and is_integer(dim) and dim >= 0 and
+             is_binary(binary) and is_list(opts) do
+    max_elements = Helper.get_keyword!(opts, :max_elements, :non_neg_integer, 0)
+
+    with {:ok, ref} <- HNSWLib.Nif.bfindex_from_binary(space, dim, binary, max_elements) do
+      {:ok,
+       %T{
+         space: space,
+         dim: dim,
+         reference: ref
+       }}
+    else
+      {:error, reason} ->
+        {:error, reason}
+    end
+  end
+
   @doc """
   Get the maximum number of elements the index can hold.
   """
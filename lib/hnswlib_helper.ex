@@ -2,12 +2,13 @@ defmodule HNSWLib.Helper do
   @moduledoc false
 
   def get_keyword!(opts, key, type, default, allow_nil? \\ false) do
-    val = opts[key] || default
+    # `false` is a valid value, so only fall back to the default for missing keys
+    val = if opts[key] == nil, do: default, else: opts[key]
 
     if allow_nil? and val == nil do
       val
     else
-      case get_keyword(key, opts[key] || default, type) do
+      case get_keyword(key, val, type) do
         {:ok, val} ->
           val
 
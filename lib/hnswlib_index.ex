@@ -65,12 +65,76 @@ defmodule HNSWLib.Index do
 
   - *random_seed*: `non_neg_integer()`.
   - *allow_replace_deleted*: `boolean()`.
+  - *concurrent_writes*: `boolean()`.
+
+    See `set_concurrent_writes/2`. Defaults to `false`.
+
+  - *segment_size*: `non_neg_integer()`.
+
+    Store the elements in segments of this many elements (rounded up to a
+    power of two) instead of one block per array. A segmented index grows
+    by allocating new segments, without copying the existing elements, and
+    can grow while searches and concurrent writes are running.
+
+    Defaults to `0`, a single block that is reallocated to grow.
+
+  - *auto_grow*: `boolean()`.
+
+    Whether `add_items/3` grows the index when it runs out of room instead
+    of returning an error. A segmented index grows by whole segments, other
+    indexes to twice their size or to fit the new items, whichever is larger.
+    With concurrent writes enabled, only a segmented index can grow.
+
+    Defaults to `true`.
+
+  - *huge_pages*: `boolean()`.
+
+    Back the stored vectors and links with transparent huge pages, which
+    makes queries on large indexes miss the TLB less often. Only applies on
+    Linux, to blocks of at least 2 MB, and when transparent huge pages are
+    enabled in `madvise` or `always` mode.
+
+    Defaults to `false`.
+
+  - *numa_interleave*: `boolean()`.
+
+    Spread the stored vectors and links over all NUMA nodes instead of the
+    node of the thread that first writes them, so that queries running on
+    any node see the same memory bandwidth. Only applies on Linux, to blocks
+    of at least 2 MB, on machines with more than one NUMA node.
+
+    Defaults to `false`.
+
+  - *align_elements*: `boolean()`.
+
+    Start each stored vector on a 64-byte cache line and pad each element
+    to a whole number of cache lines, so that reading a vector touches as
+    few cache lines as possible. Costs up to 63 bytes of padding per
+    element. Saved indexes keep the layout.
+
+    Defaults to `false`.
+
+  - *split_elements*: `boolean()`.
+
+    Store the vectors and labels in arrays of their own instead of next to
+    the links of each element, so that walking the graph only brings links
+    into the cache. Only changes the layout in memory: saved indexes can be
+    loaded with or without it.
+
+    Defaults to `false`.
   """
   @spec new(:cosine | :ip | :l2, non_neg_integer(), pos_integer(), [
           {:m, non_neg_integer()},
           {:ef_construction, non_neg_integer()},
           {:random_seed, non_neg_integer()},
-          {:allow_replace_deleted, boolean()}
+          {:allow_replace_deleted, boolean()},
+          {:concurrent_writes, boolean()},
+          {:segment_size, non_neg_integer()},
+          {:auto_grow, boolean()},
+          {:huge_pages, boolean()},
+          {:numa_interleave, boolean()},
+          {:align_elements, boolean()},
+          {:split_elements, boolean()}
         ]) :: {:ok, %T{}} | {:error, String.t()}
   def new(space, dim, max_elements, opts \\ [])
       when (space == :l2 or space == :ip or space == :cosine) and is_integer(dim) and dim >= 0 and
@@ -79,6 +143,13 @@ defmodule HNSWLib.Index do
     ef_construction = Helper.get_keyword!(opts, :ef_construction, :non_neg_integer, 200)
     random_seed = Helper.get_keyword!(opts, :random_seed, :non_neg_integer, 100)
     allow_replace_deleted = Helper.get_keyword!(opts, :allow_replace_deleted, :boolean, false)
+    concurrent_writes = Helper.get_keyword!(opts, :concurrent_writes, :boolean, false)
+    segment_size = Helper.get_keyword!(opts, :segment_size, :non_neg_integer, 0)
+    auto_grow = Helper.get_keyword!(opts, :auto_grow, :boolean, true)
+    huge_pages = Helper.get_keyword!(opts, :huge_pages, :boolean, false)
+    numa_interleave = Helper.get_keyword!(opts, :numa_interleave, :boolean, false)
+    align_elements = Helper.get_keyword!(opts, :align_elements, :boolean, false)
+    split_elements = Helper.get_keyword!(opts, :split_elements, :boolean, false)
 
     with {:ok, ref} <-
            HNSWLib.Nif.index_new(
@@ -88,8 +159,15 @@ defmodule HNSWLib.Index do
              m,
              ef_construction,
              random_seed,
-             allow_replace_deleted
-           ) do
+             allow_replace_deleted,
+             segment_size,
+             huge_pages,
+             numa_interleave,
+             align_elements,
+             split_elements
+           ),
+         :ok <- HNSWLib.Nif.index_set_concurrent_writes(ref, concurrent_writes),
+         :ok <- HNSWLib.Nif.index_set_auto_grow(ref, auto_grow) do
       {:ok,
        %T{
          space: space,
@@ -122,55 +200,249 @@ defmodule HNSWLib.Index do
   - *num_threads*: `integer()`.
 
     Number of threads to use.
+
+  - *batch*: `boolean()`.
+
+    Search this query together with other concurrent queries, see
+    `set_query_batching/2`. `num_threads` is ignored for batched queries.
+
+    Defaults to `false`.
+
+  - *scheduler*: `:dirty | :auto`.
+
+    Where the query runs. With `:dirty` it always runs on a dirty CPU scheduler,
+    or a dirty IO scheduler for an index loaded with `tiered: true`. With
+    `:auto`, queries with a small estimated cost (rows, `ef`, `k` and the
+    dimension) run single-threaded on the calling scheduler, yielding whenever
+    their timeslice is used up, which avoids the dirty scheduler handoff; larger
+    queries and queries of an index loaded with `tiered: true` still go to a
+    dirty scheduler.
+
+    Defaults to `:dirty`.
   """
   @spec knn_query(%T{}, Nx.Tensor.t() | binary() | [binary()], [
           {:k, pos_integer()},
-          {:num_threads, integer()}
+          {:num_threads, integer()},
+          {:batch, boolean()},
+          {:scheduler, :dirty | :auto}
           # {:filter, function()}
         ]) :: {:ok, Nx.Tensor.t(), Nx.Tensor.t()} | {:error, String.t()}
-  def knn_query(self, query, opts \\ [])
-
-  def knn_query(self = %T{}, query, opts) when is_binary(query) do
+  def knn_query(self = %T{}, query, opts \\ []) do
     k = Helper.get_keyword!(opts, :k, :pos_integer, 1)
     num_threads = Helper.get_keyword!(opts, :num_threads, :integer, -1)
+    batch = Helper.get_keyword!(opts, :batch, :boolean, false)
+    scheduler = Helper.get_keyword!(opts, :scheduler, {:atom, [:dirty, :auto]}, :dirty)
+    {data, rows, features} = _query_data!(self, query)
+
+    cond do
+      batch ->
+        with {:ok, ref} <-
+               HNSWLib.Nif.index_knn_query_batched(self.reference, data, k, rows, features) do
+          await_knn_query(ref)
+        end
+
+      scheduler == :auto ->
+        HNSWLib.Nif.index_knn_query_yielding(
+          self.reference,
+          data,
+          k,
+          num_threads,
+          nil,
+          rows,
+          features
+        )
+        |> knn_query_reply()
+
+      true ->
+        _do_knn_query(self, data, k, num_threads, nil, rows, features)
+    end
+  end
+
+  @doc """
+  Enable or reconfigure query batching for the index.
+
+  With batching enabled, queries made with `batch: true` are queued on the
+  index and searched together, which saves the per-call overhead when many
+  processes run small queries at the same time. A batch is searched once it
+  holds *max_rows* rows, or *max_delay_us* microseconds after its first
+  query arrived, whichever comes first. Each caller still gets its own result.
+  Queries still queued when the index is garbage collected get
+  `{:error, "query batching stopped"}`.
+
+  ##### Keyword Parameters
+
+  - *max_rows*: `pos_integer()`.
+
+    Number of rows that triggers a batch.
+
+    Defaults to `64`.
+
+  - *max_delay_us*: `non_neg_integer()`.
+
+    Longest time in microseconds a query waits for other queries.
+
+    Defaults to `200`.
+  """
+  @spec set_query_batching(%T{}, [
+          {:max_rows, pos_integer()},
+          {:max_delay_us, non_neg_integer()}
+        ]) :: :ok | {:error, String.t()}
+  def set_query_batching(self = %T{}, opts \\ []) do
+    max_rows = Helper.get_keyword!(opts, :max_rows, :pos_integer, 64)
+    max_delay_us = Helper.get_keyword!(opts, :max_delay_us, :non_neg_integer, 200)
+    HNSWLib.Nif.index_set_query_batching(self.reference, max_rows, max_delay_us)
+  end
+
+  @doc """
+  Query the index without blocking the caller.
+
+  The query runs on a pool of native threads instead of a dirty scheduler.
+  The call returns a reference right away and the result is sent to the
+  calling process as a `{:hnswlib_knn_query, ref, reply}` message, where
+  `reply` can be turned into the `knn_query/3` result with
+  `knn_query_reply/1`. Use `await_knn_query/2` to wait for the result in
+  the calling process.
+
+  ##### Positional Parameters
+
+  - *query*: `Nx.Tensor.t() | binary() | [binary()]`.
+
+    A vector or a list of vectors to query.
+
+    If *query* is a list of vectors, the vectors must be of the same dimension.
+
+  ##### Keyword Paramters
+
+  - *k*: `pos_integer()`.
+
+    Number of nearest neighbors to return.
+
+  - *num_threads*: `integer()`.
+
+    Number of threads used by this query. Defaults to `1`, so that
+    concurrent queries share the pool rather than each using every core.
+
+  - *batch*: `boolean()`.
+
+    Queue the query on the index batcher instead of the pool, see
+    `set_query_batching/2`.
+
+    Defaults to `false`.
+  """
+  @spec knn_query_async(%T{}, Nx.Tensor.t() | binary() | [binary()], [
+          {:k, pos_integer()},
+          {:num_threads, integer()},
+          {:batch, boolean()}
+        ]) :: {:ok, reference()} | {:error, String.t()}
+  def knn_query_async(self = %T{}, query, opts \\ []) do
+    k = Helper.get_keyword!(opts, :k, :pos_integer, 1)
+    num_threads = Helper.get_keyword!(opts, :num_threads, :integer, 1)
+    batch = Helper.get_keyword!(opts, :batch, :boolean, false)
+    {data, rows, features} = _query_data!(self, query)
+
+    if batch do
+      HNSWLib.Nif.index_knn_query_batched(self.reference, data, k, rows, features)
+    else
+      HNSWLib.Nif.index_knn_query_async(self.reference, data, k, num_threads, rows, features)
+    end
+  end
+
+  @doc """
+  Wait for the result of a query started with `knn_query_async/3`.
+
+  If no result arrives within *timeout* milliseconds, the query is
+  cancelled and `{:error, :timeout}` is returned.
+  """
+  @spec await_knn_query(reference(), timeout()) ::
+          {:ok, Nx.Tensor.t(), Nx.Tensor.t()} | {:error, String.t() | :timeout}
+  def await_knn_query(ref, timeout \\ :infinity) when is_reference(ref) do
+    receive do
+      {:hnswlib_knn_query, ^ref, reply} -> knn_query_reply(reply)
+    after
+      timeout ->
+        case cancel_knn_query(ref) do
+          :ok ->
+            {:error, :timeout}
+
+          {:error, _} ->
+            # the reply was sent before the query could be cancelled
+            receive do
+              {:hnswlib_knn_query, ^ref, reply} -> knn_query_reply(reply)
+            end
+        end
+    end
+  end
+
+  @doc """
+  Cancel a query started with `knn_query_async/3`.
+
+  Returns `:ok` if the query was cancelled, in which case no message will be
+  sent for it. Returns `{:error, reason}` if the result was already sent.
+  """
+  @spec cancel_knn_query(reference()) :: :ok | {:error, String.t()}
+  def cancel_knn_query(ref) when is_reference(ref) do
+    HNSWLib.Nif.index_knn_query_cancel(ref)
+  end
+
+  @doc """
+  Convert the `reply` of a `{:hnswlib_knn_query, ref, reply}` message into
+  the result format of `knn_query/3`.
+  """
+  @spec knn_query_reply(term()) :: {:ok, Nx.Tensor.t(), Nx.Tensor.t()} | {:error, String.t()}
+  def knn_query_reply({:ok, labels, dists, rows, k, label_bits, dist_bits}) do
+    labels = Nx.reshape(Nx.from_binary(labels, :"u#{label_bits}"), {rows, k})
+    dists = Nx.reshape(Nx.from_binary(dists, :"f#{dist_bits}"), {rows, k})
+    {:ok, labels, dists}
+  end
+
+  def knn_query_reply({:error, reason}), do: {:error, reason}
+
+  defp _query_data!(self = %T{}, query) when is_binary(query) do
     Helper.might_be_float_data!(query)
     features = trunc(byte_size(query) / Helper.float_size())
     Helper.ensure_vector_dimension!(self, features, true)
-
-    _do_knn_query(self, query, k, num_threads, nil, 1, features)
+    {query, 1, features}
   end
 
-  def knn_query(self = %T{}, query, opts) when is_list(query) do
-    k = Helper.get_keyword!(opts, :k, :pos_integer, 1)
-    num_threads = Helper.get_keyword!(opts, :num_threads, :integer, -1)
+  defp _query_data!(self = %T{}, query) when is_list(query) do
     {rows, features} = Helper.list_of_binary(query)
     Helper.ensure_vector_dimension!(self, features, true)
-
-    _do_knn_query(self, IO.iodata_to_binary(query), k, num_threads, nil, rows, features)
+    {IO.iodata_to_binary(query), rows, features}
   end
 
-  def knn_query(self = %T{}, query = %Nx.Tensor{}, opts) do
-    k = Helper.get_keyword!(opts, :k, :pos_integer, 1)
-    num_threads = Helper.get_keyword!(opts, :num_threads, :integer, -1)
-    {f32_data, rows, features} = Helper.verify_data_tensor!(self, query)
-
-    _do_knn_query(self, f32_data, k, num_threads, nil, rows, features)
+  defp _query_data!(self = %T{}, query = %Nx.Tensor{}) do
+    Helper.verify_data_tensor!(self, query)
   end
 
   defp _do_knn_query(self = %T{}, query, k, num_threads, filter, rows, features) do
-    case HNSWLib.Nif.index_knn_query(
-           self.reference,
-           query,
-           k,
-           num_threads,
-           filter,
-           rows,
-           features
-         ) do
-      {:ok, labels, dists, rows, k, label_bits, dist_bits} ->
-        labels = Nx.reshape(Nx.from_binary(labels, :"u#{label_bits}"), {rows, k})
-        dists = Nx.reshape(Nx.from_binary(dists, :"f#{dist_bits}"), {rows, k})
-        {:ok, labels, dists}
+    HNSWLib.Nif.index_knn_query(
+      self.reference,
+      query,
+      k,
+      num_threads,
+      filter,
+      rows,
+      features
+    )
+    |> knn_query_reply()
+  end
+
+  @doc """
+  Get a list of existing IDs in the index.
+
+  ##### Keyword Parameters
+
+  Accepts the same keyword parameters as `get_ids/2`.
+  """
+  @spec get_ids_list(%T{}, [
+          {:offset, non_neg_integer()},
+          {:limit, non_neg_integer() | nil},
+          {:sort, boolean()}
+        ]) :: {:ok, [integer()]} | {:error, String.t()}
+  def get_ids_list(self = %T{}, opts \\ []) do
+    case _do_get_ids(self, opts) do
+      {:ok, ids} ->
+        {:ok, for(<<id::unsigned-integer-native-64 <- ids>>, do: id)}
 
       {:error, reason} ->
         {:error, reason}
@@ -178,11 +450,54 @@ defmodule HNSWLib.Index do
   end
 
   @doc """
-  Get a list of existing IDs in the index.
+  Get existing IDs in the index as a `u64` tensor.
+
+  This is the preferred way to list the IDs of large indexes: the IDs are
+  returned as one packed binary and the work runs on a dirty scheduler.
+
+  ##### Keyword Parameters
+
+  - *offset*: `non_neg_integer()`.
+
+    Number of IDs to skip.
+
+    Defaults to `0`.
+
+  - *limit*: `non_neg_integer() | nil`.
+
+    Maximum number of IDs to return, `nil` returns all remaining IDs.
+
+    Defaults to `nil`.
+
+  - *sort*: `boolean()`.
+
+    Whether to return the IDs in ascending order. When `false`, IDs come in
+    insertion order, which is cheaper and stable across pages as long as no
+    deleted items are replaced.
+
+    Defaults to `true`.
   """
-  @spec get_ids_list(%T{}) :: {:ok, [integer()]} | {:error, String.t()}
-  def get_ids_list(self = %T{}) do
-    HNSWLib.Nif.index_get_ids_list(self.reference)
+  @spec get_ids(%T{}, [
+          {:offset, non_neg_integer()},
+          {:limit, non_neg_integer() | nil},
+          {:sort, boolean()}
+        ]) :: {:ok, Nx.Tensor.t()} | {:error, String.t()}
+  def get_ids(self = %T{}, opts \\ []) do
+    case _do_get_ids(self, opts) do
+      {:ok, ids} ->
+        {:ok, Nx.from_binary(ids, :u64)}
+
+      {:error, reason} ->
+        {:error, reason}
+    end
+  end
+
+  defp _do_get_ids(self = %T{}, opts) when is_list(opts) do
+    offset = Helper.get_keyword!(opts, :offset, :non_neg_integer, 0)
+    limit = Helper.get_keyword!(opts, :limit, :non_neg_integer, nil, true)
+    sort = Helper.get_keyword!(opts, :sort, :boolean, true)
+
+    HNSWLib.Nif.index_get_ids_list(self.reference, offset, limit, sort)
   end
 
   @doc """
@@ -233,10 +548,81 @@ defmodule HNSWLib.Index do
   - *path*: `Path.t()`.
 
     Path to save the index to.
+
+  ##### Keyword Parameters
+
+  - *format*: `:default` | `:mappable` | `:compact`.
+
+    File layout to write. `:mappable` files can be loaded with `mmap: true`, see
+    `load_index/4`, and are read by a regular `load_index/4` as well. They are
+    written to `path <> ".tmp"` and renamed into place, so processes that have
+    the previous file mapped keep serving it. `:compact` files only store the
+    links in use, sorted and delta encoded, with the vectors in a section of
+    their own, which makes them much smaller. They also record the space and
+    dimension of the index, so they can be loaded with `load_index/2`, and carry
+    a checksum of every section, which is verified on load.
+    Defaults to `:default`.
   """
-  @spec save_index(%T{}, Path.t()) :: :ok | {:error, String.t()}
-  def save_index(self = %T{}, path) when is_binary(path) do
-    HNSWLib.Nif.index_save_index(self.reference, path)
+  @spec save_index(%T{}, Path.t(), [{:format, :default | :mappable | :compact}]) ::
+          :ok | {:error, String.t()}
+  def save_index(self = %T{}, path, opts \\ []) when is_binary(path) and is_list(opts) do
+    format =
+      Helper.get_keyword!(opts, :format, {:atom, [:default, :mappable, :compact]}, :default)
+    HNSWLib.Nif.index_save_index(self.reference, path, format)
+  end
+
+  @doc """
+  Save a snapshot of the index to disk without blocking writes.
+
+  The snapshot holds the index as it is when the call returns. It is written
+  in the background by a native thread while `add_items/3` and the other writes
+  keep going; an element changed meanwhile is copied aside first, so the file
+  never sees the change. The call returns a reference right away and the result
+  is sent to the calling process as a `{:hnswlib_snapshot, ref, reply}` message,
+  where `reply` is `:ok` or `{:error, reason}`. Use `await_snapshot/2` to wait
+  for it.
+
+  The file is written in the `:default` format of `save_index/3` next to *path*
+  and then takes its place. Only one snapshot of an index can be saved at a time.
+  With the default storage, growing the index waits until the snapshot is written.
+
+  ##### Positional Parameters
+
+  - *path*: `Path.t()`.
+
+    Path to save the index to.
+  """
+  @spec save_snapshot(%T{}, Path.t()) :: {:ok, reference()} | {:error, String.t()}
+  def save_snapshot(self = %T{}, path) when is_binary(path) do
+    HNSWLib.Nif.index_save_snapshot(self.reference, path)
+  end
+
+  @doc """
+  Wait for a snapshot started with `save_snapshot/2` to be written.
+
+  Returns `{:error, :timeout}` if it is not written within *timeout* milliseconds.
+  The snapshot is still written in that case.
+  """
+  @spec await_snapshot(reference(), timeout()) :: :ok | {:error, String.t() | :timeout}
+  def await_snapshot(ref, timeout \\ :infinity) when is_reference(ref) do
+    receive do
+      {:hnswlib_snapshot, ^ref, reply} -> reply
+    after
+      timeout -> {:error, :timeout}
+    end
+  end
+
+  @doc """
+  Load an index saved with `format: :compact` from disk.
+
+  The space and dimension are read from the file, see `save_index/3`. Takes the
+  same options as `load_index/4`.
+  """
+  @spec load_index(Path.t(), Keyword.t()) :: {:ok, %T{}} | {:error, String.t()}
+  def load_index(path, opts \\ []) when is_binary(path) and is_list(opts) do
+    with {:ok, space, dim} <- HNSWLib.Nif.index_read_header(path) do
+      load_index(space, dim, path, opts)
+    end
   end
 
   @doc """
@@ -258,7 +644,10 @@ defmodule HNSWLib.Index do
 
   - *path*: `Path.t()`.
 
-    Path to load the index from.
+    Path to load the index from. The file is read and the label lookup is
+    rebuilt using all available cores, see `get_load_stats/1` for the load
+    throughput. A log written by `open_log/3` is loaded by replaying its writes
+    on top of its snapshot.
 
   ##### Keyword Parameters
 
@@ -269,19 +658,214 @@ defmodule HNSWLib.Index do
     Default: 0.
 
   - *allow_replace_deleted*: `boolean()`.
+  - *concurrent_writes*: `boolean()`.
+
+    See `set_concurrent_writes/2`. Defaults to `false`.
+
+  - *segment_size*: `non_neg_integer()`.
+
+    See `new/4`. Defaults to `0`.
+
+  - *auto_grow*: `boolean()`.
+
+    See `new/4`. Defaults to `true`.
+
+  - *mmap*: `boolean()`.
+
+    Serve the index straight from the memory-mapped file instead of reading it
+    into memory. Loading only reads the header and checks the upper link lists,
+    and the pages are shared with every other process that maps the same file.
+    The file must have been saved with `format: :mappable` and the index is
+    read-only: adding, deleting or resizing returns an error. `:max_elements`
+    and `:segment_size` are ignored. Defaults to `false`.
+
+  - *log*: `boolean()`.
+
+    Keep appending the writes to the log at `path` after replaying it, as if
+    `open_log/3` had been called, without writing a new snapshot first. `path`
+    must be a log. Defaults to `false`.
+
+  - *sync_log*: `boolean()`.
+
+    See the `:sync` option of `open_log/3`. Defaults to `true`.
+
+  - *huge_pages*: `boolean()`.
+
+    See `new/4`. Ignored with `mmap: true`. Defaults to `false`.
+
+  - *numa_interleave*: `boolean()`.
+
+    See `new/4`. Ignored with `mmap: true`. Defaults to `false`.
+
+  - *split_elements*: `boolean()`.
+
+    See `new/4`. Ignored with `mmap: true`. Defaults to `false`.
+
+  - *tiered*: `boolean()`.
+
+    Keep only the graph, the labels and a one-byte-per-dimension code of each
+    vector in memory, and read the full vectors from the file when they are
+    needed. Searches walk the graph on the codes and re-rank the best
+    `max(ef, k)` candidates on their full vectors, so an index much larger than
+    memory can be served at close to the same recall. The file must have been
+    saved with `format: :compact` and the index is read-only. The file must not
+    be changed or overwritten, e.g. by `save_index/3` to the same path, while
+    the index is open, as searches keep reading from it. Searches run on a
+    dirty IO scheduler. Ignored with `mmap: true`. Defaults to `false`.
+
+  - *vector_cache_size*: `non_neg_integer()`.
+
+    Number of full vectors read from the file that are kept in memory with
+    `tiered: true`. Defaults to `4096`.
   """
   @spec load_index(:cosine | :ip | :l2, non_neg_integer(), Path.t(), [
           {:max_elements, non_neg_integer()},
-          {:allow_replace_deleted, boolean()}
+          {:allow_replace_deleted, boolean()},
+          {:concurrent_writes, boolean()},
+          {:segment_size, non_neg_integer()},
+          {:auto_grow, boolean()},
+          {:mmap, boolean()},
+          {:log, boolean()},
+          {:sync_log, boolean()},
+          {:huge_pages, boolean()},
+          {:numa_interleave, boolean()},
+          {:split_elements, boolean()},
+          {:tiered, boolean()},
+          {:vector_cache_size, non_neg_integer()}
         ]) :: {:ok, %T{}} | {:error, String.t()}
   def load_index(space, dim, path, opts \\ [])
       when (space == :l2 or space == :ip or space == :cosine) and is_integer(dim) and dim >= 0 and
              is_binary(path) and is_list(opts) do
     max_elements = Helper.get_keyword!(opts, :max_elements, :non_neg_integer, 0)
     allow_replace_deleted = Helper.get_keyword!(opts, :allow_replace_deleted, :boolean, false)
+    concurrent_writes = Helper.get_keyword!(opts, :concurrent_writes, :boolean, false)
+    segment_size = Helper.get_keyword!(opts, :segment_size, :non_neg_integer, 0)
+    auto_grow = Helper.get_keyword!(opts, :auto_grow, :boolean, true)
+    mmap = Helper.get_keyword!(opts, :mmap, :boolean, false)
+    log = Helper.get_keyword!(opts, :log, :boolean, false)
+    sync_log = Helper.get_keyword!(opts, :sync_log, :boolean, true)
+    huge_pages = Helper.get_keyword!(opts, :huge_pages, :boolean, false)
+    numa_interleave = Helper.get_keyword!(opts, :numa_interleave, :boolean, false)
+    split_elements = Helper.get_keyword!(opts, :split_elements, :boolean, false)
+    tiered = Helper.get_keyword!(opts, :tiered, :boolean, false)
+    vector_cache_size = Helper.get_keyword!(opts, :vector_cache_size, :non_neg_integer, 4096)
+
+    with {:ok, ref} <-
+           HNSWLib.Nif.index_load_index(
+             space,
+             dim,
+             path,
+             max_elements,
+             allow_replace_deleted,
+             segment_size,
+             mmap,
+             log,
+             sync_log,
+             huge_pages,
+             numa_interleave,
+             split_elements,
+             tiered,
+             vector_cache_size
+           ),
+         :ok <- HNSWLib.Nif.index_set_concurrent_writes(ref, concurrent_writes),
+         :ok <- HNSWLib.Nif.index_set_auto_grow(ref, auto_grow) do
+      {:ok,
+       %T{
+         space: space,
+         dim: dim,
+         reference: ref
+       }}
+    else
+      {:error, reason} ->
+        {:error, reason}
+    end
+  end
+
+  @doc """
+  Serialize the index to a binary.
+
+  The binary has the same contents as the file written by `save_index/3` with
+  the same options, so it can be stored or sent to another node and turned back
+  into an index with `from_binary/4`. It is written in place without going
+  through a file.
+
+  ##### Keyword Parameters
+
+  - *format*: `:default` | `:mappable` | `:compact`.
+
+    See `save_index/3`. Defaults to `:default`.
+  """
+  @spec dump(%T{}, [{:format, :default | :mappable | :compact}]) ::
+          {:ok, binary()} | {:error, String.t()}
+  def dump(self = %T{}, opts \\ []) when is_list(opts) do
+    format =
+      Helper.get_keyword!(opts, :format, {:atom, [:default, :mappable, :compact]}, :default)
+    HNSWLib.Nif.index_dump(self.reference, format)
+  end
+
+  @doc """
+  Load an index from a binary returned by `dump/2`.
+
+  The contents of a file written by `save_index/3` can be loaded as well.
+
+  ##### Positional Parameters
+
+  - *space*: `:cosine` | `:ip` | `:l2`.
+
+    An atom that indicates the vector space. Valid values are
+
+      - `:cosine`, cosine space
+      - `:ip`, inner product space
+      - `:l2`, L2 space
+
+  - *dim*: `non_neg_integer()`.
+
+    Number of dimensions for each vector.
+
+  - *binary*: `binary()`.
+
+    The serialized index.
+
+  ##### Keyword Parameters
+
+  Same as `load_index/4`, except for `:mmap`, `:log` and `:sync_log`.
+  """
+  @spec from_binary(:cosine | :ip | :l2, non_neg_integer(), binary(), [
+          {:max_elements, non_neg_integer()},
+          {:allow_replace_deleted, boolean()},
+          {:concurrent_writes, boolean()},
+          {:segment_size, non_neg_integer()},
+          {:auto_grow, boolean()},
+          {:huge_pages, boolean()},
+          {:numa_interleave, boolean()},
+          {:split_elements, boolean()}
+        ]) :: {:ok, %T{}} | {:error, String.t()}
+  def from_binary(space, dim, binary, opts \\ [])
+      when (space == :l2 or space == :ip or space == :cosine) and is_integer(dim) and dim >= 0 and
+             is_binary(binary) and is_list(opts) do
+    max_elements = Helper.get_keyword!(opts, :max_elements, :non_neg_integer, 0)
+    allow_replace_deleted = Helper.get_keyword!(opts, :allow_replace_deleted, :boolean, false)
+    concurrent_writes = Helper.get_keyword!(opts, :concurrent_writes, :boolean, false)
+    segment_size = Helper.get_keyword!(opts, :segment_size, :non_neg_integer, 0)
+    auto_grow = Helper.get_keyword!(opts, :auto_grow, :boolean, true)
+    huge_pages = Helper.get_keyword!(opts, :huge_pages, :boolean, false)
+    numa_interleave = Helper.get_keyword!(opts, :numa_interleave, :boolean, false)
+    split_elements = Helper.get_keyword!(opts, :split_elements, :boolean, false)
 
     with {:ok, ref} <-
-           HNSWLib.Nif.index_load_index(space, dim, path, max_elements, allow_replace_deleted) do
+           HNSWLib.Nif.index_from_binary(
+             space,
+             dim,
+             binary,
+             max_elements,
+             allow_replace_deleted,
+             segment_size,
+             huge_pages,
+             numa_interleave,
+             split_elements
+           ),
+         :ok <- HNSWLib.Nif.index_set_concurrent_writes(ref, concurrent_writes),
+         :ok <- HNSWLib.Nif.index_set_auto_grow(ref, auto_grow) do
       {:ok,
        %T{
          space: space,
@@ -294,6 +878,105 @@ defmodule HNSWLib.Index do
     end
   end
 
+  @doc """
+  Start logging the writes to the index.
+
+  `path` is replaced by a log that starts with a snapshot of the index. From then on
+  `add_items/3`, `mark_deleted/2` and `unmark_deleted/2` append a record of each
+  successful write to it, so that `load_index/4` can restore every write that returned
+  `:ok`, even after a crash. Writes that fail are not logged.
+
+  A record is appended once its write has been applied. If it cannot be written or
+  flushed, or an `add_items/3` fails after it may have added some of its rows, the
+  write stays applied but returns an error, and every later write returns an error
+  until `compact_log/1` writes the index into a new log or `close_log/1` stops
+  logging.
+
+  While a log is open, writes are applied and appended one at a time, even with
+  `set_concurrent_writes/2`, so that the log holds them in the order they were
+  applied. Searches still run alongside them, and waiting for a flush is shared.
+
+  Use `compact_log/1` every now and then to fold the records into a new snapshot, which
+  keeps the log small and loading fast.
+
+  ##### Positional Parameters
+
+  - *path*: `Path.t()`.
+
+    Path to the log.
+
+  ##### Keyword Parameters
+
+  - *sync*: `boolean()`.
+
+    Only return from a write once its record is on disk. Writes that wait at the
+    same time share a single flush, so concurrent writers (see
+    `set_concurrent_writes/2`) pay for it only once. When `false`, records are
+    handed to the operating system right away, which survives a crash of the VM
+    but not of the machine. Defaults to `true`.
+  """
+  @spec open_log(%T{}, Path.t(), [{:sync, boolean()}]) :: :ok | {:error, String.t()}
+  def open_log(self = %T{}, path, opts \\ []) when is_binary(path) and is_list(opts) do
+    sync = Helper.get_keyword!(opts, :sync, :boolean, true)
+    HNSWLib.Nif.index_open_log(self.reference, path, sync)
+  end
+
+  @doc """
+  Replace the log with a new snapshot of the index.
+
+  The new log is written next to the old one and then takes its place, so a crash
+  at any point leaves a complete log behind. Writes and searches wait until the
+  snapshot is written.
+  """
+  @spec compact_log(%T{}) :: :ok | {:error, String.t()}
+  def compact_log(self = %T{}) do
+    HNSWLib.Nif.index_compact_log(self.reference)
+  end
+
+  @doc """
+  Stop logging the writes to the index.
+
+  Every record is flushed to disk before the log is closed.
+  """
+  @spec close_log(%T{}) :: :ok | {:error, String.t()}
+  def close_log(self = %T{}) do
+    HNSWLib.Nif.index_close_log(self.reference)
+  end
+
+  @doc """
+  Get the size of the file read by `load_index/4` or of the binary read by
+  `from_binary/4`, and how long loading it took.
+
+  Returns a map with `:bytes`, `:seconds` and `:bytes_per_second`. All values are
+  zero for an index that was created with `new/4`.
+  """
+  @spec get_load_stats(%T{}) ::
+          {:ok,
+           %{bytes: non_neg_integer(), seconds: float(), bytes_per_second: float()}}
+          | {:error, String.t()}
+  def get_load_stats(self = %T{}) do
+    HNSWLib.Nif.index_get_load_stats(self.reference)
+  end
+
+  @doc """
+  Let writes run alongside searches.
+
+  By default `add_items/3`, `mark_deleted/2` and `unmark_deleted/2` lock the
+  whole index, so every write blocks all searches until it is done. With
+  concurrent writes enabled they only share the lock with searches and rely
+  on the per-element locks of the index, so a large insert no longer stalls
+  queries. Loading, `save_index/3`, `dump/2`, and `resize_index/2` unless the
+  index is segmented (see `new/4`), still lock the whole index, so a save waits
+  for running writes and holds off searches.
+
+  While an insert is running, `get_items/2` and `get_ids_list/2` may see
+  elements whose insertion has not finished yet.
+  """
+  @spec set_concurrent_writes(%T{}, boolean()) :: :ok | {:error, String.t()}
+  def set_concurrent_writes(self = %T{}, concurrent_writes) when is_boolean(concurrent_writes) do
+    HNSWLib.Nif.index_set_concurrent_writes(self.reference, concurrent_writes)
+  end
+
   @doc """
   Mark a label as deleted.
 
@@ -337,7 +1020,9 @@ defmodule HNSWLib.Index do
 
     IDs to assign to the data.
 
-    If `nil`, IDs will be assigned sequentially starting from 0.
+    If `nil`, IDs will be assigned sequentially starting from 0. When such an
+    add fails, its IDs stay taken, as some of its items may already be in the
+    index, and later adds continue after them.
 
     Defaults to `nil`.
 
@@ -354,6 +1039,9 @@ defmodule HNSWLib.Index do
     Whether to replace deleted items.
 
     Defaults to `false`.
+
+  The index grows to fit the new items unless it was created with
+  `auto_grow: false`, see `new/4`.
   """
   @spec add_items(%T{}, Nx.Tensor.t(), [
           {:ids, Nx.Tensor.t() | [non_neg_integer()] | nil},
@@ -382,17 +1070,28 @@ defmodule HNSWLib.Index do
   @doc """
   Retrieve items from the index using IDs.
 
+  Returns an `f32` tensor of shape `{length(ids), dim}` whose rows are the
+  stored vectors, in the same order as *ids*.
+
   ##### Positional Parameters
 
   - *ids*: `Nx.Tensor.t() | [non_neg_integer()]`.
 
     IDs to retrieve.
   """
-  @spec get_items(%T{}, Nx.Tensor.t() | [integer()]) :: {:ok, [binary()]} | {:error, String.t()}
+  @spec get_items(%T{}, Nx.Tensor.t() | [integer()]) ::
+          {:ok, Nx.Tensor.t()} | {:error, String.t()}
   def get_items(self = %T{}, ids) do
     ids = Helper.normalize_ids!(ids)
+    rows = div(byte_size(ids), 8)
+
+    case HNSWLib.Nif.index_get_items(self.reference, ids) do
+      {:ok, data} ->
+        {:ok, Nx.reshape(Nx.from_binary(data, :f32), {rows, self.dim})}
 
-    HNSWLib.Nif.index_get_items(self.reference, ids)
+      {:error, reason} ->
+        {:error, reason}
+    end
   end
 
   @doc """
@@ -403,12 +1102,48 @@ defmodule HNSWLib.Index do
   - *new_size*: `non_neg_integer()`.
 
     New size of the index.
+
+  A segmented index (see `new/4`) is resized in place and keeps serving
+  searches and writes meanwhile, other indexes are locked and copied.
   """
   @spec resize_index(%T{}, non_neg_integer()) :: :ok | {:error, String.t()}
   def resize_index(self = %T{}, new_size) when is_integer(new_size) and new_size >= 0 do
     HNSWLib.Nif.index_resize_index(self.reference, new_size)
   end
 
+  @doc """
+  Reorder the items of the index in memory for faster queries.
+
+  Items are laid out in breadth-first order of the search graph, so the items a
+  query visits one after another mostly sit next to each other in memory. This
+  speeds up queries on indexes that do not fit in the CPU caches. The results
+  of queries do not change.
+
+  Reordering takes the index lock exclusively and is best done once the index
+  is built, e.g. before `freeze/1` or `save_index/3`. IDs returned by
+  `get_ids/2` with `sort: false` come in the new order afterwards.
+  """
+  @spec reorder(%T{}) :: :ok | {:error, String.t()}
+  def reorder(self = %T{}) do
+    HNSWLib.Nif.index_reorder(self.reference)
+  end
+
+  @doc """
+  Freeze the index, making it read-only.
+
+  The capacity of the index shrinks to its current number of elements and the
+  locks that guard writes are freed. Queries and `get_items/2` on a frozen index
+  no longer take any lock, so they scale with the number of concurrent callers.
+
+  Adding items, marking or unmarking deletions, resizing and opening a log
+  return an error afterwards. The index can still be saved, an index loaded
+  from the saved file is not frozen.
+  """
+  @spec freeze(%T{}) :: :ok | {:error, String.t()}
+  def freeze(self = %T{}) do
+    HNSWLib.Nif.index_freeze(self.reference)
+  end
+
   @doc """
   Get the maximum number of elements the index can hold.
   """
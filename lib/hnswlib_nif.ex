@@ -19,19 +19,38 @@ defmodule HNSWLib.Nif do
         _m,
         _ef_construction,
         _random_seed,
-        _allow_replace_deleted
+        _allow_replace_deleted,
+        _segment_size,
+        _huge_pages,
+        _numa_interleave,
+        _align_elements,
+        _split_elements
       ),
       do: :erlang.nif_error(:not_loaded)
 
   def index_knn_query(_self, _data, _k, _num_threads, _filter, _rows, _features),
     do: :erlang.nif_error(:not_loaded)
 
+  def index_knn_query_yielding(_self, _data, _k, _num_threads, _filter, _rows, _features),
+    do: :erlang.nif_error(:not_loaded)
+
+  def index_knn_query_async(_self, _data, _k, _num_threads, _rows, _features),
+    do: :erlang.nif_error(:not_loaded)
+
+  def index_knn_query_cancel(_query), do: :erlang.nif_error(:not_loaded)
+
+  def index_knn_query_batched(_self, _data, _k, _rows, _features),
+    do: :erlang.nif_error(:not_loaded)
+
+  def index_set_query_batching(_self, _max_rows, _max_delay_us),
+    do: :erlang.nif_error(:not_loaded)
+
   def index_add_items(_self, _f32_data, _ids, _num_threads, _replace_deleted, _rows, _features),
     do: :erlang.nif_error(:not_loaded)
 
   def index_get_items(_self, _ids), do: :erlang.nif_error(:not_loaded)
 
-  def index_get_ids_list(_self), do: :erlang.nif_error(:not_loaded)
+  def index_get_ids_list(_self, _offset, _limit, _sort), do: :erlang.nif_error(:not_loaded)
 
   def index_get_ef(_self), do: :erlang.nif_error(:not_loaded)
 
@@ -43,10 +62,50 @@ defmodule HNSWLib.Nif do
 
   def index_index_file_size(_self), do: :erlang.nif_error(:not_loaded)
 
-  def index_save_index(_self, _path), do: :erlang.nif_error(:not_loaded)
+  def index_save_index(_self, _path, _format), do: :erlang.nif_error(:not_loaded)
 
-  def index_load_index(_space, _dim, _path, _max_elements, _allow_replace_deleted),
-    do: :erlang.nif_error(:not_loaded)
+  def index_save_snapshot(_self, _path), do: :erlang.nif_error(:not_loaded)
+
+  def index_read_header(_path), do: :erlang.nif_error(:not_loaded)
+
+  def index_load_index(
+        _space,
+        _dim,
+        _path,
+        _max_elements,
+        _allow_replace_deleted,
+        _segment_size,
+        _mmap,
+        _log,
+        _sync_log,
+        _huge_pages,
+        _numa_interleave,
+        _split_elements,
+        _tiered,
+        _vector_cache_size
+      ),
+      do: :erlang.nif_error(:not_loaded)
+
+  def index_dump(_self, _format), do: :erlang.nif_error(:not_loaded)
+
+  def index_from_binary(
+        _space,
+        _dim,
+        _binary,
+        _max_elements,
+        _allow_replace_deleted,
+        _segment_size,
+        _huge_pages,
+        _numa_interleave,
+        _split_elements
+      ),
+      do: :erlang.nif_error(:not_loaded)
+
+  def index_open_log(_self, _path, _sync), do: :erlang.nif_error(:not_loaded)
+
+  def index_compact_log(_self), do: :erlang.nif_error(:not_loaded)
+
+  def index_close_log(_self), do: :erlang.nif_error(:not_loaded)
 
   def index_mark_deleted(_self, _label), do: :erlang.nif_error(:not_loaded)
 
@@ -54,6 +113,16 @@ defmodule HNSWLib.Nif do
 
   def index_resize_index(_self, _new_size), do: :erlang.nif_error(:not_loaded)
 
+  def index_freeze(_self), do: :erlang.nif_error(:not_loaded)
+
+  def index_reorder(_self), do: :erlang.nif_error(:not_loaded)
+
+  def index_set_concurrent_writes(_self, _concurrent_writes), do: :erlang.nif_error(:not_loaded)
+
+  def index_set_auto_grow(_self, _auto_grow), do: :erlang.nif_error(:not_loaded)
+
+  def index_get_load_stats(_self), do: :erlang.nif_error(:not_loaded)
+
   def index_get_max_elements(_self), do: :erlang.nif_error(:not_loaded)
 
   def index_get_current_count(_self), do: :erlang.nif_error(:not_loaded)
@@ -78,6 +147,11 @@ defmodule HNSWLib.Nif do
 
   def bfindex_load_index(_space, _dim, _path, _max_elements), do: :erlang.nif_error(:not_loaded)
 
+  def bfindex_dump(_self), do: :erlang.nif_error(:not_loaded)
+
+  def bfindex_from_binary(_space, _dim, _binary, _max_elements),
+    do: :erlang.nif_error(:not_loaded)
+
   def bfindex_get_max_elements(_self), do: :erlang.nif_error(:not_loaded)
 
   def bfindex_get_current_count(_self), do: :erlang.nif_error(:not_loaded)
@@ -347,6 +347,28 @@ defmodule HNSWLib.BFIndex.Test do
     File.rm(save_to)
   end
 
+  test "HNSWLib.BFIndex.save_index/2 only writes live elements" do
+    space = :l2
+    dim = 2
+    max_elements = 100_000
+    items = Nx.tensor([[10, 20], [30, 40]], type: :f32)
+    save_to = Path.join([__DIR__, "saved_bfindex.bin"])
+    {:ok, index} = HNSWLib.BFIndex.new(space, dim, max_elements)
+    :ok = HNSWLib.BFIndex.add_items(index, items)
+
+    File.rm(save_to)
+    assert :ok == HNSWLib.BFIndex.save_index(index, save_to)
+    %File.Stat{size: size} = File.stat!(save_to)
+    assert size < 1024
+
+    {:ok, index_from_save} = HNSWLib.BFIndex.load_index(space, dim, save_to)
+    assert {:ok, 100_000} == HNSWLib.BFIndex.get_max_elements(index_from_save)
+    assert {:ok, 2} == HNSWLib.BFIndex.get_current_count(index_from_save)
+
+    # cleanup
+    File.rm(save_to)
+  end
+
   test "HNSWLib.BFIndex.load_index/3" do
     space = :l2
     dim = 2
@@ -371,6 +393,63 @@ defmodule HNSWLib.BFIndex.Test do
     File.rm(save_to)
   end
 
+  test "HNSWLib.BFIndex.dump/1 and from_binary/4" do
+    space = :l2
+    dim = 2
+    max_elements = 200
+    items = Nx.tensor([[10, 20], [30, 40]], type: :f32)
+    ids = Nx.tensor([100, 200])
+    {:ok, index} = HNSWLib.BFIndex.new(space, dim, max_elements)
+    :ok = HNSWLib.BFIndex.add_items(index, items, ids: ids)
+
+    {:ok, binary} = HNSWLib.BFIndex.dump(index)
+
+    save_to = Path.join([__DIR__, "saved_bfindex.bin"])
+    File.rm(save_to)
+    assert :ok == HNSWLib.BFIndex.save_index(index, save_to)
+    assert File.read!(save_to) == binary
+
+    {:ok, loaded} = HNSWLib.BFIndex.from_binary(space, dim, binary)
+    assert HNSWLib.BFIndex.get_max_elements(index) == HNSWLib.BFIndex.get_max_elements(loaded)
+    assert {:ok, 2} == HNSWLib.BFIndex.get_current_count(loaded)
+
+    {:ok, labels, dists} = HNSWLib.BFIndex.knn_query(loaded, Nx.tensor([1, 2], type: :f32))
+    assert 1 == Nx.to_number(Nx.all_close(labels, Nx.tensor([100])))
+    assert 1 == Nx.to_number(Nx.all_close(dists, Nx.tensor([405.0])))
+
+    assert {:error, "Index seems to be corrupted or unsupported"} ==
+             HNSWLib.BFIndex.from_binary(space, dim, "not an index")
+
+    # cleanup
+    File.rm(save_to)
+  end
+
+  test "HNSWLib.BFIndex.load_index/3 keeps vectors and labels in sync after delete_vector/2" do
+    space = :l2
+    dim = 2
+    max_elements = 200
+    items = Nx.tensor([[10, 20], [30, 40], [50, 60]], type: :f32)
+    ids = Nx.tensor([100, 200, 300])
+    query = Nx.tensor([29, 39], type: :f32)
+    save_to = Path.join([__DIR__, "saved_bfindex.bin"])
+    {:ok, index} = HNSWLib.BFIndex.new(space, dim, max_elements)
+    :ok = HNSWLib.BFIndex.add_items(index, items, ids: ids)
+    :ok = HNSWLib.BFIndex.delete_vector(index, 100)
+
+    File.rm(save_to)
+    assert :ok == HNSWLib.BFIndex.save_index(index, save_to)
+
+    {:ok, index_from_save} = HNSWLib.BFIndex.load_index(space, dim, save_to)
+    assert {:ok, 2} == HNSWLib.BFIndex.get_current_count(index_from_save)
+
+    {:ok, labels, dists} = HNSWLib.BFIndex.knn_query(index_from_save, query, k: 2)
+    assert 1 == Nx.to_number(Nx.all_close(labels, Nx.tensor([[200, 300]])))
+    assert 1 == Nx.to_number(Nx.all_close(dists, Nx.tensor([[2, 882]])))
+
+    # cleanup
+    File.rm(save_to)
+  end
+
   test "HNSWLib.BFIndex.load_index/3 with new max_elements" do
     space = :l2
     dim = 2
@@ -388,12 +467,12 @@ defmodule HNSWLib.BFIndex.Test do
 
     new_max_elements = 100
 
-    {:ok, _index_from_save} =
+    {:ok, index_from_save} =
       HNSWLib.BFIndex.load_index(space, dim, save_to, max_elements: new_max_elements)
 
     assert {:ok, 200} == HNSWLib.BFIndex.get_max_elements(index)
-    # fix: upstream bug?
-    # assert {:ok, 100} == HNSWLib.BFIndex.get_max_elements(index_from_save)
+    assert {:ok, 100} == HNSWLib.BFIndex.get_max_elements(index_from_save)
+    assert {:ok, 2} == HNSWLib.BFIndex.get_current_count(index_from_save)
 
     # cleanup
     File.rm(save_to)
@@ -388,6 +388,312 @@ defmodule HNSWLib.Index.Test do
   #            HNSWLib.Index.knn_query(index, data, filter: filter)
   # end
 
+  test "HNSWLib.Index.knn_query_async/3 replies with a message" do
+    space = :l2
+    dim = 2
+    max_elements = 200
+
+    data =
+      Nx.tensor(
+        [
+          [42, 42],
+          [43, 43],
+          [0, 0],
+          [200, 200],
+          [200, 220]
+        ],
+        type: :f32
+      )
+
+    query = Nx.tensor([[1, 2], [201, 219]], type: :f32)
+    {:ok, index} = HNSWLib.Index.new(space, dim, max_elements)
+    assert :ok == HNSWLib.Index.add_items(index, data)
+
+    {:ok, ref} = HNSWLib.Index.knn_query_async(index, query, k: 2)
+    assert is_reference(ref)
+    assert_receive {:hnswlib_knn_query, ^ref, reply}, 5_000
+
+    {:ok, labels, dists} = HNSWLib.Index.knn_query_reply(reply)
+    assert {:ok, labels, dists} == HNSWLib.Index.knn_query(index, query, k: 2)
+    assert [[2, 0], [4, 3]] == Nx.to_list(labels)
+
+    {:ok, ref} = HNSWLib.Index.knn_query_async(index, query, k: 2)
+    assert {:ok, labels, dists} == HNSWLib.Index.await_knn_query(ref)
+    refute_received {:hnswlib_knn_query, ^ref, _}
+
+    {:ok, ref} = HNSWLib.Index.knn_query_async(index, query, k: 100)
+    assert {:error, _} = HNSWLib.Index.await_knn_query(ref)
+  end
+
+  test "HNSWLib.Index.cancel_knn_query/1" do
+    space = :l2
+    dim = 2
+    max_elements = 200
+    data = Nx.iota({100, 2}, type: :f32)
+    {:ok, index} = HNSWLib.Index.new(space, dim, max_elements)
+    assert :ok == HNSWLib.Index.add_items(index, data)
+
+    {:ok, ref} = HNSWLib.Index.knn_query_async(index, Nx.iota({100, 2}, type: :f32))
+
+    case HNSWLib.Index.cancel_knn_query(ref) do
+      :ok ->
+        refute_receive {:hnswlib_knn_query, ^ref, _}, 100
+
+      {:error, "The query has already completed"} ->
+        assert_receive {:hnswlib_knn_query, ^ref, {:ok, _, _, 100, 1, _, _}}, 5_000
+    end
+
+    {:ok, ref} = HNSWLib.Index.knn_query_async(index, Nx.tensor([1, 2], type: :f32))
+    assert {:ok, _, _} = HNSWLib.Index.await_knn_query(ref)
+    assert {:error, "The query has already completed"} == HNSWLib.Index.cancel_knn_query(ref)
+  end
+
+  test "HNSWLib.Index.knn_query/3 with batch: true" do
+    space = :cosine
+    dim = 4
+    max_elements = 1000
+    data = Nx.iota({500, 4}, type: :f32) |> Nx.sin()
+    {:ok, index} = HNSWLib.Index.new(space, dim, max_elements)
+    assert :ok == HNSWLib.Index.add_items(index, data)
+
+    assert {:error, "Query batching is not enabled for this index"} ==
+             HNSWLib.Index.knn_query(index, data[0], batch: true)
+
+    assert :ok == HNSWLib.Index.set_query_batching(index, max_rows: 16, max_delay_us: 500)
+
+    results =
+      0..99
+      |> Task.async_stream(fn i ->
+        query = data[i]
+
+        {HNSWLib.Index.knn_query(index, query, k: 3, batch: true),
+         HNSWLib.Index.knn_query(index, query, k: 3)}
+      end)
+      |> Enum.map(fn {:ok, result} -> result end)
+
+    for {batched, unbatched} <- results do
+      assert batched == unbatched
+    end
+
+    assert :ok == HNSWLib.Index.set_query_batching(index, max_rows: 1)
+    {:ok, ref} = HNSWLib.Index.knn_query_async(index, data[0..1], k: 2, batch: true)
+    {:ok, labels, _dists} = HNSWLib.Index.await_knn_query(ref)
+    assert {2, 2} == Nx.shape(labels)
+
+    assert {:error, _} = HNSWLib.Index.knn_query(index, data[0], k: 2000, batch: true)
+  end
+
+  test "HNSWLib.Index.knn_query_async/3 with batch gets a reply when the index goes away" do
+    query =
+      Task.async(fn ->
+        {:ok, ref} =
+          (fn ->
+             {:ok, index} = HNSWLib.Index.new(:l2, 2, 10)
+             :ok = HNSWLib.Index.add_items(index, Nx.tensor([[1, 2]], type: :f32))
+
+             :ok =
+               HNSWLib.Index.set_query_batching(index, max_rows: 1000, max_delay_us: 60_000_000)
+
+             HNSWLib.Index.knn_query_async(index, Nx.tensor([1, 2], type: :f32), batch: true)
+           end).()
+
+        # drops the last reference to the index, which stops its batcher
+        :erlang.garbage_collect()
+        HNSWLib.Index.await_knn_query(ref, 10_000)
+      end)
+
+    assert {:error, "query batching stopped"} == Task.await(query, 15_000)
+  end
+
+  test "HNSWLib.Index.knn_query/3 with scheduler: :auto" do
+    space = :l2
+    dim = 8
+    max_elements = 5000
+    data = Nx.iota({5000, 8}, type: :f32) |> Nx.cos()
+    {:ok, index} = HNSWLib.Index.new(space, dim, max_elements)
+    assert :ok == HNSWLib.Index.add_items(index, data)
+
+    # small enough to run on the calling scheduler
+    query = data[0..9]
+
+    assert HNSWLib.Index.knn_query(index, query, k: 5) ==
+             HNSWLib.Index.knn_query(index, query, k: 5, scheduler: :auto)
+
+    # large enough to be sent to a dirty scheduler
+    assert HNSWLib.Index.knn_query(index, data, k: 5) ==
+             HNSWLib.Index.knn_query(index, data, k: 5, scheduler: :auto)
+
+    assert {:error, _} = HNSWLib.Index.knn_query(index, query, k: 6000, scheduler: :auto)
+
+    assert_raise ArgumentError, fn ->
+      HNSWLib.Index.knn_query(index, query, scheduler: :normal)
+    end
+  end
+
+  test "HNSWLib.Index.set_concurrent_writes/2 with a mixed workload" do
+    space = :l2
+    dim = 8
+    max_elements = 20_000
+    batch_size = 250
+    {:ok, index} = HNSWLib.Index.new(space, dim, max_elements, concurrent_writes: true)
+
+    vectors = fn first -> Nx.iota({batch_size, dim}, type: :f32) |> Nx.add(first) |> Nx.sin() end
+    ids = fn first -> Nx.iota({batch_size}, type: :u64) |> Nx.add(first) end
+    assert :ok == HNSWLib.Index.add_items(index, vectors.(0), ids: ids.(0))
+
+    writers =
+      for w <- 1..4 do
+        Task.async(fn ->
+          for b <- 0..9 do
+            first = (w * 10 + b) * batch_size
+            :ok = HNSWLib.Index.add_items(index, vectors.(first), ids: ids.(first))
+          end
+        end)
+      end
+
+    deleter =
+      Task.async(fn ->
+        for label <- 0..(batch_size - 1) do
+          :ok = HNSWLib.Index.mark_deleted(index, label)
+          :ok = HNSWLib.Index.unmark_deleted(index, label)
+        end
+      end)
+
+    searchers =
+      for _ <- 1..4 do
+        Task.async(fn ->
+          for i <- 0..199 do
+            {:ok, labels, _dists} = HNSWLib.Index.knn_query(index, vectors.(i)[0], k: 1)
+            assert {1, 1} == Nx.shape(labels)
+          end
+        end)
+      end
+
+    Task.await_many(writers ++ [deleter] ++ searchers, 60_000)
+
+    expected =
+      Enum.to_list(0..(batch_size - 1)) ++ Enum.to_list((10 * batch_size)..(50 * batch_size - 1))
+
+    assert {:ok, expected} == HNSWLib.Index.get_ids_list(index)
+    assert {:ok, 10_250} == HNSWLib.Index.get_current_count(index)
+
+    # the graph built by concurrent inserts still finds the inserted vectors
+    :ok = HNSWLib.Index.set_ef(index, 100)
+    {:ok, labels, _dists} = HNSWLib.Index.knn_query(index, vectors.(12_000), k: 1)
+
+    found =
+      Nx.to_flat_list(labels)
+      |> Enum.zip(12_000..12_249)
+      |> Enum.count(fn {label, id} -> label == id end)
+
+    assert found >= 0.95 * batch_size
+
+    assert :ok == HNSWLib.Index.set_concurrent_writes(index, false)
+    assert :ok == HNSWLib.Index.add_items(index, vectors.(50_000), ids: ids.(50_000))
+    assert {:ok, 10_500} == HNSWLib.Index.get_current_count(index)
+  end
+
+  test "HNSWLib.Index.add_items/3 from concurrent writers into one neighborhood" do
+    space = :l2
+    dim = 4
+    max_elements = 100
+    batch_size = 100
+
+    # every vector sits next to the others, so writers and searchers keep
+    # waiting on the locks of the same few elements
+    vectors = fn first ->
+      Nx.iota({batch_size, dim}, type: :f32) |> Nx.add(first * dim) |> Nx.multiply(1.0e-4)
+    end
+
+    ids = fn first -> Nx.iota({batch_size}, type: :u64) |> Nx.add(first) end
+
+    {:ok, index} = HNSWLib.Index.new(space, dim, max_elements)
+    # grows the flat storage before the concurrent writes
+    assert :ok == HNSWLib.Index.add_items(index, vectors.(0), ids: ids.(0))
+    assert :ok == HNSWLib.Index.add_items(index, vectors.(100), ids: ids.(100))
+    assert :ok == HNSWLib.Index.resize_index(index, 5000)
+    assert :ok == HNSWLib.Index.set_concurrent_writes(index, true)
+
+    writers =
+      for w <- 1..8 do
+        Task.async(fn ->
+          for b <- 0..4 do
+            first = (w * 5 + b) * batch_size
+            :ok = HNSWLib.Index.add_items(index, vectors.(first), ids: ids.(first))
+          end
+        end)
+      end
+
+    searchers =
+      for _ <- 1..4 do
+        Task.async(fn ->
+          for _ <- 0..199 do
+            {:ok, labels, _dists} = HNSWLib.Index.knn_query(index, vectors.(0), k: 3)
+            assert {batch_size, 3} == Nx.shape(labels)
+          end
+        end)
+      end
+
+    Task.await_many(writers ++ searchers, 60_000)
+
+    assert {:ok, 4200} == HNSWLib.Index.get_current_count(index)
+
+    expected = Enum.to_list(0..199) ++ Enum.to_list(500..4499)
+    assert {:ok, expected} == HNSWLib.Index.get_ids_list(index)
+
+    {:ok, labels, _dists} = HNSWLib.Index.knn_query(index, vectors.(2000), k: 1)
+    assert Enum.all?(Nx.to_flat_list(labels), &(&1 in expected))
+  end
+
+  test "HNSWLib.Index.save_index/3 while concurrent writes run" do
+    space = :l2
+    dim = 8
+    batch_size = 100
+    {:ok, index} = HNSWLib.Index.new(space, dim, 5000, concurrent_writes: true)
+
+    vectors = fn first -> Nx.iota({batch_size, dim}, type: :f32) |> Nx.add(first) |> Nx.sin() end
+    ids = fn first -> Nx.iota({batch_size}, type: :u64) |> Nx.add(first) end
+    assert :ok == HNSWLib.Index.add_items(index, vectors.(0), ids: ids.(0))
+
+    writers =
+      for w <- 1..4 do
+        Task.async(fn ->
+          for b <- 0..9 do
+            first = (w * 10 + b) * batch_size
+            :ok = HNSWLib.Index.add_items(index, vectors.(first), ids: ids.(first))
+          end
+        end)
+      end
+
+    save_to = Path.join([__DIR__, "saved_concurrent_index.bin"])
+
+    for _ <- 1..5 do
+      File.rm(save_to)
+      assert :ok == HNSWLib.Index.save_index(index, save_to)
+
+      # every element in the file is whole, whatever was added since
+      {:ok, saved} = HNSWLib.Index.load_index(space, dim, save_to)
+      {:ok, count} = HNSWLib.Index.get_current_count(saved)
+      {:ok, saved_ids} = HNSWLib.Index.get_ids_list(saved)
+      assert count == length(saved_ids)
+
+      {:ok, labels, _dists} = HNSWLib.Index.knn_query(saved, vectors.(0)[0], k: 1)
+      assert [0] == Nx.to_flat_list(labels)
+
+      {:ok, binary} = HNSWLib.Index.dump(index)
+      assert {:ok, _} = HNSWLib.Index.from_binary(space, dim, binary)
+    end
+
+    Task.await_many(writers, 60_000)
+
+    assert :ok == HNSWLib.Index.save_index(index, save_to)
+    {:ok, saved} = HNSWLib.Index.load_index(space, dim, save_to)
+    assert {:ok, 4100} == HNSWLib.Index.get_current_count(saved)
+
+    # cleanup
+    File.rm(save_to)
+  end
+
   test "HNSWLib.Index.add_items/3 without specifying ids" do
     space = :l2
     dim = 2
@@ -458,6 +764,187 @@ defmodule HNSWLib.Index.Test do
     end
   end
 
+  test "HNSWLib.Index.add_items/3 grows a full index" do
+    space = :l2
+    dim = 2
+    max_elements = 2
+    {:ok, index} = HNSWLib.Index.new(space, dim, max_elements)
+
+    assert :ok == HNSWLib.Index.add_items(index, Nx.iota({5, dim}, type: :f32))
+    assert {:ok, 5} == HNSWLib.Index.get_max_elements(index)
+    assert :ok == HNSWLib.Index.add_items(index, Nx.iota({1, dim}, type: :f32) |> Nx.add(10))
+    assert {:ok, 10} == HNSWLib.Index.get_max_elements(index)
+    assert {:ok, 6} == HNSWLib.Index.get_current_count(index)
+
+    {:ok, index} = HNSWLib.Index.new(space, dim, max_elements, auto_grow: false)
+
+    assert {:error, "The number of elements exceeds the specified limit"} ==
+             HNSWLib.Index.add_items(index, Nx.iota({5, dim}, type: :f32))
+  end
+
+  test "HNSWLib.Index.add_items/3 gives back default ids after a failed add with ids" do
+    space = :l2
+    dim = 2
+    max_elements = 10
+    {:ok, index} = HNSWLib.Index.new(space, dim, max_elements)
+
+    assert {:error, "Replacement of deleted elements is disabled in constructor"} ==
+             HNSWLib.Index.add_items(index, Nx.iota({2, dim}, type: :f32),
+               ids: [5, 6],
+               replace_deleted: true
+             )
+
+    assert :ok == HNSWLib.Index.add_items(index, Nx.iota({1, dim}, type: :f32))
+    assert {:ok, [0]} == HNSWLib.Index.get_ids_list(index)
+  end
+
+  test "HNSWLib.Index.new/4 with segment_size grows while searching" do
+    space = :l2
+    dim = 8
+    max_elements = 10
+    batch_size = 100
+
+    {:ok, index} =
+      HNSWLib.Index.new(space, dim, max_elements, segment_size: 1000, concurrent_writes: true)
+
+    assert {:ok, 10} == HNSWLib.Index.get_max_elements(index)
+
+    vectors = fn first -> Nx.iota({batch_size, dim}, type: :f32) |> Nx.add(first) |> Nx.sin() end
+    ids = fn first -> Nx.iota({batch_size}, type: :u64) |> Nx.add(first) end
+    assert :ok == HNSWLib.Index.add_items(index, vectors.(0), ids: ids.(0))
+
+    writers =
+      for w <- 1..4 do
+        Task.async(fn ->
+          for b <- 0..9 do
+            first = (w * 10 + b) * batch_size
+            :ok = HNSWLib.Index.add_items(index, vectors.(first), ids: ids.(first))
+          end
+        end)
+      end
+
+    searchers =
+      for _ <- 1..4 do
+        Task.async(fn ->
+          for i <- 0..199 do
+            {:ok, labels, _dists} = HNSWLib.Index.knn_query(index, vectors.(i)[0], k: 1)
+            assert {1, 1} == Nx.shape(labels)
+          end
+        end)
+      end
+
+    Task.await_many(writers ++ searchers, 60_000)
+
+    # segments are 1024 elements, the index grows by whole segments
+    assert {:ok, 4100} == HNSWLib.Index.get_current_count(index)
+    assert {:ok, 5120} == HNSWLib.Index.get_max_elements(index)
+
+    :ok = HNSWLib.Index.set_ef(index, 100)
+    {:ok, labels, _dists} = HNSWLib.Index.knn_query(index, vectors.(3000), k: 1)
+
+    found =
+      Nx.to_flat_list(labels)
+      |> Enum.zip(3000..3099)
+      |> Enum.count(fn {label, id} -> label == id end)
+
+    assert found >= 0.95 * batch_size
+
+    assert :ok == HNSWLib.Index.resize_index(index, 4100)
+    assert {:ok, 4100} == HNSWLib.Index.get_max_elements(index)
+
+    assert {:error, "Cannot resize, max element is less than the current number of elements"} ==
+             HNSWLib.Index.resize_index(index, 4000)
+
+    save_to = Path.join([__DIR__, "saved_segmented_index.bin"])
+    File.rm(save_to)
+    assert :ok == HNSWLib.Index.save_index(index, save_to)
+
+    {:ok, loaded} = HNSWLib.Index.load_index(space, dim, save_to, segment_size: 512)
+    assert {:ok, 4100} == HNSWLib.Index.get_current_count(loaded)
+    :ok = HNSWLib.Index.set_ef(loaded, 100)
+    {:ok, loaded_labels, _dists} = HNSWLib.Index.knn_query(loaded, vectors.(3000), k: 1)
+    assert Nx.to_flat_list(loaded_labels) == Nx.to_flat_list(labels)
+
+    # cleanup
+    File.rm(save_to)
+  end
+
+  test "HNSWLib.Index.new/4 with huge_pages and numa_interleave" do
+    space = :l2
+    dim = 128
+    # large enough for the stored vectors to be placed
+    max_elements = 4000
+    opts = [huge_pages: true, numa_interleave: true]
+    items = Nx.iota({1000, dim}, type: :f32) |> Nx.sin()
+    {:ok, index} = HNSWLib.Index.new(space, dim, max_elements, opts)
+    assert :ok == HNSWLib.Index.add_items(index, items)
+
+    {:ok, labels, _dists} = HNSWLib.Index.knn_query(index, items[10], k: 1)
+    assert 1 == Nx.to_number(Nx.all_close(labels, Nx.tensor([10])))
+
+    assert :ok == HNSWLib.Index.resize_index(index, 8000)
+    {:ok, data} = HNSWLib.Index.get_items(index, [999])
+    assert Nx.to_binary(data) == Nx.to_binary(items[999])
+
+    {:ok, binary} = HNSWLib.Index.dump(index)
+    {:ok, loaded} = HNSWLib.Index.from_binary(space, dim, binary, opts)
+    {:ok, labels, _dists} = HNSWLib.Index.knn_query(loaded, items[10], k: 1)
+    assert 1 == Nx.to_number(Nx.all_close(labels, Nx.tensor([10])))
+  end
+
+  test "HNSWLib.Index.new/4 with align_elements" do
+    space = :l2
+    dim = 20
+    items = Nx.iota({300, dim}, type: :f32) |> Nx.sin()
+    {:ok, index} = HNSWLib.Index.new(space, dim, 400, align_elements: true)
+    assert :ok == HNSWLib.Index.add_items(index, items)
+
+    {:ok, labels, _dists} = HNSWLib.Index.knn_query(index, items[10], k: 1)
+    assert 1 == Nx.to_number(Nx.all_close(labels, Nx.tensor([10])))
+    {:ok, data} = HNSWLib.Index.get_items(index, [299])
+    assert Nx.to_binary(data) == Nx.to_binary(items[299])
+
+    {:ok, expected, _dists} = HNSWLib.Index.knn_query(index, items[0..49], k: 5)
+    save_to = Path.join([__DIR__, "saved_index.bin"])
+
+    for format <- [:default, :compact] do
+      File.rm(save_to)
+      assert :ok == HNSWLib.Index.save_index(index, save_to, format: format)
+      {:ok, loaded} = HNSWLib.Index.load_index(space, dim, save_to)
+      {:ok, labels, _dists} = HNSWLib.Index.knn_query(loaded, items[0..49], k: 5)
+      assert Nx.to_binary(labels) == Nx.to_binary(expected)
+    end
+
+    File.rm(save_to)
+  end
+
+  test "HNSWLib.Index.new/4 with split_elements" do
+    space = :l2
+    dim = 8
+    items = Nx.iota({300, dim}, type: :f32) |> Nx.sin()
+    {:ok, index} = HNSWLib.Index.new(space, dim, 200, split_elements: true)
+    assert :ok == HNSWLib.Index.add_items(index, items)
+    assert {:ok, 300} == HNSWLib.Index.get_current_count(index)
+
+    {:ok, labels, _dists} = HNSWLib.Index.knn_query(index, items[10], k: 1)
+    assert 1 == Nx.to_number(Nx.all_close(labels, Nx.tensor([10])))
+    {:ok, data} = HNSWLib.Index.get_items(index, [299])
+    assert Nx.to_binary(data) == Nx.to_binary(items[299])
+
+    {:ok, expected, _dists} = HNSWLib.Index.knn_query(index, items[0..49], k: 5)
+    {:ok, binary} = HNSWLib.Index.dump(index)
+
+    # the layout only exists in memory, files load either way
+    for split_elements <- [true, false] do
+      {:ok, loaded} =
+        HNSWLib.Index.from_binary(space, dim, binary, split_elements: split_elements)
+
+      {:ok, labels, _dists} = HNSWLib.Index.knn_query(loaded, items[0..49], k: 5)
+      assert Nx.to_binary(labels) == Nx.to_binary(expected)
+      assert HNSWLib.Index.get_ids_list(index) == HNSWLib.Index.get_ids_list(loaded)
+    end
+  end
+
   test "HNSWLib.Index.get_items/2" do
     space = :l2
     dim = 2
@@ -470,17 +957,21 @@ defmodule HNSWLib.Index.Test do
     assert :ok == HNSWLib.Index.add_items(index, items)
     assert {:ok, [0, 1]} == HNSWLib.Index.get_ids_list(index)
 
-    {:ok, [f32_binary_0, f32_binary_1]} = HNSWLib.Index.get_items(index, [0, 1])
-    assert f32_binary_0 == Nx.to_binary(items[0])
-    assert f32_binary_1 == Nx.to_binary(items[1])
+    {:ok, data} = HNSWLib.Index.get_items(index, [0, 1])
+    assert {2, 2} == Nx.shape(data)
+    assert {:f, 32} == Nx.type(data)
+    assert Nx.to_binary(data) == Nx.to_binary(items)
 
-    {:ok, [f32_binary_1]} = HNSWLib.Index.get_items(index, [1])
-    assert f32_binary_1 == Nx.to_binary(items[1])
+    {:ok, data} = HNSWLib.Index.get_items(index, [1, 0])
+    assert Nx.to_binary(data) == Nx.to_binary(Nx.stack([items[1], items[0]]))
 
-    {:ok, [f32_binary_0]} = HNSWLib.Index.get_items(index, [0])
-    assert f32_binary_0 == Nx.to_binary(items[0])
+    {:ok, data} = HNSWLib.Index.get_items(index, Nx.tensor([1]))
+    assert {1, 2} == Nx.shape(data)
+    assert Nx.to_binary(data) == Nx.to_binary(items[1])
 
     assert {:error, "Label not found"} == HNSWLib.Index.get_items(index, [2])
+    assert :ok == HNSWLib.Index.mark_deleted(index, 0)
+    assert {:error, "Label not found"} == HNSWLib.Index.get_items(index, [1, 0])
   end
 
   test "HNSWLib.Index.get_ids_list/1 when empty" do
@@ -492,6 +983,39 @@ defmodule HNSWLib.Index.Test do
     assert {:ok, []} == HNSWLib.Index.get_ids_list(index)
   end
 
+  test "HNSWLib.Index.get_ids_list/2 with offset, limit and sort" do
+    space = :l2
+    dim = 2
+    max_elements = 200
+    items = Nx.tensor([[10, 20], [30, 40], [50, 60], [70, 80]], type: :f32)
+    ids = [400, 100, 300, 200]
+    {:ok, index} = HNSWLib.Index.new(space, dim, max_elements)
+    :ok = HNSWLib.Index.add_items(index, items, ids: ids)
+
+    assert {:ok, [100, 200, 300, 400]} == HNSWLib.Index.get_ids_list(index)
+    assert {:ok, [200, 300]} == HNSWLib.Index.get_ids_list(index, offset: 1, limit: 2)
+    assert {:ok, [400]} == HNSWLib.Index.get_ids_list(index, offset: 3)
+    assert {:ok, []} == HNSWLib.Index.get_ids_list(index, offset: 10)
+    assert {:ok, [400, 100, 300, 200]} == HNSWLib.Index.get_ids_list(index, sort: false)
+    assert {:ok, [300]} == HNSWLib.Index.get_ids_list(index, sort: false, offset: 2, limit: 1)
+  end
+
+  test "HNSWLib.Index.get_ids/2" do
+    space = :l2
+    dim = 2
+    max_elements = 200
+    items = Nx.tensor([[10, 20], [30, 40], [50, 60]], type: :f32)
+    {:ok, index} = HNSWLib.Index.new(space, dim, max_elements)
+    :ok = HNSWLib.Index.add_items(index, items, ids: [30, 10, 20])
+
+    {:ok, ids} = HNSWLib.Index.get_ids(index)
+    assert {:u, 64} == Nx.type(ids)
+    assert [10, 20, 30] == Nx.to_flat_list(ids)
+
+    {:ok, ids} = HNSWLib.Index.get_ids(index, limit: 2, sort: false)
+    assert [30, 10] == Nx.to_flat_list(ids)
+  end
+
   test "HNSWLib.Index.get_ef/1 with default init config" do
     space = :ip
     dim = 2
@@ -581,6 +1105,35 @@ defmodule HNSWLib.Index.Test do
     File.rm(save_to)
   end
 
+  test "HNSWLib.Index.save_snapshot/2 and await_snapshot/2" do
+    space = :l2
+    dim = 4
+    items = Nx.iota({300, dim}, type: :f32) |> Nx.sin()
+    save_to = Path.join([__DIR__, "snapshot_index.bin"])
+    File.rm(save_to)
+
+    {:ok, index} = HNSWLib.Index.new(space, dim, 300)
+    :ok = HNSWLib.Index.add_items(index, items[0..199])
+    {:ok, ref} = HNSWLib.Index.save_snapshot(index, save_to)
+
+    # writes made after the call are not part of the snapshot
+    :ok = HNSWLib.Index.add_items(index, items[200..299])
+    :ok = HNSWLib.Index.mark_deleted(index, 5)
+    assert :ok == HNSWLib.Index.await_snapshot(ref)
+    assert {:ok, 300} == HNSWLib.Index.get_current_count(index)
+
+    {:ok, restored} = HNSWLib.Index.load_index(space, dim, save_to)
+    assert {:ok, 200} == HNSWLib.Index.get_current_count(restored)
+    {:ok, data} = HNSWLib.Index.get_items(restored, [5, 199])
+    assert Nx.to_binary(data) == Nx.to_binary(Nx.stack([items[5], items[199]]))
+
+    {:ok, ref} = HNSWLib.Index.save_snapshot(index, Path.join([save_to, "index.bin"]))
+    assert {:error, "Cannot open file"} == HNSWLib.Index.await_snapshot(ref)
+
+    # cleanup
+    File.rm(save_to)
+  end
+
   test "HNSWLib.Index.load_index/3" do
     space = :l2
     dim = 2
@@ -654,12 +1207,376 @@ defmodule HNSWLib.Index.Test do
     File.rm(save_to)
   end
 
+  test "HNSWLib.Index.get_load_stats/1" do
+    space = :l2
+    dim = 2
+    max_elements = 200
+    items = Nx.tensor([[10, 20], [30, 40]], type: :f32)
+    save_to = Path.join([__DIR__, "saved_index.bin"])
+    {:ok, index} = HNSWLib.Index.new(space, dim, max_elements)
+    :ok = HNSWLib.Index.add_items(index, items)
+
+    assert {:ok, %{bytes: 0, seconds: +0.0, bytes_per_second: +0.0}} ==
+             HNSWLib.Index.get_load_stats(index)
+
+    File.rm(save_to)
+    assert :ok == HNSWLib.Index.save_index(index, save_to)
+    {:ok, index_from_save} = HNSWLib.Index.load_index(space, dim, save_to)
+
+    {:ok, stats} = HNSWLib.Index.get_load_stats(index_from_save)
+    assert {:ok, stats.bytes} == HNSWLib.Index.index_file_size(index)
+    assert stats.seconds >= 0
+    assert stats.bytes_per_second >= 0
+
+    # cleanup
+    File.rm(save_to)
+  end
+
   test "HNSWLib.Index.load_index/3 with missing file" do
     bad_filepath = "this/file/doesnt/exist"
     refute File.exists?(bad_filepath)
     assert {:error, "Cannot open file"} = HNSWLib.Index.load_index(:l2, 2, bad_filepath)
   end
 
+  test "HNSWLib.Index.load_index/2" do
+    dim = 4
+    items = Nx.iota({200, dim}, type: :f32) |> Nx.sin()
+    {:ok, index} = HNSWLib.Index.new(:ip, dim, 300)
+    :ok = HNSWLib.Index.add_items(index, items)
+    :ok = HNSWLib.Index.mark_deleted(index, 3)
+
+    save_to = Path.join([__DIR__, "saved_index.bin"])
+    File.rm(save_to)
+    assert :ok == HNSWLib.Index.save_index(index, save_to, format: :compact)
+
+    {:ok, loaded} = HNSWLib.Index.load_index(save_to)
+    assert :ip == loaded.space
+    assert dim == loaded.dim
+    assert {:ok, 200} == HNSWLib.Index.get_current_count(loaded)
+    assert HNSWLib.Index.get_ids_list(index) == HNSWLib.Index.get_ids_list(loaded)
+
+    assert {:error, "The index file was saved for another space"} ==
+             HNSWLib.Index.load_index(:l2, dim, save_to)
+
+    assert {:error, "The index file was saved for an index of another dimension"} ==
+             HNSWLib.Index.load_index(:ip, dim + 1, save_to)
+
+    binary = File.read!(save_to)
+    size = byte_size(binary) - 1
+    <<head::binary-size(size), last>> = binary
+    File.write!(save_to, <<head::binary, Bitwise.bxor(last, 1)>>)
+
+    assert {:error, "The index file is corrupted, a checksum does not match"} ==
+             HNSWLib.Index.load_index(save_to)
+
+    assert :ok == HNSWLib.Index.save_index(index, save_to)
+
+    assert {:error, "The index file does not record its space and dimension"} ==
+             HNSWLib.Index.load_index(save_to)
+
+    # cleanup
+    File.rm(save_to)
+  end
+
+  test "HNSWLib.Index.load_index/3 with mmap" do
+    space = :l2
+    dim = 4
+    max_elements = 500
+    items = Nx.iota({300, dim}, type: :f32) |> Nx.sin()
+    {:ok, index} = HNSWLib.Index.new(space, dim, max_elements)
+    :ok = HNSWLib.Index.add_items(index, items)
+    :ok = HNSWLib.Index.mark_deleted(index, 7)
+
+    save_to = Path.join([__DIR__, "saved_mappable_index.bin"])
+    File.rm(save_to)
+    assert :ok == HNSWLib.Index.save_index(index, save_to, format: :mappable)
+
+    {:ok, mapped} = HNSWLib.Index.load_index(space, dim, save_to, mmap: true)
+    assert {:ok, 300} == HNSWLib.Index.get_current_count(mapped)
+    assert HNSWLib.Index.get_ids_list(index) == HNSWLib.Index.get_ids_list(mapped)
+
+    {:ok, labels, dists} = HNSWLib.Index.knn_query(index, items, k: 5)
+    {:ok, mapped_labels, mapped_dists} = HNSWLib.Index.knn_query(mapped, items, k: 5)
+    assert Nx.to_binary(labels) == Nx.to_binary(mapped_labels)
+    assert Nx.to_binary(dists) == Nx.to_binary(mapped_dists)
+
+    {:ok, data} = HNSWLib.Index.get_items(mapped, [0, 299])
+    assert Nx.to_binary(data) == Nx.to_binary(Nx.stack([items[0], items[299]]))
+    assert {:error, "Label not found"} == HNSWLib.Index.get_items(mapped, [7])
+    assert {:error, "Label not found"} == HNSWLib.Index.get_items(mapped, [300])
+
+    assert {:error, "The index is memory-mapped and read-only"} ==
+             HNSWLib.Index.add_items(mapped, items[0..0])
+
+    assert {:error, "The index is memory-mapped and read-only"} ==
+             HNSWLib.Index.mark_deleted(mapped, 1)
+
+    # a regular load copies the mappable file into a writable index
+    {:ok, copied} = HNSWLib.Index.load_index(space, dim, save_to)
+    assert {:ok, 500} == HNSWLib.Index.get_max_elements(copied)
+    assert :ok == HNSWLib.Index.unmark_deleted(copied, 7)
+    assert :ok == HNSWLib.Index.add_items(copied, items[0..0], ids: [300])
+    assert {:ok, 301} == HNSWLib.Index.get_current_count(copied)
+
+    # saving over a mapped file replaces it instead of truncating it under the mapping
+    assert :ok == HNSWLib.Index.save_index(copied, save_to, format: :mappable)
+    refute File.exists?(save_to <> ".tmp")
+    {:ok, mapped_labels, _dists} = HNSWLib.Index.knn_query(mapped, items, k: 5)
+    assert Nx.to_binary(labels) == Nx.to_binary(mapped_labels)
+
+    assert :ok == HNSWLib.Index.save_index(index, save_to)
+
+    assert {:error, "The index file was not saved in the mappable format"} ==
+             HNSWLib.Index.load_index(space, dim, save_to, mmap: true)
+
+    # cleanup
+    File.rm(save_to)
+  end
+
+  test "HNSWLib.Index.load_index/3 with tiered" do
+    space = :l2
+    dim = 8
+    items = Nx.iota({300, dim}, type: :f32) |> Nx.sin()
+    {:ok, index} = HNSWLib.Index.new(space, dim, 300)
+    :ok = HNSWLib.Index.add_items(index, items)
+    :ok = HNSWLib.Index.mark_deleted(index, 7)
+
+    save_to = Path.join([__DIR__, "saved_tiered_index.bin"])
+    File.rm(save_to)
+    assert :ok == HNSWLib.Index.save_index(index, save_to, format: :compact)
+
+    {:ok, tiered} =
+      HNSWLib.Index.load_index(space, dim, save_to, tiered: true, vector_cache_size: 16)
+    assert {:ok, 300} == HNSWLib.Index.get_current_count(tiered)
+    assert HNSWLib.Index.get_ids_list(index) == HNSWLib.Index.get_ids_list(tiered)
+
+    # candidates are re-ranked on the full vectors read from the file
+    {:ok, labels, dists} = HNSWLib.Index.knn_query(tiered, items[10], k: 1)
+    assert 1 == Nx.to_number(Nx.all_close(labels, Nx.tensor([10])))
+    assert 1 == Nx.to_number(Nx.all_close(dists, Nx.tensor([0.0])))
+
+    # always leaves the calling scheduler, as re-ranking reads the file
+    assert {:ok, labels, dists} ==
+             HNSWLib.Index.knn_query(tiered, items[10], k: 1, scheduler: :auto)
+
+    {:ok, data} = HNSWLib.Index.get_items(tiered, [0, 299])
+    assert Nx.to_binary(data) == Nx.to_binary(Nx.stack([items[0], items[299]]))
+    assert {:error, "Label not found"} == HNSWLib.Index.get_items(tiered, [7])
+
+    assert {:error, "The index keeps its vectors on disk and is read-only"} ==
+             HNSWLib.Index.add_items(tiered, items[0..0])
+
+    # the file of an open tiered index must stay as it is
+    default_save_to = Path.join([__DIR__, "saved_tiered_default_index.bin"])
+    assert :ok == HNSWLib.Index.save_index(index, default_save_to)
+
+    assert {:error, "The index file was not saved in the compact format"} ==
+             HNSWLib.Index.load_index(space, dim, default_save_to, tiered: true)
+
+    # cleanup
+    File.rm(save_to)
+    File.rm(default_save_to)
+  end
+
+  test "HNSWLib.Index.dump/2 and from_binary/4" do
+    space = :l2
+    dim = 4
+    max_elements = 500
+    items = Nx.iota({300, dim}, type: :f32) |> Nx.sin()
+    {:ok, index} = HNSWLib.Index.new(space, dim, max_elements)
+    :ok = HNSWLib.Index.add_items(index, items)
+    :ok = HNSWLib.Index.mark_deleted(index, 7)
+    {:ok, labels, dists} = HNSWLib.Index.knn_query(index, items, k: 5)
+
+    {:ok, binary} = HNSWLib.Index.dump(index)
+    assert {:ok, byte_size(binary)} == HNSWLib.Index.index_file_size(index)
+
+    save_to = Path.join([__DIR__, "saved_index.bin"])
+    File.rm(save_to)
+    assert :ok == HNSWLib.Index.save_index(index, save_to)
+    assert File.read!(save_to) == binary
+
+    {:ok, compact} = HNSWLib.Index.dump(index, format: :compact)
+    assert byte_size(compact) < byte_size(binary)
+
+    for format <- [:default, :mappable, :compact] do
+      {:ok, binary} = HNSWLib.Index.dump(index, format: format)
+      {:ok, loaded} = HNSWLib.Index.from_binary(space, dim, binary)
+      assert {:ok, 300} == HNSWLib.Index.get_current_count(loaded)
+      assert HNSWLib.Index.get_ids_list(index) == HNSWLib.Index.get_ids_list(loaded)
+
+      {:ok, loaded_labels, loaded_dists} = HNSWLib.Index.knn_query(loaded, items, k: 5)
+      assert Nx.to_binary(labels) == Nx.to_binary(loaded_labels)
+      assert Nx.to_binary(dists) == Nx.to_binary(loaded_dists)
+      assert :ok == HNSWLib.Index.add_items(loaded, items[0..0], ids: [300])
+    end
+
+    {:ok, loaded} = HNSWLib.Index.from_binary(space, dim, File.read!(save_to), max_elements: 1000)
+    assert {:ok, 1000} == HNSWLib.Index.get_max_elements(loaded)
+
+    assert {:error, "Index seems to be corrupted or unsupported"} ==
+             HNSWLib.Index.from_binary(space, dim, "not an index")
+
+    # cleanup
+    File.rm(save_to)
+  end
+
+  test "HNSWLib.Index.open_log/3, compact_log/1 and close_log/1" do
+    space = :l2
+    dim = 4
+    items = Nx.iota({300, dim}, type: :f32) |> Nx.sin()
+    log_path = Path.join([__DIR__, "index.log"])
+    File.rm(log_path)
+
+    {:ok, index} = HNSWLib.Index.new(space, dim, 100)
+    :ok = HNSWLib.Index.add_items(index, items[0..99])
+    assert :ok == HNSWLib.Index.open_log(index, log_path)
+
+    :ok = HNSWLib.Index.add_items(index, items[100..199])
+    :ok = HNSWLib.Index.add_items(index, items[200..299], ids: Nx.iota({100}) |> Nx.add(1000))
+    :ok = HNSWLib.Index.mark_deleted(index, 7)
+    :ok = HNSWLib.Index.mark_deleted(index, 8)
+    :ok = HNSWLib.Index.unmark_deleted(index, 8)
+
+    # a crash in the middle of a write leaves a torn record behind
+    File.write!(log_path, <<1, 2, 3>>, [:append])
+
+    {:ok, restored} = HNSWLib.Index.load_index(space, dim, log_path, log: true)
+    assert {:ok, 300} == HNSWLib.Index.get_current_count(restored)
+    assert HNSWLib.Index.get_ids_list(index) == HNSWLib.Index.get_ids_list(restored)
+    assert {:error, "Label not found"} == HNSWLib.Index.get_items(restored, [7])
+
+    {:ok, data} = HNSWLib.Index.get_items(restored, [8, 1099])
+    assert Nx.to_binary(data) == Nx.to_binary(Nx.stack([items[8], items[299]]))
+
+    # the restored index keeps appending to the log
+    :ok = HNSWLib.Index.mark_deleted(restored, 9)
+    assert :ok == HNSWLib.Index.compact_log(restored)
+    :ok = HNSWLib.Index.mark_deleted(restored, 10)
+    assert :ok == HNSWLib.Index.close_log(restored)
+    :ok = HNSWLib.Index.mark_deleted(restored, 11)
+
+    {:ok, restored} = HNSWLib.Index.load_index(space, dim, log_path)
+    assert {:error, "Label not found"} == HNSWLib.Index.get_items(restored, [9])
+    assert {:error, "Label not found"} == HNSWLib.Index.get_items(restored, [10])
+    assert {:ok, _} = HNSWLib.Index.get_items(restored, [11])
+
+    assert {:error, "The index has no log"} == HNSWLib.Index.compact_log(restored)
+
+    assert {:error, "The log was written for an index of another dimension"} ==
+             HNSWLib.Index.load_index(space, dim + 1, log_path)
+
+    # cleanup
+    File.rm(log_path)
+  end
+
+  test "HNSWLib.Index.load_index/3 replays replace_deleted records of a log" do
+    space = :l2
+    dim = 4
+    items = Nx.iota({20, dim}, type: :f32) |> Nx.sin()
+    log_path = Path.join([__DIR__, "replace_deleted.log"])
+    File.rm(log_path)
+
+    {:ok, index} = HNSWLib.Index.new(space, dim, 20, allow_replace_deleted: true)
+    :ok = HNSWLib.Index.add_items(index, items[0..9])
+    assert :ok == HNSWLib.Index.open_log(index, log_path)
+    :ok = HNSWLib.Index.mark_deleted(index, 3)
+    :ok = HNSWLib.Index.add_items(index, items[10..10], ids: [100], replace_deleted: true)
+    assert :ok == HNSWLib.Index.close_log(index)
+
+    # the replacement is replayed even when the index is loaded without it
+    {:ok, restored} = HNSWLib.Index.load_index(space, dim, log_path)
+    assert {:ok, 10} == HNSWLib.Index.get_current_count(restored)
+    assert HNSWLib.Index.get_ids_list(index) == HNSWLib.Index.get_ids_list(restored)
+
+    assert {:error, "Replacement of deleted elements is disabled in constructor"} ==
+             HNSWLib.Index.add_items(restored, items[11..11], replace_deleted: true)
+
+    # cleanup
+    File.rm(log_path)
+  end
+
+  test "HNSWLib.Index.open_log/3 stops logging after a partly applied batch" do
+    space = :l2
+    dim = 4
+    items = Nx.iota({12, dim}, type: :f32) |> Nx.sin()
+    log_path = Path.join([__DIR__, "partial_batch.log"])
+    File.rm(log_path)
+
+    {:ok, index} = HNSWLib.Index.new(space, dim, 10, auto_grow: false)
+    :ok = HNSWLib.Index.add_items(index, items[0..8])
+    assert :ok == HNSWLib.Index.open_log(index, log_path)
+
+    # the first row fits, the second one does not
+    assert {:error, "The number of elements exceeds the specified limit"} ==
+             HNSWLib.Index.add_items(index, items[9..11], ids: [9, 10, 11])
+
+    assert {:ok, 10} == HNSWLib.Index.get_current_count(index)
+
+    assert {:error, "The log could not be written, compact or close it before writing again"} ==
+             HNSWLib.Index.mark_deleted(index, 0)
+
+    assert :ok == HNSWLib.Index.compact_log(index)
+    assert :ok == HNSWLib.Index.mark_deleted(index, 0)
+    assert :ok == HNSWLib.Index.close_log(index)
+
+    {:ok, restored} = HNSWLib.Index.load_index(space, dim, log_path)
+    assert {:ok, 10} == HNSWLib.Index.get_current_count(restored)
+    assert HNSWLib.Index.get_ids_list(index) == HNSWLib.Index.get_ids_list(restored)
+
+    # cleanup
+    File.rm(log_path)
+  end
+
+  test "HNSWLib.Index.open_log/3 logs concurrent writes in the order they were applied" do
+    space = :l2
+    dim = 4
+    items = Nx.iota({200, dim}, type: :f32) |> Nx.sin()
+    log_path = Path.join([__DIR__, "concurrent_writes.log"])
+    File.rm(log_path)
+
+    {:ok, index} = HNSWLib.Index.new(space, dim, 200, concurrent_writes: true)
+    :ok = HNSWLib.Index.add_items(index, items[0..99])
+    assert :ok == HNSWLib.Index.open_log(index, log_path, sync: false)
+
+    # every writer flips the same labels, so only the order decides the outcome
+    writers =
+      for w <- 0..3 do
+        Task.async(fn ->
+          for i <- 0..49 do
+            label = rem(i, 10)
+
+            case HNSWLib.Index.mark_deleted(index, label) do
+              :ok -> :ok
+              {:error, _} -> :ok
+            end
+
+            case HNSWLib.Index.unmark_deleted(index, label) do
+              :ok -> :ok
+              {:error, _} -> :ok
+            end
+
+            first = 100 + w * 25 + rem(i, 25)
+            :ok = HNSWLib.Index.add_items(index, items[first..first], ids: [first])
+          end
+        end)
+      end
+
+    Task.await_many(writers, 60_000)
+    assert :ok == HNSWLib.Index.close_log(index)
+
+    {:ok, restored} = HNSWLib.Index.load_index(space, dim, log_path)
+    assert HNSWLib.Index.get_ids_list(index) == HNSWLib.Index.get_ids_list(restored)
+
+    for label <- 0..9 do
+      assert HNSWLib.Index.get_items(index, [label]) ==
+               HNSWLib.Index.get_items(restored, [label])
+    end
+
+    # cleanup
+    File.rm(log_path)
+  end
+
   test "HNSWLib.Index.mark_deleted/2" do
     space = :ip
     dim = 2
@@ -733,6 +1650,54 @@ defmodule HNSWLib.Index.Test do
              HNSWLib.Index.resize_index(index, max_elements)
   end
 
+  test "HNSWLib.Index.reorder/1" do
+    space = :l2
+    dim = 2
+    max_elements = 200
+    items = Nx.tensor([[10, 20], [30, 40], [50, 60], [70, 80]], type: :f32)
+    query = Nx.tensor([[29, 39], [71, 81]], type: :f32)
+    {:ok, index} = HNSWLib.Index.new(space, dim, max_elements)
+    assert :ok == HNSWLib.Index.add_items(index, items, ids: [5, 6, 7, 8])
+    assert :ok == HNSWLib.Index.mark_deleted(index, 7)
+    {:ok, labels, dists} = HNSWLib.Index.knn_query(index, query, k: 2)
+
+    assert :ok == HNSWLib.Index.reorder(index)
+    assert {:ok, labels, dists} == HNSWLib.Index.knn_query(index, query, k: 2)
+    assert {:ok, 4} == HNSWLib.Index.get_current_count(index)
+
+    {:ok, data} = HNSWLib.Index.get_items(index, [8, 5])
+    assert Nx.to_binary(data) == Nx.to_binary(Nx.stack([items[3], items[0]]))
+    assert {:error, "Label not found"} == HNSWLib.Index.get_items(index, [7])
+
+    assert :ok == HNSWLib.Index.add_items(index, Nx.tensor([[90, 100]], type: :f32), ids: [9])
+    {:ok, labels, _dists} = HNSWLib.Index.knn_query(index, Nx.tensor([91, 101], type: :f32))
+    assert 1 == Nx.to_number(Nx.all_close(labels, Nx.tensor([9])))
+  end
+
+  test "HNSWLib.Index.freeze/1" do
+    space = :l2
+    dim = 2
+    max_elements = 200
+    items = Nx.tensor([[10, 20], [30, 40], [50, 60]], type: :f32)
+    query = Nx.tensor([29, 39], type: :f32)
+    {:ok, index} = HNSWLib.Index.new(space, dim, max_elements)
+    assert :ok == HNSWLib.Index.add_items(index, items)
+    {:ok, labels, dists} = HNSWLib.Index.knn_query(index, query, k: 2)
+
+    assert :ok == HNSWLib.Index.freeze(index)
+    assert {:ok, 3} == HNSWLib.Index.get_max_elements(index)
+    assert {:ok, labels, dists} == HNSWLib.Index.knn_query(index, query, k: 2)
+
+    {:ok, data} = HNSWLib.Index.get_items(index, [2, 0])
+    assert Nx.to_binary(data) == Nx.to_binary(Nx.stack([items[2], items[0]]))
+
+    error = {:error, "The index is frozen and read-only"}
+    assert error == HNSWLib.Index.add_items(index, Nx.tensor([[70, 80]], type: :f32))
+    assert error == HNSWLib.Index.mark_deleted(index, 0)
+    assert error == HNSWLib.Index.resize_index(index, 400)
+    assert {:ok, 3} == HNSWLib.Index.get_current_count(index)
+  end
+
   test "HNSWLib.Index.get_max_elements/1" do
     space = :l2
     dim = 2